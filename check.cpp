@@ -1,33 +1,411 @@
-#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <algorithm>
 #include <fstream>
 #include <iostream>
+#include <vector>
 #include "vtf.h"
+#include "vtf-thread.h"
+
+
+static const char*
+operationToString (Vtf::Stats::Operation op)
+{
+	switch (op) {
+		case Vtf::Stats::OpLoad:	return "load";
+		case Vtf::Stats::OpDecode:	return "decode";
+		case Vtf::Stats::OpSave:	return "save";
+		default:					return "?";
+	}
+}
+
+
+static void
+print_stats (const Vtf::Stats& stats, const Vtf::File& vtf)
+{
+	std::cout << "Bytes read: " << stats.bytesRead << " in " << stats.readCalls << " reads" << std::endl
+			<< "Allocations: " << stats.allocCount << " (" << stats.allocBytes << " bytes)" << std::endl
+			<< "Header: " << stats.headerTime << " ns" << std::endl
+			<< "Load total: " << stats.totalTime << " ns" << std::endl
+			<< "Memory footprint: " << vtf.memoryUsage() << " bytes" << std::endl;
+	
+	std::cout << "op\tmip\tframe\tface\tslice\tbytes\talloc_ns\tio_ns\tdecode_ns" << std::endl;
+	for (std::vector<Vtf::Stats::Subimage>::const_iterator i = stats.subimages.begin();
+			i != stats.subimages.end(); ++i)
+		std::cout << operationToString(i->op) << "\t" << (int) i->mipmap << "\t"
+				<< i->frame << "\t" << i->face << "\t" << i->slice << "\t"
+				<< i->length << "\t" << i->allocTime << "\t" << i->ioTime << "\t"
+				<< i->decodeTime << std::endl;
+}
+
+
+/* Re-encodes the first subimage with every DXT tier, to help choosing
+	one per kind of asset */
+static void
+print_psnr (Vtf::HiresImageResource* img)
+{
+	uint8_t* rgba = img->getImageRGBA(0, 0, 0, 0);
+	if (!rgba)
+		return;
+	
+	uint16_t width = img->width(), height = img->height();
+	Vtf::Format format = img->format();
+	if (format != Vtf::FormatDXT1 && format != Vtf::FormatDXT1_1bitAlpha
+			&& format != Vtf::FormatDXT3 && format != Vtf::FormatDXT5) {
+		Vtf::ImageTraits traits;
+		Vtf::analyzeRGBA(rgba, width * height, traits);
+		format = traits.opaque ? Vtf::FormatDXT1 : Vtf::FormatDXT5;
+	}
+	
+	static const char* names[] = {"fast", "range", "cluster", "iterative"};
+	std::vector<uint8_t> encoded(Vtf::getImageLength(format, width, height));
+	std::vector<uint8_t> decoded(width * height * 4);
+	
+	std::cout << "tier\t" << Vtf::formatToString(format) << "_psnr_db\tmpix_per_s" << std::endl;
+	for (int q = Vtf::QualityFast; q <= Vtf::QualityIterative; q++) {
+		struct timespec t0, t1;
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		Vtf::packRGBA(rgba, format, &encoded[0], width, height, false, (Vtf::Quality) q);
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		
+		Vtf::convert(&encoded[0], format, &decoded[0], Vtf::FormatRGBA8888, width, height);
+		double secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) * 1e-9;
+		std::cout << names[q] << "\t"
+				<< Vtf::psnr(rgba, &decoded[0], width * height, format != Vtf::FormatDXT1)
+				<< "\t" << width * height / secs / 1e6 << std::endl;
+	}
+	
+	delete[] rgba;
+}
+
+
+/* Many threads decoding from one File at once, see the thread safety
+	notes in vtf.h. Every result is checked against a decode made before
+	the threads start; build with -fsanitize=thread to catch races. */
+
+#define STRESS_ROUNDS	200
+
+struct StressShared
+{
+	const Vtf::HiresImageResource* img;
+	std::vector<uint64_t> rgba;		/* per subimage, hash of the RGBA decode */
+	std::vector<uint64_t> alpha;	/* same, A8 */
+	uint32_t perMipmap;
+	Vtf::Mutex mutex;
+	unsigned int mismatches;
+};
+
+
+/* Mipmap and subimage of INDEX, counting subimages mipmap by mipmap */
+static uint8_t
+subimage_at (const Vtf::HiresImageResource* img, uint32_t index, uint16_t& frame,
+		uint16_t& face, uint16_t& slice)
+{
+	uint32_t per_mipmap = img->frameCount() * img->faceCount() * img->depth();
+	uint32_t i = index % per_mipmap;
+	slice = i % img->depth();
+	face = i / img->depth() % img->faceCount();
+	frame = i / img->depth() / img->faceCount();
+	return index / per_mipmap;
+}
+
+
+static uint64_t
+hash_decoded (uint8_t* data, std::size_t length)
+{
+	uint64_t hash = data ? Vtf::hash64(data, length) : 0;
+	delete[] data;
+	return hash;
+}
+
+
+class StressTask : public Vtf::Task
+{
+public:
+	StressTask(StressShared& shared, uint32_t seed) : m_Shared(shared), m_Seed(seed) {}
+	
+	void run()
+	{
+		const Vtf::HiresImageResource* img = m_Shared.img;
+		unsigned int bad = 0;
+		
+		for (int round = 0; round < STRESS_ROUNDS; round++) {
+			uint32_t index = next() % (m_Shared.perMipmap * img->mipmapCount());
+			uint16_t frame, face, slice;
+			uint8_t mm = subimage_at(img, index, frame, face, slice);
+			uint16_t width = std::max(img->width() >> mm, 1);
+			uint16_t height = std::max(img->height() >> mm, 1);
+			bool decodable = m_Shared.rgba[index] != 0;
+			
+			switch (next() % 4) {
+			case 0:
+				bad += hash_decoded(img->getImageRGBA(mm, frame, face, slice),
+						width * height * 4) != m_Shared.rgba[index];
+				break;
+			case 1:
+				bad += hash_decoded(img->getImageAs(Vtf::FormatA8, mm, frame, face, slice),
+						width * height) != m_Shared.alpha[index];
+				break;
+			case 2: {
+				/* a region, then the whole image it was cut from */
+				if (!decodable)
+					break;
+				uint16_t x = next() % width, y = next() % height;
+				uint16_t w = 1 + next() % (width - x), h = 1 + next() % (height - y);
+				std::vector<uint8_t> full(width * height * 4);
+				bad += !img->decodeRegion(mm, frame, face, slice, 0, 0, width, height,
+						&full[0], width * 4);
+				std::vector<uint8_t> part(w * h * 4);
+				bad += !img->decodeRegion(mm, frame, face, slice, x, y, w, h, &part[0], w * 4);
+				for (uint16_t row = 0; row < h; row++)
+					bad += memcmp(&part[row * w * 4], &full[((y + row) * width + x) * 4],
+							w * 4) != 0;
+				bad += Vtf::hash64(&full[0], full.size()) != m_Shared.rgba[index];
+				break;
+			}
+			default: {
+				Vtf::ImageStats stats;
+				bad += decodable && !Vtf::computeStats(img->getImage(mm, frame, face, slice),
+						img->format(), width, height, stats);
+				break;
+			}
+			}
+		}
+		
+		if (bad) {
+			Vtf::Lock lock(m_Shared.mutex);
+			m_Shared.mismatches += bad;
+		}
+	}
+	
+private:
+	uint32_t next()
+	{
+		m_Seed = m_Seed * 1103515245 + 12345;
+		return m_Seed >> 8;
+	}
+	
+	StressShared& m_Shared;
+	uint32_t m_Seed;
+};
+
+
+static bool
+stress (const Vtf::HiresImageResource* img, unsigned int threads)
+{
+	StressShared shared;
+	shared.img = img;
+	shared.perMipmap = img->frameCount() * img->faceCount() * img->depth();
+	shared.mismatches = 0;
+	
+	for (uint8_t mm = 0; mm < img->mipmapCount(); mm++) {
+		uint16_t width = std::max(img->width() >> mm, 1);
+		uint16_t height = std::max(img->height() >> mm, 1);
+		for (uint32_t i = 0; i < shared.perMipmap; i++) {
+			uint16_t slice = i % img->depth();
+			uint16_t face = i / img->depth() % img->faceCount();
+			uint16_t frame = i / img->depth() / img->faceCount();
+			shared.rgba.push_back(hash_decoded(img->getImageRGBA(mm, frame, face, slice),
+					width * height * 4));
+			shared.alpha.push_back(hash_decoded(img->getImageAs(Vtf::FormatA8, mm, frame,
+					face, slice), width * height));
+		}
+	}
+	
+	Vtf::ThreadPool pool(threads);
+	for (unsigned int i = 0; i < threads; i++)
+		pool.push(new StressTask(shared, i + 1));
+	pool.wait();
+	
+	std::cout << "Stress: " << threads << " threads, " << threads * STRESS_ROUNDS
+			<< " decodes, " << shared.mismatches << " mismatches" << std::endl;
+	return shared.mismatches == 0;
+}
+
+
+/* Encoding in parallel the way the exporters do: workers only write
+	buffers of their own, and setImage() is left to the calling thread. */
+struct EncodeShared
+{
+	const Vtf::HiresImageResource* img;
+	std::vector<uint8_t*> encoded;		/* per subimage, filled by one worker */
+	uint32_t next;
+	Vtf::Mutex mutex;
+};
+
+
+class EncodeTask : public Vtf::Task
+{
+public:
+	EncodeTask(EncodeShared& shared) : m_Shared(shared) {}
+	
+	void run()
+	{
+		const Vtf::HiresImageResource* img = m_Shared.img;
+		
+		for (;;) {
+			uint32_t index;
+			{
+				Vtf::Lock lock(m_Shared.mutex);
+				index = m_Shared.next++;
+			}
+			if (index >= m_Shared.encoded.size())
+				break;
+			
+			uint16_t frame, face, slice;
+			uint8_t mm = subimage_at(img, index, frame, face, slice);
+			uint8_t* rgba = img->getImageRGBA(mm, frame, face, slice);
+			try {
+				m_Shared.encoded[index] = Vtf::encodeImage(img->format(), rgba,
+						std::max(img->width() >> mm, 1), std::max(img->height() >> mm, 1),
+						false, Vtf::QualityFast);
+			} catch (std::exception&) {
+			}
+			delete[] rgba;
+		}
+	}
+	
+private:
+	EncodeShared& m_Shared;
+};
+
+
+static bool
+stress_encode (const Vtf::HiresImageResource* img, unsigned int threads)
+{
+	uint32_t count = img->frameCount() * img->faceCount() * img->depth() * img->mipmapCount();
+	std::vector<uint64_t> expected(count);
+	for (uint32_t i = 0; i < count; i++) {
+		uint16_t frame, face, slice;
+		uint8_t mm = subimage_at(img, i, frame, face, slice);
+		uint16_t width = std::max(img->width() >> mm, 1);
+		uint16_t height = std::max(img->height() >> mm, 1);
+		uint8_t* rgba = img->getImageRGBA(mm, frame, face, slice);
+		if (!rgba)
+			return true;
+		try {
+			expected[i] = hash_decoded(Vtf::encodeImage(img->format(), rgba, width, height,
+					false, Vtf::QualityFast), Vtf::getImageLength(img->format(), width, height));
+		} catch (std::exception&) {
+			/* not a format we encode */
+			delete[] rgba;
+			return true;
+		}
+		delete[] rgba;
+	}
+	
+	EncodeShared shared;
+	shared.img = img;
+	shared.encoded.resize(count, NULL);
+	shared.next = 0;
+	
+	Vtf::ThreadPool pool(threads);
+	for (unsigned int i = 0; i < threads; i++)
+		pool.push(new EncodeTask(shared));
+	pool.wait();
+	
+	Vtf::HiresImageResource copy;
+	copy.setup(img->format(), img->width(), img->height(), img->mipmapCount(),
+			img->frameCount(), img->faceCount(), img->depth());
+	unsigned int mismatches = 0;
+	for (uint32_t i = 0; i < count; i++) {
+		uint16_t frame, face, slice;
+		uint8_t mm = subimage_at(img, i, frame, face, slice);
+		uint8_t* data = shared.encoded[i];
+		mismatches += !data || Vtf::hash64(data, Vtf::getImageLength(img->format(),
+				std::max(img->width() >> mm, 1), std::max(img->height() >> mm, 1)))
+				!= expected[i];
+		if (data)
+			copy.setImage(mm, frame, face, slice, data);
+	}
+	mismatches += !copy.check();
+	
+	std::cout << "Encode: " << threads << " threads, " << count << " subimages, "
+			<< mismatches << " mismatches" << std::endl;
+	return mismatches == 0;
+}
 
 
 int main (int argc, char* argv[])
 {
-	assert(argc >= 2);
+	bool show_stats = false;
+	bool show_psnr = false;
+	unsigned int stress_threads = 0;
+	const char* cache_dir = NULL;
+	const char* fname = NULL;
+	Vtf::LoadOptions options;
+	
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--stats") == 0)
+			show_stats = true;
+		else if (strcmp(argv[i], "--psnr") == 0)
+			show_psnr = true;
+		else if (strcmp(argv[i], "--stress") == 0 && i + 1 < argc)
+			stress_threads = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--cache") == 0 && i + 1 < argc)
+			cache_dir = argv[++i];
+		else if (strcmp(argv[i], "--skip-mips") == 0 && i + 1 < argc)
+			options.skipTopMips = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--max-size") == 0 && i + 1 < argc)
+			options.maxDimension = atoi(argv[++i]);
+		else
+			fname = argv[i];
+	}
+	
+	if (!fname) {
+		std::cerr << "Usage: " << argv[0] << " [--stats] [--psnr] [--stress THREADS] [--cache DIR] [--skip-mips N] [--max-size N] FILE" << std::endl;
+		return 1;
+	}
 	
 	Vtf::File* vtf = new Vtf::File;
+	Vtf::Stats stats;
+	Vtf::Stats* pstats = show_stats ? &stats : NULL;
+	int ret = 0;
 	
 	try {
-		vtf->load(argv[1]);
+		vtf->load(fname, pstats, &options);
 		Vtf::HiresImageResource* img = dynamic_cast<Vtf::HiresImageResource*>(
 				vtf->findResource(Vtf::Resource::TypeHires));
-		std::cout << "Format: " << img->getFormat() << std::endl
-				<< "Width: " << img->getWidth() << std::endl
-				<< "Height: " << img->getHeight() << std::endl
-				<< "Depth: " << img->getDepth() << std::endl
-				<< "Frames: " << img->getFrameCount() << std::endl;
-		uint8_t* data = img->getImageRGBA(0, 0, 0, 0);
-		if (data)
-			delete[] data;
-	} catch (std::ifstream::failure e) {
+		if (!img)
+			throw Vtf::Exception("Could not find high-resolution image resource");
+		
+		std::cout << "Format: " << Vtf::formatToString(img->format()) << std::endl
+				<< "Width: " << img->width() << std::endl
+				<< "Height: " << img->height() << std::endl
+				<< "Depth: " << img->depth() << std::endl
+				<< "Frames: " << img->frameCount() << std::endl
+				<< "Mipmaps: " << (int) img->mipmapCount() << std::endl
+				<< "Unique subimages: " << img->uniqueCount() << std::endl;
+		if (cache_dir) {
+			Vtf::DiskCache cache(cache_dir, 256 * 1024 * 1024);
+			std::size_t length;
+			uint8_t* data = cache.getImage(img, Vtf::FormatRGBA8888, 0, 0, 0, 0, length);
+			Vtf::DiskCache::unmap(data, length);
+			std::cout << "Cache: " << (cache.hits() ? "hit" : "miss") << ", "
+					<< cache.size() << " bytes" << std::endl;
+		} else {
+			uint8_t* data = img->getImageRGBA(0, 0, 0, 0, pstats);
+			if (data)
+				delete[] data;
+		}
+		
+		if (show_stats)
+			print_stats(stats, *vtf);
+		if (show_psnr)
+			print_psnr(img);
+		if (stress_threads && !stress(img, stress_threads))
+			ret = 1;
+		if (stress_threads && !stress_encode(img, stress_threads))
+			ret = 1;
+	} catch (std::ifstream::failure& e) {
 		std::cout << "Exception opening/reading file" << std::endl;
+		ret = 1;
 	} catch (std::exception& e) {
 		std::cout << e.what() << std::endl;
+		ret = 1;
 	}
 	
 	delete vtf;
-	return 0;
+	return ret;
 }
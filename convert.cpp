@@ -0,0 +1,644 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <set>
+#include <gdk-pixbuf/gdk-pixbuf.h>
+#include "vtf.h"
+#include "vtf-thread.h"
+
+
+/* Converts images to VTF on one thread pool shared by all files. Each
+	file is loaded by one task, which then queues its mipmaps in strips of
+	block rows, so that a single large texture keeps every core busy as
+	well as a directory of small ones. Outputs whose source and options
+	did not change since the last run are skipped. */
+
+
+#define STAMPS_NAME			".vtf-convert-stamps"
+#define STAMPS_MAGIC		"vtf-convert 1"
+#define STRIP_PIXELS		65536		/* per encode task */
+#define PIXEL_BUDGET		(64 << 20)	/* decoded pixels held at once */
+
+
+struct Options
+{
+	Vtf::Format format;			/* FormatNone picks one per image */
+	uint32_t version;
+	bool mipmaps;
+	bool lowres;
+	bool crc;
+	bool dither;
+	bool lossless;				/* for FormatNone */
+	Vtf::Quality quality;
+	
+	/* anything that changes the output changes this */
+	uint64_t hash() const
+	{
+		char buf[128];
+		snprintf(buf, sizeof(buf), "format %u version %u mipmaps %d lowres %d crc %d "
+				"dither %d lossless %d quality %d", (unsigned int) format, version, mipmaps,
+				lowres, crc, dither, lossless, (int) quality);
+		return Vtf::hash64((const uint8_t*) buf, strlen(buf));
+	}
+};
+
+
+struct Stamp
+{
+	uint64_t options;
+	uint64_t mtime;
+	uint64_t size;
+};
+
+typedef std::map<std::string, Stamp> StampMap;	/* by output path */
+
+
+static void
+read_stamps (const std::string& fname, StampMap& stamps)
+{
+	FILE* fp = fopen(fname.c_str(), "r");
+	if (!fp)
+		return;
+	
+	char* line = NULL;
+	size_t size = 0;
+	ssize_t len = getline(&line, &size, fp);
+	bool ok = len > 0 && strncmp(line, STAMPS_MAGIC, strlen(STAMPS_MAGIC)) == 0;
+	
+	while (ok && (len = getline(&line, &size, fp)) > 0) {
+		unsigned long long options, mtime, length;
+		int path_start = 0;
+		if (line[len - 1] == '\n')
+			line[--len] = '\0';
+		if (sscanf(line, "%llx %llu %llu %n", &options, &mtime, &length, &path_start) < 3
+				|| path_start == 0 || !line[path_start])
+			continue;
+		
+		Stamp& stamp = stamps[line + path_start];
+		stamp.options = options;
+		stamp.mtime = mtime;
+		stamp.size = length;
+	}
+	
+	free(line);
+	fclose(fp);
+}
+
+
+static bool
+write_stamps (const std::string& fname, const StampMap& stamps)
+{
+	std::string tmp = fname + ".XXXXXX";
+	int fd = mkstemp(&tmp[0]);
+	FILE* fp = fd >= 0 ? fdopen(fd, "w") : NULL;
+	if (!fp) {
+		if (fd >= 0) {
+			close(fd);
+			unlink(tmp.c_str());
+		}
+		return false;
+	}
+	
+	fprintf(fp, STAMPS_MAGIC "\n");
+	for (StampMap::const_iterator i = stamps.begin(); i != stamps.end(); ++i)
+		fprintf(fp, "%016llx %llu %llu %s\n", (unsigned long long) i->second.options,
+				(unsigned long long) i->second.mtime, (unsigned long long) i->second.size,
+				i->first.c_str());
+	
+	if (fclose(fp) != 0 || rename(tmp.c_str(), fname.c_str()) < 0) {
+		unlink(tmp.c_str());
+		return false;
+	}
+	return true;
+}
+
+
+static bool
+parse_format (const char* name, Vtf::Format& format)
+{
+	if (strcasecmp(name, "auto") == 0) {
+		format = Vtf::FormatNone;
+		return true;
+	}
+	
+	for (uint32_t i = Vtf::FormatRGBA8888; i <= Vtf::FormatUVLX8888; i++) {
+		if (strcasecmp(name, Vtf::formatToString((Vtf::Format) i)) == 0) {
+			format = (Vtf::Format) i;
+			return true;
+		}
+	}
+	return false;
+}
+
+
+static bool
+parse_quality (const char* name, Vtf::Quality& quality)
+{
+	static const char* names[] = {"fast", "range", "cluster", "iterative"};
+	for (int i = 0; i < 4; i++) {
+		if (strcasecmp(name, names[i]) == 0) {
+			quality = (Vtf::Quality) i;
+			return true;
+		}
+	}
+	return false;
+}
+
+
+/* SRC with its directory and extension replaced */
+static std::string
+output_path (const std::string& src, const std::string& outdir)
+{
+	std::string::size_type slash = src.rfind('/');
+	std::string dir = slash == std::string::npos ? "" : src.substr(0, slash + 1);
+	std::string name = slash == std::string::npos ? src : src.substr(slash + 1);
+	
+	std::string::size_type dot = name.rfind('.');
+	if (dot != std::string::npos && dot > 0)
+		name.erase(dot);
+	
+	if (!outdir.empty())
+		dir = outdir + "/";
+	return dir + name + ".vtf";
+}
+
+
+class Converter;
+
+
+/* One source file on its way through the pool */
+struct Job
+{
+	Converter* conv;
+	std::string src;
+	std::string dst;
+	Stamp stamp;
+	
+	Vtf::File* vtf;
+	Vtf::HiresImageResource* vres;
+	std::vector<std::vector<uint8_t> > levels;	/* RGBA of each mipmap */
+	uint32_t pixels;
+	unsigned int pending;		/* encode tasks left */
+	bool failed;
+};
+
+
+class Converter
+{
+public:
+	Converter(const Options& options, unsigned int threads)
+		: m_Options(options), m_InFlight(0), m_Pixels(0), m_Converted(0), m_Failed(0),
+		m_Pool(threads)
+		{}
+	
+	void convert(const std::string& src, const std::string& dst, const Stamp& stamp);
+	void wait();
+	
+	/* called from the tasks */
+	void load(Job* job);
+	void encode(Job* job, uint8_t mipmap, uint32_t y, uint32_t rows);
+	
+	inline StampMap& stamps()
+		{return m_Stamps;}
+	inline unsigned int converted() const
+		{return m_Converted;}
+	inline unsigned int failed() const
+		{return m_Failed;}
+
+private:
+	void fail(Job* job, const std::string& message);
+	void finish(Job* job);
+	void save(Job* job);
+	
+	Options m_Options;
+	Vtf::Mutex m_Mutex;
+	Vtf::Cond m_Done;
+	unsigned int m_InFlight;
+	uint64_t m_Pixels;
+	unsigned int m_Converted;
+	unsigned int m_Failed;
+	StampMap m_Stamps;
+	Vtf::ThreadPool m_Pool;		/* last, its workers go first */
+};
+
+
+class LoadTask : public Vtf::Task
+{
+public:
+	LoadTask(Job* job) : m_Job(job) {}
+	void run()
+		{m_Job->conv->load(m_Job);}
+
+private:
+	Job* m_Job;
+};
+
+
+class EncodeTask : public Vtf::Task
+{
+public:
+	EncodeTask(Job* job, uint8_t mipmap, uint32_t y, uint32_t rows)
+		: m_Job(job), m_Mipmap(mipmap), m_Y(y), m_Rows(rows) {}
+	void run()
+		{m_Job->conv->encode(m_Job, m_Mipmap, m_Y, m_Rows);}
+
+private:
+	Job* m_Job;
+	uint8_t m_Mipmap;
+	uint32_t m_Y;
+	uint32_t m_Rows;
+};
+
+
+/* Bounds the files in flight, by count and by decoded size, so that a
+	long list of sources does not get loaded all at once */
+void Converter::convert(const std::string& src, const std::string& dst, const Stamp& stamp)
+{
+	Job* job = new Job;
+	job->conv = this;
+	job->src = src;
+	job->dst = dst;
+	job->stamp = stamp;
+	job->vtf = NULL;
+	job->vres = NULL;
+	job->pixels = 0;
+	job->pending = 0;
+	job->failed = false;
+	
+	Vtf::Lock lock(m_Mutex);
+	while (m_InFlight > 0 && (m_InFlight >= 2 * m_Pool.threadCount()
+			|| m_Pixels >= PIXEL_BUDGET))
+		m_Done.wait(m_Mutex);
+	m_InFlight++;
+	m_Pool.push(new LoadTask(job));
+}
+
+
+void Converter::wait()
+{
+	m_Pool.wait();
+}
+
+
+void Converter::fail(Job* job, const std::string& message)
+{
+	Vtf::Lock lock(m_Mutex);
+	std::cerr << job->src << ": " << message << std::endl;
+	job->failed = true;
+}
+
+
+static bool
+is_power_of_two (int n)
+{
+	return n > 0 && !(n & (n - 1));
+}
+
+
+void Converter::load(Job* job)
+{
+	GError* error = NULL;
+	GdkPixbuf* pixbuf = gdk_pixbuf_new_from_file(job->src.c_str(), &error);
+	if (!pixbuf) {
+		fail(job, error->message);
+		g_error_free(error);
+		finish(job);
+		return;
+	}
+	
+	int width = gdk_pixbuf_get_width(pixbuf);
+	int height = gdk_pixbuf_get_height(pixbuf);
+	int channels = gdk_pixbuf_get_n_channels(pixbuf);
+	int rowstride = gdk_pixbuf_get_rowstride(pixbuf);
+	const guchar* pixels = gdk_pixbuf_get_pixels(pixbuf);
+	
+	if (width > 0xffff || height > 0xffff || !is_power_of_two(width)
+			|| !is_power_of_two(height)) {
+		fail(job, "Image dimensions must be powers of 2");
+		g_object_unref(pixbuf);
+		finish(job);
+		return;
+	}
+	if (gdk_pixbuf_get_bits_per_sample(pixbuf) != 8 || (channels != 3 && channels != 4)) {
+		fail(job, "Only 8 bit RGB and RGBA images are supported");
+		g_object_unref(pixbuf);
+		finish(job);
+		return;
+	}
+	
+	try {
+		uint8_t mipmaps = m_Options.mipmaps ? Vtf::calcMipmapCount(width, height) : 1;
+		job->levels.resize(mipmaps);
+		
+		std::vector<uint8_t>& rgba = job->levels[0];
+		rgba.resize((std::size_t) width * height * 4);
+		for (int y = 0; y < height; y++) {
+			const guchar* row = pixels + y * rowstride;
+			uint8_t* dst = &rgba[(std::size_t) y * width * 4];
+			if (channels == 4) {
+				memcpy(dst, row, width * 4);
+			} else {
+				for (int x = 0; x < width; x++) {
+					dst[x * 4 + 0] = row[x * 3 + 0];
+					dst[x * 4 + 1] = row[x * 3 + 1];
+					dst[x * 4 + 2] = row[x * 3 + 2];
+					dst[x * 4 + 3] = 255;
+				}
+			}
+		}
+		g_object_unref(pixbuf);
+		pixbuf = NULL;
+		
+		/* the alpha flags follow the image even if the format is forced */
+		Vtf::ImageTraits traits;
+		uint32_t flags = 0;
+		Vtf::analyzeRGBA(&rgba[0], width * height, traits);
+		Vtf::Format format = Vtf::chooseFormat(traits, flags, m_Options.lossless);
+		if (m_Options.format != Vtf::FormatNone)
+			format = m_Options.format;
+		
+		job->vtf = new Vtf::File;
+		job->vres = new Vtf::HiresImageResource;
+		job->vtf->addResource(job->vres);
+		job->vres->setup(format, width, height, mipmaps, 1, 1, 1);
+		job->vtf->setFlags(flags);
+		
+		uint32_t total = 0;
+		for (uint8_t mm = 0; mm < mipmaps; mm++) {
+			uint16_t w = std::max(width >> mm, 1);
+			uint16_t h = std::max(height >> mm, 1);
+			if (mm > 0) {
+				job->levels[mm].resize((std::size_t) w * h * 4);
+				Vtf::resample(&job->levels[mm - 1][0], std::max(width >> (mm - 1), 1),
+						std::max(height >> (mm - 1), 1), &job->levels[mm][0], w, h,
+						Vtf::FilterBox);
+			}
+			
+			uint32_t length = Vtf::getImageLength(format, w, h);
+			if (length == 0)
+				throw Vtf::Exception(std::string("Could not encode to ")
+						+ Vtf::formatToString(format));
+			job->vres->setImage(mm, 0, 0, 0, new uint8_t[length]);
+			total += w * h;
+		}
+		
+		if (m_Options.lowres || m_Options.version < 3) {
+			Vtf::LowresImageResource* lowres = new Vtf::LowresImageResource;
+			job->vtf->addResource(lowres);
+			int lw = std::min(width, 16), lh = std::min(height, 16);
+			if (width > height)
+				lh = std::max(lw * height / width, 1);
+			else if (height > width)
+				lw = std::max(lh * width / height, 1);
+			std::vector<uint8_t> small(lw * lh * 4);
+			Vtf::resample(&rgba[0], width, height, &small[0], lw, lh, Vtf::FilterBox);
+			lowres->setup(Vtf::FormatDXT1, lw, lh);
+			lowres->setImageRGBA(&small[0]);
+		}
+		
+		/* strips of whole block rows, so that every strip encodes on its
+			own into its part of the mipmap */
+		std::vector<EncodeTask*> tasks;
+		for (uint8_t mm = 0; mm < mipmaps; mm++) {
+			uint16_t w = std::max(width >> mm, 1);
+			uint16_t h = std::max(height >> mm, 1);
+			uint32_t rows = std::max<uint32_t>(4, (STRIP_PIXELS / w) & ~3u);
+			for (uint32_t y = 0; y < h; y += rows)
+				tasks.push_back(new EncodeTask(job, mm, y, std::min<uint32_t>(rows, h - y)));
+		}
+		
+		{
+			Vtf::Lock lock(m_Mutex);
+			job->pending = tasks.size();
+			job->pixels = total;
+			m_Pixels += total;
+		}
+		for (std::size_t i = 0; i < tasks.size(); i++)
+			m_Pool.push(tasks[i]);
+	} catch (std::exception& e) {
+		if (pixbuf)
+			g_object_unref(pixbuf);
+		fail(job, e.what());
+		finish(job);
+	}
+}
+
+
+void Converter::encode(Job* job, uint8_t mipmap, uint32_t y, uint32_t rows)
+{
+	Vtf::HiresImageResource* vres = job->vres;
+	Vtf::Format format = vres->format();
+	uint16_t width = std::max(vres->width() >> mipmap, 1);
+	const uint8_t* rgba = &job->levels[mipmap][(std::size_t) y * width * 4];
+	uint8_t* dst = vres->getImage(mipmap, 0, 0, 0) + Vtf::getImageLength(format, width, y);
+	
+	try {
+		if (!Vtf::packRGBA(rgba, format, dst, width, rows, m_Options.dither,
+				m_Options.quality))
+			fail(job, std::string("Could not encode to ") + Vtf::formatToString(format));
+	} catch (std::exception& e) {
+		fail(job, e.what());
+	}
+	
+	bool last;
+	{
+		Vtf::Lock lock(m_Mutex);
+		last = --job->pending == 0;
+	}
+	if (last)
+		finish(job);
+}
+
+
+/* Written aside and renamed, so a failed run never leaves a partial
+	VTF that a later run would take as up to date */
+void Converter::save(Job* job)
+{
+	try {
+		std::vector<std::vector<uint8_t> >().swap(job->levels);
+		
+		if (m_Options.crc && m_Options.version >= 3) {
+			Vtf::CRCResource* crc = new Vtf::CRCResource;
+			crc->set(job->vres->checksum());
+			job->vtf->addResource(crc);
+		}
+		
+		std::string tmp = job->dst + ".tmp";
+		std::ofstream stm(tmp.c_str(), std::ios::binary);
+		if (!stm.is_open())
+			throw Vtf::Exception(std::string("Could not create ") + tmp + ": "
+					+ strerror(errno));
+		job->vtf->save(stm, m_Options.version);
+		stm.close();
+		if (stm.fail() || rename(tmp.c_str(), job->dst.c_str()) < 0) {
+			unlink(tmp.c_str());
+			throw Vtf::Exception(std::string("Could not write ") + job->dst);
+		}
+	} catch (std::exception& e) {
+		fail(job, e.what());
+	}
+}
+
+
+void Converter::finish(Job* job)
+{
+	if (!job->failed && job->vtf)
+		save(job);
+	delete job->vtf;
+	
+	Vtf::Lock lock(m_Mutex);
+	if (job->failed) {
+		m_Stamps.erase(job->dst);
+		m_Failed++;
+	} else {
+		m_Stamps[job->dst] = job->stamp;
+		m_Converted++;
+	}
+	m_Pixels -= job->pixels;
+	m_InFlight--;
+	m_Done.signal();
+	delete job;
+}
+
+
+static void
+usage (const char* prog)
+{
+	std::cerr << "Usage: " << prog << " [-o DIR] [--format NAME] [--version N] "
+			"[--quality fast|range|cluster|iterative] [--dither] [--lossless] [--no-mipmaps] "
+			"[--no-lowres] [--no-crc] [--jobs N] [--force] IMAGE..." << std::endl;
+}
+
+
+int main (int argc, char* argv[])
+{
+	Options options;
+	options.format = Vtf::FormatNone;
+	options.version = 4;
+	options.mipmaps = true;
+	options.lowres = true;
+	options.crc = true;
+	options.dither = false;
+	options.lossless = false;
+	options.quality = Vtf::QualityCluster;
+	
+	std::string outdir;
+	unsigned int jobs = 0;
+	bool force = false;
+	std::vector<std::string> sources;
+	
+	for (int i = 1; i < argc; i++) {
+		const char* arg = argv[i];
+		bool has_value = i + 1 < argc;
+		
+		if (strcmp(arg, "-o") == 0 && has_value) {
+			outdir = argv[++i];
+		} else if (strcmp(arg, "--format") == 0 && has_value) {
+			if (!parse_format(argv[++i], options.format)) {
+				std::cerr << "Unknown format: " << argv[i] << std::endl;
+				return 1;
+			}
+		} else if (strcmp(arg, "--version") == 0 && has_value) {
+			options.version = atoi(argv[++i]);
+			if (options.version > 4) {
+				std::cerr << "Version must be between 0 and 4" << std::endl;
+				return 1;
+			}
+		} else if (strcmp(arg, "--quality") == 0 && has_value) {
+			if (!parse_quality(argv[++i], options.quality)) {
+				std::cerr << "Unknown quality: " << argv[i] << std::endl;
+				return 1;
+			}
+		} else if (strcmp(arg, "--dither") == 0) {
+			options.dither = true;
+		} else if (strcmp(arg, "--lossless") == 0) {
+			options.lossless = true;
+		} else if (strcmp(arg, "--no-mipmaps") == 0) {
+			options.mipmaps = false;
+		} else if (strcmp(arg, "--no-lowres") == 0) {
+			options.lowres = false;
+		} else if (strcmp(arg, "--no-crc") == 0) {
+			options.crc = false;
+		} else if (strcmp(arg, "--jobs") == 0 && has_value) {
+			jobs = atoi(argv[++i]);
+		} else if (strcmp(arg, "--force") == 0) {
+			force = true;
+		} else if (arg[0] == '-') {
+			usage(argv[0]);
+			return 1;
+		} else {
+			sources.push_back(arg);
+		}
+	}
+	
+	if (sources.empty()) {
+		usage(argv[0]);
+		return 1;
+	}
+	
+	while (outdir.size() > 1 && outdir[outdir.size() - 1] == '/')
+		outdir.erase(outdir.size() - 1);
+	if (!outdir.empty() && mkdir(outdir.c_str(), 0777) < 0 && errno != EEXIST) {
+		std::cerr << outdir << ": " << strerror(errno) << std::endl;
+		return 1;
+	}
+	
+	std::string stamps_name = (outdir.empty() ? std::string(".") : outdir) + "/" STAMPS_NAME;
+	StampMap old_stamps;
+	read_stamps(stamps_name, old_stamps);
+	
+	uint64_t options_hash = options.hash();
+	unsigned int skipped = 0, failed = 0;
+	std::set<std::string> outputs;
+	Converter conv(options, jobs);
+	conv.stamps() = old_stamps;
+	
+	for (std::size_t i = 0; i < sources.size(); i++) {
+		const std::string& src = sources[i];
+		std::string dst = output_path(src, outdir);
+		
+		struct stat st, dst_st;
+		if (stat(src.c_str(), &st) < 0) {
+			std::cerr << src << ": " << strerror(errno) << std::endl;
+			failed++;
+			continue;
+		}
+		if (!outputs.insert(dst).second) {
+			std::cerr << src << ": Another source already writes " << dst << std::endl;
+			failed++;
+			continue;
+		}
+		
+		Stamp stamp;
+		stamp.options = options_hash;
+		stamp.mtime = st.st_mtime;
+		stamp.size = st.st_size;
+		
+		StampMap::const_iterator old = old_stamps.find(dst);
+		if (!force && old != old_stamps.end() && old->second.options == stamp.options
+				&& old->second.mtime == stamp.mtime && old->second.size == stamp.size
+				&& stat(dst.c_str(), &dst_st) == 0) {
+			skipped++;
+			continue;
+		}
+		
+		conv.convert(src, dst, stamp);
+	}
+	conv.wait();
+	
+	if (!write_stamps(stamps_name, conv.stamps()))
+		std::cerr << stamps_name << ": Could not write stamps: " << strerror(errno) << std::endl;
+	
+	failed += conv.failed();
+	std::cerr << conv.converted() << " converted, " << skipped << " up to date, "
+			<< failed << " failed" << std::endl;
+	return failed ? 1 : 0;
+}
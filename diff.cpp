@@ -0,0 +1,149 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <iostream>
+#include "vtf.h"
+
+
+/* Exit status as with diff(1): 0 if the images match, 1 if they differ,
+	2 on trouble */
+
+
+static Vtf::HiresImageResource*
+open_vtf (Vtf::File& vtf, const char* fname)
+{
+	Vtf::Status status = vtf.tryLoad(std::string(fname));
+	if (status != Vtf::StatusOk) {
+		std::cerr << fname << ": " << Vtf::statusToString(status) << std::endl;
+		return NULL;
+	}
+	
+	Vtf::HiresImageResource* img = static_cast<Vtf::HiresImageResource*>(
+			vtf.findResource(Vtf::Resource::TypeHires));
+	if (!img)
+		std::cerr << fname << ": Could not find high-resolution image resource" << std::endl;
+	return img;
+}
+
+
+static void
+print_mask (const Vtf::BlockDiff& diff)
+{
+	for (uint32_t by = 0; by < diff.blocksHigh; by++) {
+		std::cout << "  ";
+		for (uint32_t bx = 0; bx < diff.blocksWide; bx++)
+			std::cout << (diff.changed[by * diff.blocksWide + bx] ? '#' : '.');
+		std::cout << std::endl;
+	}
+}
+
+
+/* Compares one subimage. Same format: block by block as stored,
+	otherwise both decoded to RGBA first. */
+static int
+diff_subimage (Vtf::HiresImageResource* a, Vtf::HiresImageResource* b, uint8_t mipmap,
+		uint16_t frame, uint16_t face, uint16_t slice, bool show_mask)
+{
+	uint16_t width = std::max(a->width() >> mipmap, 1);
+	uint16_t height = std::max(a->height() >> mipmap, 1);
+	Vtf::BlockDiff diff;
+	bool ok;
+	
+	if (a->format() == b->format()) {
+		ok = Vtf::diffImages(a->getImage(mipmap, frame, face, slice),
+				b->getImage(mipmap, frame, face, slice), a->format(), width, height, diff);
+	} else {
+		uint8_t* rgba_a = a->getImageRGBA(mipmap, frame, face, slice);
+		uint8_t* rgba_b = b->getImageRGBA(mipmap, frame, face, slice);
+		ok = rgba_a && rgba_b && Vtf::diffImages(rgba_a, rgba_b, Vtf::FormatRGBA8888,
+				width, height, diff);
+		delete[] rgba_a;
+		delete[] rgba_b;
+	}
+	
+	if (!ok) {
+		std::cerr << "Format " << Vtf::formatToString(a->format())
+				<< " is not supported" << std::endl;
+		return 2;
+	}
+	if (!diff.changedCount)
+		return 0;
+	
+	std::cout << "mip " << (int) mipmap << " frame " << frame << " face " << face
+			<< " slice " << slice << ": " << diff.changedCount << "/"
+			<< diff.blocksWide * diff.blocksHigh << " blocks, box " << diff.x0 << ","
+			<< diff.y0 << " " << diff.x1 - diff.x0 << "x" << diff.y1 - diff.y0
+			<< ", max error " << (int) diff.maxError;
+	if (isinf(diff.psnr))
+		std::cout << ", identical pixels" << std::endl;
+	else
+		std::cout << ", psnr " << diff.psnr << " dB" << std::endl;
+	
+	if (show_mask)
+		print_mask(diff);
+	return 1;
+}
+
+
+int main (int argc, char* argv[])
+{
+	bool show_mask = false;
+	const char* fnames[2] = {NULL, NULL};
+	int nfiles = 0;
+	
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--mask") == 0)
+			show_mask = true;
+		else if (nfiles < 2)
+			fnames[nfiles++] = argv[i];
+	}
+	
+	if (nfiles != 2) {
+		std::cerr << "Usage: " << argv[0] << " [--mask] OLD NEW" << std::endl;
+		return 2;
+	}
+	
+	Vtf::File vtf_a, vtf_b;
+	Vtf::HiresImageResource* a = open_vtf(vtf_a, fnames[0]);
+	Vtf::HiresImageResource* b = open_vtf(vtf_b, fnames[1]);
+	if (!a || !b)
+		return 2;
+	
+	if (a->width() != b->width() || a->height() != b->height()) {
+		std::cout << "Dimensions differ: " << a->width() << "x" << a->height() << " and "
+				<< b->width() << "x" << b->height() << std::endl;
+		return 1;
+	}
+	
+	int ret = 0;
+	if (a->format() != b->format()) {
+		std::cout << "Formats differ: " << Vtf::formatToString(a->format()) << " and "
+				<< Vtf::formatToString(b->format()) << ", comparing pixels" << std::endl;
+	}
+	if (a->mipmapCount() != b->mipmapCount() || a->frameCount() != b->frameCount()
+			|| a->faceCount() != b->faceCount() || a->depth() != b->depth()) {
+		std::cout << "Layout differs, comparing the common subimages" << std::endl;
+		ret = 1;
+	}
+	
+	uint8_t mipmaps = std::min(a->mipmapCount(), b->mipmapCount());
+	uint16_t frames = std::min(a->frameCount(), b->frameCount());
+	uint16_t faces = std::min(a->faceCount(), b->faceCount());
+	uint16_t slices = std::min(a->depth(), b->depth());
+	
+	for (uint8_t mm = 0; mm < mipmaps; mm++) {
+		for (uint16_t fr = 0; fr < frames; fr++) {
+			for (uint16_t fc = 0; fc < faces; fc++) {
+				for (uint16_t sl = 0; sl < slices; sl++) {
+					int r = diff_subimage(a, b, mm, fr, fc, sl, show_mask);
+					if (r == 2)
+						return 2;
+					ret = std::max(ret, r);
+				}
+			}
+		}
+	}
+	
+	return ret;
+}
@@ -22,41 +22,516 @@
 
 
 
-#include <memory>
+#include <stdlib.h>
 #include <gdk-pixbuf/gdk-pixbuf.h>
 #include "vtf.h"
 
 
 typedef struct _LoadContext {
 	GByteArray *buffer;
+	GdkPixbufModuleSizeFunc size;
 	GdkPixbufModulePreparedFunc prepared;
+	GdkPixbufModuleUpdatedFunc updated;
 	gpointer udata;
 } LoadContext;
 
 
+
+/* Animation that decodes frames on demand from the compressed data kept
+	in the Vtf::File. Only the last few decoded frames are cached, and the
+	frame following the one shown is decoded ahead on a worker thread. */
+
+#define VTF_ANIM_CACHE_SIZE		3
+#define VTF_ANIM_DELAY			100		/* ms, VTF does not store a frame rate */
+
+typedef struct _CachedFrame {
+	gint frame;
+	GdkPixbuf *pixbuf;
+} CachedFrame;
+
+typedef struct _GdkPixbufVtfAnim {
+	GdkPixbufAnimation parent;
+	
+	Vtf::File *vtf;
+	Vtf::HiresImageResource *vres;
+	guint8 mipmap;
+	gboolean has_alpha;
+	gint width, height, frames;
+	GdkPixbuf *first;
+	
+	GMutex lock;
+	CachedFrame cache[VTF_ANIM_CACHE_SIZE];
+	guint cache_next;
+	GThreadPool *prefetch;
+	gint prefetch_frame;		/* latest frame asked for, under lock */
+	gboolean prefetch_queued;
+} GdkPixbufVtfAnim;
+
+typedef struct _GdkPixbufVtfAnimClass {
+	GdkPixbufAnimationClass parent_class;
+} GdkPixbufVtfAnimClass;
+
+typedef struct _GdkPixbufVtfAnimIter {
+	GdkPixbufAnimationIter parent;
+	
+	GdkPixbufVtfAnim *anim;
+	GTimeVal start;
+	gint elapsed;
+	gint frame;
+	GdkPixbuf *pixbuf;
+} GdkPixbufVtfAnimIter;
+
+typedef struct _GdkPixbufVtfAnimIterClass {
+	GdkPixbufAnimationIterClass parent_class;
+} GdkPixbufVtfAnimIterClass;
+
+
+G_DEFINE_TYPE (GdkPixbufVtfAnim, gdk_pixbuf_vtf_anim, GDK_TYPE_PIXBUF_ANIMATION);
+G_DEFINE_TYPE (GdkPixbufVtfAnimIter, gdk_pixbuf_vtf_anim_iter, GDK_TYPE_PIXBUF_ANIMATION_ITER);
+
+
+static void
+free_rgba (guchar *pixels, gpointer data)
+{
+	delete[] pixels;
+}
+
+
+static void
+unmap_pixels (guchar *pixels, gpointer data)
+{
+	Vtf::DiskCache::unmap (pixels, GPOINTER_TO_SIZE (data));
+}
+
+
+/* Decoded frames are kept across processes when VTF_CACHE_DIR is set */
+#define VTF_CACHE_BUDGET		(256 * 1024 * 1024)
+
+static Vtf::DiskCache *vtf_disk_cache = NULL;
+
+
+/* The cache writes its index every so often by itself; this catches what
+	is left when the process exits, instead of a write per image */
+static void
+vtf_flush_cache (void)
+{
+	vtf_disk_cache->flush ();
+}
+
+
+static Vtf::DiskCache *
+vtf_get_cache (void)
+{
+	static gsize init = 0;
+	
+	if (g_once_init_enter (&init)) {
+		const gchar *dir = g_getenv ("VTF_CACHE_DIR");
+		if (dir && *dir) {
+			try {
+				vtf_disk_cache = new Vtf::DiskCache (dir, VTF_CACHE_BUDGET);
+				atexit (vtf_flush_cache);
+			} catch (std::exception& e) {
+				g_warning ("%s", e.what ());
+			}
+		}
+		g_once_init_leave (&init, 1);
+	}
+	return vtf_disk_cache;
+}
+
+
+/* Opaque textures are decoded straight to 3 channels, which saves a
+	quarter of the memory and lets consumers skip alpha compositing.
+	All frames of an animation share one layout. */
+static gboolean
+vtf_has_alpha (Vtf::HiresImageResource *vres, guint8 mipmap)
+{
+	for (gint frame = 0; frame < vres->frameCount (); frame++)
+		if (!vres->isOpaque (mipmap, frame, 0, 0))
+			return TRUE;
+	return FALSE;
+}
+
+
 static GdkPixbuf *
-gdk_pixbuf__vtf_image_load (FILE *fd, GError **error)
+vtf_decode_frame (Vtf::HiresImageResource *vres, gint frame, guint8 mipmap,
+		gboolean has_alpha)
+{
+	Vtf::Format format = has_alpha ? Vtf::FormatRGBA8888 : Vtf::FormatRGB888;
+	gint width = MAX (vres->width () >> mipmap, 1);
+	gint height = MAX (vres->height () >> mipmap, 1);
+	gint channels = has_alpha ? 4 : 3;
+	
+	Vtf::DiskCache *cache = vtf_get_cache ();
+	if (cache) {
+		std::size_t length;
+		uint8_t *data = cache->getImage (vres, format, mipmap, frame, 0, 0, length);
+		if (!data)
+			return NULL;
+		return gdk_pixbuf_new_from_data (data, GDK_COLORSPACE_RGB, has_alpha, 8,
+				width, height, width * channels, unmap_pixels, GSIZE_TO_POINTER (length));
+	}
+	
+	uint8_t *data = vres->getImageAs (format, mipmap, frame, 0, 0);
+	if (!data)
+		return NULL;
+	return gdk_pixbuf_new_from_data (data, GDK_COLORSPACE_RGB,
+			has_alpha, 8, width, height, width * channels, free_rgba, NULL);
+}
+
+
+static GdkPixbuf *
+vtf_decode_lowres (Vtf::LowresImageResource *lres)
+{
+	gboolean has_alpha = !lres->isOpaque ();
+	uint8_t *data = lres->getImageAs (has_alpha ? Vtf::FormatRGBA8888 : Vtf::FormatRGB888);
+	if (!data)
+		return NULL;
+	
+	gint width = lres->width ();
+	gint height = lres->height ();
+	gint channels = has_alpha ? 4 : 3;
+	return gdk_pixbuf_new_from_data (data, GDK_COLORSPACE_RGB,
+			has_alpha, 8, width, height, width * channels, free_rgba, NULL);
+}
+
+
+/* Returns a new reference to the decoded frame */
+static GdkPixbuf *
+vtf_anim_get_frame (GdkPixbufVtfAnim *anim, gint frame)
 {
 	GdkPixbuf *pixbuf = NULL;
-	std::auto_ptr<Vtf::File> vtf(new Vtf::File);
-	
-	try {
-		vtf->load(fd);
-		
-		Vtf::HiresImageResource* vres = static_cast<Vtf::HiresImageResource*> (
-				vtf->findResource(Vtf::Resource::TypeHires));
-		if (!vres)
-			throw Vtf::Exception ("Could not find high-resolution image resource");
-		
-		uint8_t* data = vres->getImageRGBA (0, 0, 0, 0);
-		gint width = vres->width ();
-		gint height = vres->height ();
-		pixbuf = gdk_pixbuf_new_from_data (data, GDK_COLORSPACE_RGB,
-				TRUE, 8, width, height, width * 4, NULL, NULL);
-	} catch (std::exception& e) {
-		g_set_error (error, 0, 0, e.what());
+	guint i;
+	
+	/* repeated frames share one decoded pixbuf */
+	guint16 original = frame, face = 0, slice = 0;
+	anim->vres->findOriginal (anim->mipmap, original, face, slice);
+	frame = original;
+	
+	g_mutex_lock (&anim->lock);
+	for (i = 0; i < VTF_ANIM_CACHE_SIZE; i++)
+		if (anim->cache[i].frame == frame) {
+			pixbuf = GDK_PIXBUF (g_object_ref (anim->cache[i].pixbuf));
+			break;
+		}
+	g_mutex_unlock (&anim->lock);
+	
+	if (pixbuf)
+		return pixbuf;
+	
+	/* decode outside of the lock; if the prefetch thread got there
+		first, use its result and drop ours */
+	pixbuf = vtf_decode_frame (anim->vres, frame, anim->mipmap, anim->has_alpha);
+	if (!pixbuf)
+		return NULL;
+	
+	g_mutex_lock (&anim->lock);
+	for (i = 0; i < VTF_ANIM_CACHE_SIZE; i++)
+		if (anim->cache[i].frame == frame) {
+			g_object_unref (pixbuf);
+			pixbuf = GDK_PIXBUF (g_object_ref (anim->cache[i].pixbuf));
+			break;
+		}
+	if (i == VTF_ANIM_CACHE_SIZE) {
+		CachedFrame *slot = &anim->cache[anim->cache_next];
+		if (slot->pixbuf)
+			g_object_unref (slot->pixbuf);
+		slot->frame = frame;
+		slot->pixbuf = GDK_PIXBUF (g_object_ref (pixbuf));
+		anim->cache_next = (anim->cache_next + 1) % VTF_ANIM_CACHE_SIZE;
+	}
+	g_mutex_unlock (&anim->lock);
+	
+	return pixbuf;
+}
+
+
+/* Decodes whichever frame was asked for last, not the one wanted when
+	the task was queued */
+static void
+vtf_anim_prefetch_func (gpointer data, gpointer user_data)
+{
+	GdkPixbufVtfAnim *anim = static_cast<GdkPixbufVtfAnim*> (user_data);
+	
+	g_mutex_lock (&anim->lock);
+	gint frame = anim->prefetch_frame;
+	anim->prefetch_queued = FALSE;
+	g_mutex_unlock (&anim->lock);
+	
+	GdkPixbuf *pixbuf = vtf_anim_get_frame (anim, frame);
+	if (pixbuf)
+		g_object_unref (pixbuf);
+}
+
+
+/* At most one prefetch waits in the pool. When decoding is slower than
+	the frame delay, a newer request only replaces the frame it decodes,
+	so stale frames do not pile up. */
+static void
+vtf_anim_prefetch (GdkPixbufVtfAnim *anim, gint frame)
+{
+	g_mutex_lock (&anim->lock);
+	anim->prefetch_frame = frame;
+	gboolean push = !anim->prefetch_queued;
+	anim->prefetch_queued = TRUE;
+	g_mutex_unlock (&anim->lock);
+	
+	/* thread pool data cannot be NULL */
+	if (push)
+		g_thread_pool_push (anim->prefetch, anim, NULL);
+}
+
+
+static GdkPixbufVtfAnim *
+gdk_pixbuf_vtf_anim_new (Vtf::File *vtf, Vtf::HiresImageResource *vres,
+		guint8 mipmap, GdkPixbuf *first)
+{
+	GdkPixbufVtfAnim *anim = static_cast<GdkPixbufVtfAnim*> (
+			g_object_new (gdk_pixbuf_vtf_anim_get_type (), NULL));
+	anim->vtf = vtf;
+	anim->vres = vres;
+	anim->mipmap = mipmap;
+	anim->has_alpha = gdk_pixbuf_get_has_alpha (first);
+	anim->width = gdk_pixbuf_get_width (first);
+	anim->height = gdk_pixbuf_get_height (first);
+	anim->frames = vres->frameCount ();
+	anim->first = GDK_PIXBUF (g_object_ref (first));
+	anim->prefetch = g_thread_pool_new (vtf_anim_prefetch_func, anim, 1, FALSE, NULL);
+	return anim;
+}
+
+
+static void
+gdk_pixbuf_vtf_anim_init (GdkPixbufVtfAnim *anim)
+{
+	g_mutex_init (&anim->lock);
+	for (guint i = 0; i < VTF_ANIM_CACHE_SIZE; i++) {
+		anim->cache[i].frame = -1;
+		anim->cache[i].pixbuf = NULL;
+	}
+	anim->cache_next = 0;
+	anim->prefetch_frame = -1;
+	anim->prefetch_queued = FALSE;
+}
+
+
+static void
+gdk_pixbuf_vtf_anim_finalize (GObject *object)
+{
+	GdkPixbufVtfAnim *anim = reinterpret_cast<GdkPixbufVtfAnim*> (object);
+	
+	/* drop queued prefetches and wait for the running one */
+	if (anim->prefetch)
+		g_thread_pool_free (anim->prefetch, TRUE, TRUE);
+	
+	for (guint i = 0; i < VTF_ANIM_CACHE_SIZE; i++)
+		if (anim->cache[i].pixbuf)
+			g_object_unref (anim->cache[i].pixbuf);
+	if (anim->first)
+		g_object_unref (anim->first);
+	g_mutex_clear (&anim->lock);
+	delete anim->vtf;
+	
+	G_OBJECT_CLASS (gdk_pixbuf_vtf_anim_parent_class)->finalize (object);
+}
+
+
+static gboolean
+gdk_pixbuf_vtf_anim_is_static_image (GdkPixbufAnimation *animation)
+{
+	return reinterpret_cast<GdkPixbufVtfAnim*> (animation)->frames <= 1;
+}
+
+
+static GdkPixbuf *
+gdk_pixbuf_vtf_anim_get_static_image (GdkPixbufAnimation *animation)
+{
+	return reinterpret_cast<GdkPixbufVtfAnim*> (animation)->first;
+}
+
+
+static void
+gdk_pixbuf_vtf_anim_get_size (GdkPixbufAnimation *animation, gint *width, gint *height)
+{
+	GdkPixbufVtfAnim *anim = reinterpret_cast<GdkPixbufVtfAnim*> (animation);
+	if (width)
+		*width = anim->width;
+	if (height)
+		*height = anim->height;
+}
+
+
+static GdkPixbufAnimationIter *
+gdk_pixbuf_vtf_anim_get_iter (GdkPixbufAnimation *animation, const GTimeVal *start_time)
+{
+	GdkPixbufVtfAnim *anim = reinterpret_cast<GdkPixbufVtfAnim*> (animation);
+	GdkPixbufVtfAnimIter *iter = static_cast<GdkPixbufVtfAnimIter*> (
+			g_object_new (gdk_pixbuf_vtf_anim_iter_get_type (), NULL));
+	
+	iter->anim = static_cast<GdkPixbufVtfAnim*> (g_object_ref (anim));
+	if (start_time)
+		iter->start = *start_time;
+	else
+		g_get_current_time (&iter->start);
+	iter->elapsed = 0;
+	iter->frame = 0;
+	iter->pixbuf = GDK_PIXBUF (g_object_ref (anim->first));
+	
+	if (anim->frames > 1)
+		vtf_anim_prefetch (anim, 1);
+	
+	return GDK_PIXBUF_ANIMATION_ITER (iter);
+}
+
+
+static void
+gdk_pixbuf_vtf_anim_class_init (GdkPixbufVtfAnimClass *klass)
+{
+	GObjectClass *object_class = G_OBJECT_CLASS (klass);
+	GdkPixbufAnimationClass *anim_class = GDK_PIXBUF_ANIMATION_CLASS (klass);
+	
+	object_class->finalize = gdk_pixbuf_vtf_anim_finalize;
+	anim_class->is_static_image = gdk_pixbuf_vtf_anim_is_static_image;
+	anim_class->get_static_image = gdk_pixbuf_vtf_anim_get_static_image;
+	anim_class->get_size = gdk_pixbuf_vtf_anim_get_size;
+	anim_class->get_iter = gdk_pixbuf_vtf_anim_get_iter;
+}
+
+
+static void
+gdk_pixbuf_vtf_anim_iter_init (GdkPixbufVtfAnimIter *iter)
+{
+}
+
+
+static void
+gdk_pixbuf_vtf_anim_iter_finalize (GObject *object)
+{
+	GdkPixbufVtfAnimIter *iter = reinterpret_cast<GdkPixbufVtfAnimIter*> (object);
+	
+	if (iter->pixbuf)
+		g_object_unref (iter->pixbuf);
+	g_object_unref (iter->anim);
+	
+	G_OBJECT_CLASS (gdk_pixbuf_vtf_anim_iter_parent_class)->finalize (object);
+}
+
+
+static gint
+gdk_pixbuf_vtf_anim_iter_get_delay_time (GdkPixbufAnimationIter *animation_iter)
+{
+	GdkPixbufVtfAnimIter *iter = reinterpret_cast<GdkPixbufVtfAnimIter*> (animation_iter);
+	if (iter->anim->frames <= 1)
+		return -1;
+	return VTF_ANIM_DELAY - iter->elapsed % VTF_ANIM_DELAY;
+}
+
+
+static GdkPixbuf *
+gdk_pixbuf_vtf_anim_iter_get_pixbuf (GdkPixbufAnimationIter *animation_iter)
+{
+	return reinterpret_cast<GdkPixbufVtfAnimIter*> (animation_iter)->pixbuf;
+}
+
+
+static gboolean
+gdk_pixbuf_vtf_anim_iter_on_currently_loading_frame (GdkPixbufAnimationIter *animation_iter)
+{
+	return FALSE;
+}
+
+
+static gboolean
+gdk_pixbuf_vtf_anim_iter_advance (GdkPixbufAnimationIter *animation_iter,
+		const GTimeVal *current_time)
+{
+	GdkPixbufVtfAnimIter *iter = reinterpret_cast<GdkPixbufVtfAnimIter*> (animation_iter);
+	GdkPixbufVtfAnim *anim = iter->anim;
+	
+	GTimeVal now;
+	if (current_time)
+		now = *current_time;
+	else
+		g_get_current_time (&now);
+	
+	glong elapsed = (now.tv_sec - iter->start.tv_sec) * 1000
+			+ (now.tv_usec - iter->start.tv_usec) / 1000;
+	if (elapsed < 0) {
+		/* clock went backwards */
+		iter->start = now;
+		elapsed = 0;
 	}
 	
+	iter->elapsed = elapsed;
+	gint frame = anim->frames > 1 ? (elapsed / VTF_ANIM_DELAY) % anim->frames : 0;
+	if (frame == iter->frame)
+		return FALSE;
+	
+	GdkPixbuf *pixbuf = vtf_anim_get_frame (anim, frame);
+	if (!pixbuf)
+		return FALSE;
+	
+	g_object_unref (iter->pixbuf);
+	iter->pixbuf = pixbuf;
+	iter->frame = frame;
+	
+	vtf_anim_prefetch (anim, (frame + 1) % anim->frames);
+	return TRUE;
+}
+
+
+static void
+gdk_pixbuf_vtf_anim_iter_class_init (GdkPixbufVtfAnimIterClass *klass)
+{
+	GObjectClass *object_class = G_OBJECT_CLASS (klass);
+	GdkPixbufAnimationIterClass *iter_class = GDK_PIXBUF_ANIMATION_ITER_CLASS (klass);
+	
+	object_class->finalize = gdk_pixbuf_vtf_anim_iter_finalize;
+	iter_class->get_delay_time = gdk_pixbuf_vtf_anim_iter_get_delay_time;
+	iter_class->get_pixbuf = gdk_pixbuf_vtf_anim_iter_get_pixbuf;
+	iter_class->on_currently_loading_frame = gdk_pixbuf_vtf_anim_iter_on_currently_loading_frame;
+	iter_class->advance = gdk_pixbuf_vtf_anim_iter_advance;
+}
+
+
+
+static Vtf::HiresImageResource *
+vtf_find_hires (Vtf::File *vtf, Vtf::Status status, GError **error)
+{
+	if (status != Vtf::StatusOk) {
+		g_set_error (error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_CORRUPT_IMAGE,
+				"%s", Vtf::statusToString (status));
+		return NULL;
+	}
+	
+	Vtf::HiresImageResource *vres = static_cast<Vtf::HiresImageResource*> (
+			vtf->findResource (Vtf::Resource::TypeHires));
+	if (!vres)
+		g_set_error (error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_CORRUPT_IMAGE,
+				"Could not find high-resolution image resource");
+	return vres;
+}
+
+
+static void
+vtf_set_format_error (Vtf::HiresImageResource *vres, GError **error)
+{
+	g_set_error (error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_UNKNOWN_TYPE,
+			"Format %s is not supported", Vtf::formatToString (vres->format ()));
+}
+
+
+static GdkPixbuf *
+gdk_pixbuf__vtf_image_load (FILE *fd, GError **error)
+{
+	Vtf::File vtf;
+	Vtf::HiresImageResource *vres = vtf_find_hires (&vtf, vtf.tryLoad (fd), error);
+	if (!vres)
+		return NULL;
+	
+	GdkPixbuf *pixbuf = vtf_decode_frame (vres, 0, 0, vtf_has_alpha (vres, 0));
+	if (!pixbuf)
+		vtf_set_format_error (vres, error);
 	return pixbuf;
 }
 
@@ -68,71 +543,85 @@ gdk_pixbuf__vtf_image_begin_load (GdkPixbufModuleSizeFunc size_func,
 {
 	LoadContext *lc = g_slice_new (LoadContext);
 	lc->buffer = g_byte_array_sized_new (5 * 1024);
+	lc->size = size_func;
 	lc->prepared = prepare_func;
+	lc->updated = update_func;
 	lc->udata = udata;
 	return lc;
 }
 
 
-static void
-free_buffer (guchar *pixels, gpointer data)
-{
-	g_free (pixels);
-}
-
-
+/* Takes over VTF, either handing it to the animation or deleting it */
 static gboolean
-gdk_pixbuf__vtf_image_stop_load (gpointer context_ptr, GError **error)
+vtf_stop_load (LoadContext *lc, Vtf::File *vtf, GError **error)
 {
-	LoadContext* lc = static_cast<LoadContext*> (context_ptr);
-	
-	Vtf *vtf = vtf_open_mem (lc->buffer->data, lc->buffer->len, error);
-	if (!vtf)
-		goto err;
-	
-	guchar *data = vtf_get_image_rgba (vtf, 0);
-	if (!data) {
-		g_set_error (error, VTF_ERROR, VTF_ERROR_FORMAT,
-				"Format %s is not supported",
-				vtf_get_format_name (vtf_get_format (vtf)));
-		goto err;
+	Vtf::HiresImageResource *vres = vtf_find_hires (vtf, vtf->tryLoad (
+			(const char*) lc->buffer->data, lc->buffer->len), error);
+	if (!vres) {
+		delete vtf;
+		return FALSE;
 	}
 	
-	gint width = vtf_get_width (vtf);
-	gint height = vtf_get_height (vtf);
-	GdkPixbuf *pixbuf = gdk_pixbuf_new_from_data (data, GDK_COLORSPACE_RGB,
-			TRUE, 8, width, height, width * 4, free_buffer, NULL);
-	
-	GdkPixbufSimpleAnim *anim = NULL;
-	gint i, frames = vtf_get_frame_count (vtf);
-	if (frames > 0) {
-		GdkPixbuf *frame;
-		anim = gdk_pixbuf_simple_anim_new (width, height, 10.0f);
-		gdk_pixbuf_simple_anim_set_loop (anim, TRUE);
-		for (i = 0; i < frames; i++) {
-			data = vtf_get_image_rgba (vtf, i);
-			frame = gdk_pixbuf_new_from_data (data, GDK_COLORSPACE_RGB,
-					TRUE, 8, width, height, width * 4, free_buffer, NULL);
-			gdk_pixbuf_simple_anim_add_frame (anim, frame);
-			g_object_unref (frame);
+	/* let the caller scale the image down, and decode only the
+		mipmap (or the low-resolution image) closest to that size */
+	gint width = vres->width ();
+	gint height = vres->height ();
+	if (lc->size) {
+		lc->size (&width, &height, lc->udata);
+		if (width <= 0 || height <= 0) {
+			g_set_error (error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_FAILED,
+					"Loading was cancelled");
+			delete vtf;
+			return FALSE;
 		}
 	}
 	
-	lc->prepared (pixbuf, GDK_PIXBUF_ANIMATION (anim), lc->udata);
-	g_object_unref (pixbuf);
-	g_object_unref (anim);
+	guint8 mipmap = vres->findMipmap (MIN (width, G_MAXUINT16),
+			MIN (height, G_MAXUINT16));
+	Vtf::LowresImageResource* lres = static_cast<Vtf::LowresImageResource*> (
+			vtf->findResource(Vtf::Resource::TypeLowres));
 	
-	vtf_close (vtf);
-	g_byte_array_free (lc->buffer, TRUE);
-	g_slice_free (LoadContext, lc);
+	GdkPixbuf *pixbuf = NULL;
+	if (lres && vres->frameCount () == 1 && lres->width () >= width
+			&& lres->height () >= height)
+		pixbuf = vtf_decode_lowres (lres);
+	if (!pixbuf)
+		pixbuf = vtf_decode_frame (vres, 0, mipmap, vtf_has_alpha (vres, mipmap));
+	if (!pixbuf) {
+		vtf_set_format_error (vres, error);
+		delete vtf;
+		return FALSE;
+	}
+	
+	/* the animation takes over the file and decodes other frames lazily */
+	GdkPixbufAnimation *anim = NULL;
+	if (vres->frameCount () > 1)
+		anim = GDK_PIXBUF_ANIMATION (gdk_pixbuf_vtf_anim_new (vtf, vres,
+				mipmap, pixbuf));
+	else
+		delete vtf;
+	
+	lc->prepared (pixbuf, anim, lc->udata);
+	if (lc->updated)
+		lc->updated (pixbuf, 0, 0, gdk_pixbuf_get_width (pixbuf),
+				gdk_pixbuf_get_height (pixbuf), lc->udata);
+	
+	g_object_unref (pixbuf);
+	if (anim)
+		g_object_unref (anim);
 	return TRUE;
+}
+
+
+static gboolean
+gdk_pixbuf__vtf_image_stop_load (gpointer context_ptr, GError **error)
+{
+	LoadContext* lc = static_cast<LoadContext*> (context_ptr);
+	gboolean ret = vtf_stop_load (lc, new Vtf::File, error);
 	
-err:
 	g_byte_array_free (lc->buffer, TRUE);
 	g_slice_free (LoadContext, lc);
-	if (vtf)
-		vtf_close (vtf);
-	return FALSE;
+	return ret;
 }
 
 
@@ -140,7 +629,7 @@ static gboolean
 gdk_pixbuf__vtf_image_load_increment (gpointer context_ptr, const guchar *data,
 		guint size, GError **error)
 {
-	LoadContext *lc = context_ptr;
+	LoadContext *lc = static_cast<LoadContext*> (context_ptr);
 	g_byte_array_append (lc->buffer, data, size);
 	return TRUE;
 }
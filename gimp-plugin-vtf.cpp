@@ -12,11 +12,16 @@ typedef struct _SaveInfo {
 	gboolean mipmap;
 	gboolean lowres;
 	gboolean crc;
+	gboolean dither;
 	
 	GtkWidget *ctl_version, *ctl_format, *ctl_layer,
-			*ctl_mipmap, *ctl_lowres, *ctl_crc;
+			*ctl_mipmap, *ctl_lowres, *ctl_crc, *ctl_dither;
 } SaveInfo;
 
+/* format picked from the layers' alpha and colour content */
+#define SAVE_FORMAT_AUTO			((gint) Vtf::FormatNone)
+#define SAVE_FORMAT_AUTO_LOSSLESS	(-2)
+
 
 static gint32 file_vtf_load_image (const gchar *fname, GError **error);
 static gint32 file_vtf_load_thumbnail_image (const gchar *fname,
@@ -187,13 +192,22 @@ run (const gchar *name, gint nparams, const GimpParam *param,
 	
 	} else if (strcmp (name, SAVE_PROC) == 0) {
 		gchar *file_name;
-		gint32 image_ID;
+		gint32 image_ID, drawable_ID;
 		
 		image_ID = param[1].data.d_int32;
+		drawable_ID = param[2].data.d_int32;
 		file_name = param[3].data.d_string;
 		
 		switch (run_mode) {
 		case GIMP_RUN_INTERACTIVE:
+		case GIMP_RUN_WITH_LAST_VALS:
+			gimp_ui_init ("file-vtf", FALSE);
+			ret = gimp_export_image (&image_ID, &drawable_ID, NULL,
+					(GimpExportCapabilities) (GIMP_EXPORT_CAN_HANDLE_RGB
+							| GIMP_EXPORT_CAN_HANDLE_ALPHA
+							| GIMP_EXPORT_CAN_HANDLE_LAYERS));
+			if (ret == GIMP_EXPORT_CANCEL)
+				status = GIMP_PDB_CANCEL;
 			break;
 		
         case GIMP_RUN_NONINTERACTIVE:
@@ -201,9 +215,6 @@ run (const gchar *name, gint nparams, const GimpParam *param,
 				status = GIMP_PDB_CALLING_ERROR;
 			break;
 		
-		case GIMP_RUN_WITH_LAST_VALS:
-			break;
-		
 		default:
 			break;
 		}
@@ -242,14 +253,16 @@ MAIN ()
 
 
 
+/* The file is mapped rather than loaded: each layer is decoded straight
+	from the mapping into the tiles, so only a row of tiles is kept in
+	memory at a time. The mapped pages are clean and backed by the file,
+	so they can be dropped again as soon as a frame is done. */
 static gboolean
-file_vtf_load_layer (Vtf::HiresImageResource *vres, gint32 image, gint16 frame)
+file_vtf_load_layer (const gchar *data, const Vtf::FileInfo *info, gint32 image,
+		gint16 frame)
 {
-	uint8_t *rgba = vres->getImageRGBA(0, frame, 0, 0);
-	g_return_val_if_fail (rgba != NULL, FALSE);
-	
 	gchar *name = g_strdup_printf ("Frame %d", frame);
-	gint32 layer = gimp_layer_new (image, name, vres->width (), vres->height(),
+	gint32 layer = gimp_layer_new (image, name, info->width, info->height,
 			GIMP_RGBA_IMAGE, 100, GIMP_NORMAL_MODE);
 	gimp_image_insert_layer (image, layer, -1, frame);
 	g_free (name);
@@ -258,11 +271,39 @@ file_vtf_load_layer (Vtf::HiresImageResource *vres, gint32 image, gint16 frame)
 	GimpDrawable *drawable = gimp_drawable_get (layer);
 	gimp_pixel_rgn_init (&pixel_rgn, drawable, 0, 0, drawable->width,
 			drawable->height, TRUE, FALSE);
-	gimp_pixel_rgn_set_rect (&pixel_rgn, rgba, 0, 0, drawable->width,
-			drawable->height);
-	gimp_drawable_detach (drawable);
 	
-	return TRUE;
+	const guint8 *src = (const guint8 *) data + info->subimageOffset (0, frame, 0, 0);
+	gboolean ret = TRUE;
+	gpointer iter;
+	for (iter = gimp_pixel_rgns_register (1, &pixel_rgn); iter != NULL;
+			iter = gimp_pixel_rgns_process (iter)) {
+		if (ret)
+			ret = Vtf::decodeRegion (src, info->format, info->width, info->height,
+					pixel_rgn.x, pixel_rgn.y, pixel_rgn.w, pixel_rgn.h,
+					pixel_rgn.data, pixel_rgn.rowstride);
+	}
+	
+	gimp_drawable_detach (drawable);
+	return ret;
+}
+
+
+/* tryProbe checks that every subimage lies within the mapping */
+static GMappedFile *
+file_vtf_map (const gchar *fname, Vtf::FileInfo *info, GError **error)
+{
+	GMappedFile *file = g_mapped_file_new (fname, FALSE, error);
+	if (!file)
+		return NULL;
+	
+	Vtf::Status status = Vtf::File::tryProbe (g_mapped_file_get_contents (file),
+			g_mapped_file_get_length (file), info);
+	if (status != Vtf::StatusOk) {
+		g_set_error (error, 0, 0, "%s", Vtf::statusToString (status));
+		g_mapped_file_unref (file);
+		return NULL;
+	}
+	return file;
 }
 
 
@@ -271,36 +312,30 @@ file_vtf_load_image (const gchar *fname, GError **error)
 {
 	gimp_progress_init_printf ("Opening '%s'", gimp_filename_to_utf8 (fname));
 	
-	gint32 image = -1;
-	std::auto_ptr<Vtf::File> vtf (new Vtf::File);
+	Vtf::FileInfo info;
+	GMappedFile *file = file_vtf_map (fname, &info, error);
+	if (!file)
+		return -1;
+	const gchar *data = g_mapped_file_get_contents (file);
 	
-	try {
-		vtf->load(fname);
-		
-		Vtf::HiresImageResource* vres = (Vtf::HiresImageResource*)
-				vtf->findResource (Vtf::Resource::TypeHires);
-		if (!vres)
-			throw Vtf::Exception ("Cound not find high-resolution image");
-		
-		image = gimp_image_new (vres->width (), vres->height  (), GIMP_RGB);
-		gimp_image_set_filename (image, fname);
-		
-		guint16 i, frame_count = vres->frameCount ();
-		for (i = 0; i < frame_count; i++) {
-			if (!file_vtf_load_layer (vres, image, i)) {
-				g_set_error (error, 0, 0, "Unsupported format %s",
-						Vtf::formatToString (vres->format()));
-				gimp_image_delete (image);
-				image = -1;
-				break;
-			}
+	gint32 image = gimp_image_new (info.width, info.height, GIMP_RGB);
+	gimp_image_set_filename (image, fname);
+	gimp_tile_cache_ntiles (info.width / gimp_tile_width () + 1);
+	
+	guint16 i;
+	for (i = 0; i < info.frames; i++) {
+		if (!file_vtf_load_layer (data, &info, image, i)) {
+			g_set_error (error, 0, 0, "Unsupported format %s",
+					Vtf::formatToString (info.format));
+			gimp_image_delete (image);
+			g_mapped_file_unref (file);
+			return -1;
 		}
-		
-		gimp_progress_update (1.0);
-	} catch (std::exception& e) {
-		g_set_error (error, 0, 0, e.what ());
+		gimp_progress_update ((gdouble) (i + 1) / info.frames);
 	}
 	
+	g_mapped_file_unref (file);
+	gimp_progress_update (1.0);
 	return image;
 }
 
@@ -309,41 +344,32 @@ gint32
 file_vtf_load_thumbnail_image (const gchar *fname, gint *width, gint *height,
 		GError **error)
 {
-	gint32 image = -1;
 	gimp_progress_init_printf ("Opening thumbnail for '%s'",
 			gimp_filename_to_utf8 (fname));
 	
-	Vtf::File *vtf = new Vtf::File;
-	try {
-		vtf->load(fname);
-		
-		Vtf::HiresImageResource* vres = (Vtf::HiresImageResource*)
-				vtf->findResource(Vtf::Resource::TypeHires);
-		if (!vres)
-			throw Vtf::Exception ("Cound not find high-resolution image");
-		
-		*width = static_cast<gint> (vres->width ());
-		*height = static_cast<gint> (vres->height ());
-		
-		image = gimp_image_new (*width, *height, GIMP_RGB);
-		if (!file_vtf_load_layer (vres, image, 0)) {
-			g_set_error (error, 0, 0, "Unsupported format %s",
-					Vtf::formatToString(vres->format()));
-			gimp_image_delete (image);
-			image = -1;
-		}
-		
-		gimp_progress_update (1.0);
-	} catch (std::exception& e) {
-		g_set_error (error, 0, 0, e.what());
+	Vtf::FileInfo info;
+	GMappedFile *file = file_vtf_map (fname, &info, error);
+	if (!file)
+		return -1;
+	
+	*width = static_cast<gint> (info.width);
+	*height = static_cast<gint> (info.height);
+	
+	gint32 image = gimp_image_new (*width, *height, GIMP_RGB);
+	if (!file_vtf_load_layer (g_mapped_file_get_contents (file), &info, image, 0)) {
+		g_set_error (error, 0, 0, "Unsupported format %s",
+				Vtf::formatToString (info.format));
+		gimp_image_delete (image);
+		g_mapped_file_unref (file);
+		return -1;
 	}
 	
-	delete vtf;
+	g_mapped_file_unref (file);
+	gimp_progress_update (1.0);
 	return image;
 }
 
 
-
 static void
 save_dialog_version_changed (GtkComboBox *widget, SaveInfo *info)
 {
@@ -408,10 +434,18 @@ file_vtf_save_dialog (SaveInfo *info)
 			GTK_FILL, GTK_FILL, 0, 0);
 	
 	info->ctl_format = gimp_int_combo_box_new (
+			"Auto",										SAVE_FORMAT_AUTO,
+			"Auto (lossless)",							SAVE_FORMAT_AUTO_LOSSLESS,
 			Vtf::formatToString (Vtf::FormatRGBA8888),	Vtf::FormatRGBA8888,
 			Vtf::formatToString (Vtf::FormatDXT1),		Vtf::FormatDXT1,
 			Vtf::formatToString (Vtf::FormatDXT3),		Vtf::FormatDXT3,
 			Vtf::formatToString (Vtf::FormatDXT5),		Vtf::FormatDXT5,
+			Vtf::formatToString (Vtf::FormatBGR565),	Vtf::FormatBGR565,
+			Vtf::formatToString (Vtf::FormatBGRA5551),	Vtf::FormatBGRA5551,
+			Vtf::formatToString (Vtf::FormatBGRA4444),	Vtf::FormatBGRA4444,
+			Vtf::formatToString (Vtf::FormatI8),		Vtf::FormatI8,
+			Vtf::formatToString (Vtf::FormatIA88),		Vtf::FormatIA88,
+			Vtf::formatToString (Vtf::FormatA8),		Vtf::FormatA8,
 			NULL);
 	gimp_int_combo_box_set_active (GIMP_INT_COMBO_BOX (info->ctl_format), info->format);
 	gtk_table_attach (GTK_TABLE (table), info->ctl_format, 1, 2, 1, 2,
@@ -431,7 +465,7 @@ file_vtf_save_dialog (SaveInfo *info)
 			"Faces",	1,
 			"Z slices",	2,
 			NULL);
-	gimp_int_combo_box_set_active (GIMP_INT_COMBO_BOX (info->ctl_layer), 0);
+	gimp_int_combo_box_set_active (GIMP_INT_COMBO_BOX (info->ctl_layer), info->layer);
 	gtk_table_attach (GTK_TABLE (table), info->ctl_layer, 1, 2, 2, 3,
 			(GtkAttachOptions) (GTK_FILL | GTK_EXPAND), GTK_FILL, 0, 0);
 	
@@ -447,7 +481,7 @@ file_vtf_save_dialog (SaveInfo *info)
 	info->ctl_mipmap = gtk_check_button_new_with_label ("Add and generate _mipmaps");
 	g_object_set (G_OBJECT (info->ctl_mipmap),
 			"use-underline", TRUE,
-			"active", TRUE,
+			"active", info->mipmap,
 			NULL);
 	gtk_table_attach (GTK_TABLE (table), info->ctl_mipmap, 0, 2, 3, 4,
 			GTK_FILL, GTK_FILL, 0, 0);
@@ -455,7 +489,7 @@ file_vtf_save_dialog (SaveInfo *info)
 	info->ctl_lowres = gtk_check_button_new_with_label ("Add low _resolution image");
 	g_object_set (G_OBJECT (info->ctl_lowres),
 			"use-underline", TRUE,
-			"active", TRUE,
+			"active", info->lowres,
 			NULL);
 	gtk_table_attach (GTK_TABLE (table), info->ctl_lowres, 0, 2, 4, 5,
 			GTK_FILL, GTK_FILL, 0, 0);
@@ -463,33 +497,237 @@ file_vtf_save_dialog (SaveInfo *info)
 	info->ctl_crc = gtk_check_button_new_with_label ("Add _CRC");
 	g_object_set (G_OBJECT (info->ctl_crc),
 			"use-underline", TRUE,
-			"active", TRUE,
+			"active", info->crc,
 			NULL);
 	gtk_table_attach (GTK_TABLE (table), info->ctl_crc, 0, 2, 5, 6,
 			GTK_FILL, GTK_FILL, 0, 0);
 	
+	info->ctl_dither = gtk_check_button_new_with_label ("_Dither 16 bit formats");
+	g_object_set (G_OBJECT (info->ctl_dither),
+			"use-underline", TRUE,
+			"active", info->dither,
+			NULL);
+	gtk_table_attach (GTK_TABLE (table), info->ctl_dither, 0, 2, 6, 7,
+			GTK_FILL, GTK_FILL, 0, 0);
+	
 	gtk_box_pack_start (GTK_BOX (gimp_export_dialog_get_content_area (dialog)),
 			table, TRUE, TRUE, 0);
 	gtk_widget_show_all (table);
 	
 	gtk_widget_show (dialog);
 	gint resp = gimp_dialog_run (GIMP_DIALOG (dialog));
+	
+	if (resp == GTK_RESPONSE_OK) {
+		gimp_int_combo_box_get_active (GIMP_INT_COMBO_BOX (info->ctl_version), &info->version);
+		gimp_int_combo_box_get_active (GIMP_INT_COMBO_BOX (info->ctl_format), &info->format);
+		gimp_int_combo_box_get_active (GIMP_INT_COMBO_BOX (info->ctl_layer), &info->layer);
+		info->mipmap = gtk_toggle_button_get_active (GTK_TOGGLE_BUTTON (info->ctl_mipmap));
+		info->lowres = gtk_toggle_button_get_active (GTK_TOGGLE_BUTTON (info->ctl_lowres));
+		info->crc = gtk_toggle_button_get_active (GTK_TOGGLE_BUTTON (info->ctl_crc));
+		info->dither = gtk_toggle_button_get_active (GTK_TOGGLE_BUTTON (info->ctl_dither));
+	}
+	
 	gtk_widget_destroy (dialog);
 	return (resp == GTK_RESPONSE_OK);
 }
 
 
+/* One layer to be encoded with all its mipmaps on the thread pool. The
+	workers never touch the resource: setImage() may only be called by one
+	thread at a time, so encoded mipmaps go back to the GIMP thread. */
+typedef struct _EncodeTask {
+	Vtf::Format format;
+	gint width, height;
+	guint8 mipmaps;
+	guint8 *rgba;
+	guint16 frame, face, slice;
+	gboolean dither;
+} EncodeTask;
+
+
+/* One encoded mipmap, or with data NULL the end of a layer */
+typedef struct _EncodedImage {
+	guint8 *data;
+	guint8 mipmap;
+	guint16 frame, face, slice;
+} EncodedImage;
+
+
+typedef struct _EncodeContext {
+	GAsyncQueue *done;
+	gint failed;
+} EncodeContext;
+
+
+static void
+file_vtf_encode_push (EncodeContext *ctx, const EncodeTask *task, guint8 *data,
+		guint8 mipmap)
+{
+	EncodedImage *img = g_slice_new (EncodedImage);
+	img->data = data;
+	img->mipmap = mipmap;
+	img->frame = task->frame;
+	img->face = task->face;
+	img->slice = task->slice;
+	g_async_queue_push (ctx->done, img);
+}
+
+
+static void
+file_vtf_encode_layer (gpointer data, gpointer user_data)
+{
+	EncodeTask *task = static_cast<EncodeTask*> (data);
+	EncodeContext *ctx = static_cast<EncodeContext*> (user_data);
+	
+	guint8 *rgba = task->rgba;
+	gint width = task->width;
+	gint height = task->height;
+	
+	try {
+		for (guint8 mm = 0; mm < task->mipmaps; mm++) {
+			if (mm > 0) {
+				gint w = MAX (width / 2, 1);
+				gint h = MAX (height / 2, 1);
+				guint8 *next = g_new (guint8, w * h * 4);
+				Vtf::resample (rgba, width, height, next, w, h, Vtf::FilterBox);
+				g_free (rgba);
+				rgba = next;
+				width = w;
+				height = h;
+			}
+			
+			file_vtf_encode_push (ctx, task, Vtf::encodeImage (task->format, rgba,
+					width, height, task->dither), mm);
+		}
+	} catch (std::exception& e) {
+		g_atomic_int_set (&ctx->failed, TRUE);
+	}
+	
+	g_free (rgba);
+	file_vtf_encode_push (ctx, task, NULL, 0);
+	g_slice_free (EncodeTask, task);
+}
+
+
+/* Owns the encoder threads and the queue they report to, and stores what
+	they encode into VRES from the calling thread. Destroying it first waits
+	for every layer handed out, so an exception in the GIMP thread cannot
+	free the context or the resource under a running task. */
+class EncodePool
+{
+public:
+	EncodePool (Vtf::HiresImageResource *vres, gint threads, gint total)
+		: m_Vres (vres), m_Threads (threads), m_InFlight (0), m_Encoded (0),
+		m_Total (total)
+	{
+		m_Ctx.done = g_async_queue_new ();
+		m_Ctx.failed = FALSE;
+		m_Pool = g_thread_pool_new (file_vtf_encode_layer, &m_Ctx, threads, TRUE, NULL);
+	}
+	
+	~EncodePool ()
+	{
+		while (m_InFlight > 0)
+			wait ();
+		g_thread_pool_free (m_Pool, FALSE, TRUE);
+		g_async_queue_unref (m_Ctx.done);
+	}
+	
+	/* bounds the number of decoded layers held in memory */
+	void push (EncodeTask *task)
+	{
+		while (m_InFlight >= m_Threads * 2)
+			wait ();
+		g_thread_pool_push (m_Pool, task, NULL);
+		m_InFlight++;
+	}
+	
+	/* true if every layer was encoded */
+	bool finish ()
+	{
+		while (m_InFlight > 0)
+			wait ();
+		return !g_atomic_int_get (&m_Ctx.failed);
+	}
+	
+private:
+	void wait ()
+	{
+		EncodedImage *img = static_cast<EncodedImage*> (g_async_queue_pop (m_Ctx.done));
+		if (img->data) {
+			m_Vres->setImage (img->mipmap, img->frame, img->face, img->slice, img->data);
+			gimp_progress_update ((gdouble) ++m_Encoded / m_Total);
+		} else {
+			m_InFlight--;
+		}
+		g_slice_free (EncodedImage, img);
+	}
+	
+	Vtf::HiresImageResource *m_Vres;
+	EncodeContext m_Ctx;
+	GThreadPool *m_Pool;
+	gint m_Threads;
+	gint m_InFlight;
+	gint m_Encoded;
+	gint m_Total;
+};
+
+
+/* Reads a layer as image-sized RGBA, placing it at its offsets */
+static guint8 *
+file_vtf_read_layer (gint32 layer, gint width, gint height)
+{
+	guint8 *rgba = g_new0 (guint8, width * height * 4);
+	
+	GimpDrawable *drawable = gimp_drawable_get (layer);
+	gint bpp = drawable->bpp;
+	gint offx, offy;
+	gimp_drawable_offsets (layer, &offx, &offy);
+	
+	gint x0 = MAX (offx, 0), y0 = MAX (offy, 0);
+	gint x1 = MIN (offx + (gint) drawable->width, width);
+	gint y1 = MIN (offy + (gint) drawable->height, height);
+	
+	if (x1 > x0 && y1 > y0 && (bpp == 3 || bpp == 4)) {
+		GimpPixelRgn rgn;
+		gimp_pixel_rgn_init (&rgn, drawable, x0 - offx, y0 - offy, x1 - x0, y1 - y0,
+				FALSE, FALSE);
+		
+		guint8 *row = g_new (guint8, (x1 - x0) * bpp);
+		for (gint y = y0; y < y1; y++) {
+			gimp_pixel_rgn_get_row (&rgn, row, x0 - offx, y - offy, x1 - x0);
+			guint8 *dst = rgba + (y * width + x0) * 4;
+			if (bpp == 4) {
+				memcpy (dst, row, (x1 - x0) * 4);
+			} else {
+				for (gint x = 0; x < x1 - x0; x++) {
+					dst[x * 4 + 0] = row[x * 3 + 0];
+					dst[x * 4 + 1] = row[x * 3 + 1];
+					dst[x * 4 + 2] = row[x * 3 + 2];
+					dst[x * 4 + 3] = 255;
+				}
+			}
+		}
+		g_free (row);
+	}
+	
+	gimp_drawable_detach (drawable);
+	return rgba;
+}
+
+
 GimpPDBStatusType
 file_vtf_save_image (const gchar *fname, gint32 image, gint32 run_mode,
 		GError **error)
 {
 	SaveInfo info;
 	info.version = 4;
-	info.format = Vtf::FormatDXT5;
+	info.format = SAVE_FORMAT_AUTO;
 	info.layer = 0;
 	info.mipmap = TRUE;
 	info.lowres = TRUE;
 	info.crc = TRUE;
+	info.dither = FALSE;
 	
 	if (run_mode == GIMP_RUN_INTERACTIVE)
 		if (!file_vtf_save_dialog (&info))
@@ -497,19 +735,115 @@ file_vtf_save_image (const gchar *fname, gint32 image, gint32 run_mode,
 	
 	gimp_progress_init_printf ("Saving '%s'", gimp_filename_to_utf8 (fname));
 	
+	gint width = gimp_image_width (image);
+	gint height = gimp_image_height (image);
+	if (width > G_MAXUINT16 || height > G_MAXUINT16
+			|| (width & (width - 1)) != 0 || (height & (height - 1)) != 0) {
+		g_set_error (error, 0, 0, "Image dimensions must be powers of 2");
+		return GIMP_PDB_EXECUTION_ERROR;
+	}
+	
+	gint nlayers;
+	gint32 *layers = gimp_image_get_layers (image, &nlayers);
+	
+	guint16 frames = 1, faces = 1, slices = 1;
+	switch (info.layer) {
+	case 0:	frames = nlayers; break;
+	case 1:	faces = nlayers; break;
+	case 2:	slices = nlayers; break;
+	}
+	
+	if (faces != 1 && faces != 6 && faces != 7) {
+		g_set_error (error, 0, 0, "An environment map needs 6 or 7 layers, not %d", nlayers);
+		g_free (layers);
+		return GIMP_PDB_EXECUTION_ERROR;
+	}
+	
+	guint8 mipmaps = info.mipmap ? Vtf::calcMipmapCount (width, height) : 1;
+	Vtf::Format format = (Vtf::Format) info.format;
+	guint32 flags = 0;
+	
+	/* an extra pass over the layers, to see what the image needs */
+	if (info.format == SAVE_FORMAT_AUTO || info.format == SAVE_FORMAT_AUTO_LOSSLESS) {
+		Vtf::ImageTraits traits;
+		for (gint i = 0; i < nlayers; i++) {
+			guint8 *rgba = file_vtf_read_layer (layers[i], width, height);
+			Vtf::analyzeRGBA (rgba, width * height, traits);
+			g_free (rgba);
+		}
+		format = Vtf::chooseFormat (traits, flags,
+				info.format == SAVE_FORMAT_AUTO_LOSSLESS);
+	}
+	
 	std::auto_ptr<Vtf::File> vtf (new Vtf::File);
+	GimpPDBStatusType status = GIMP_PDB_SUCCESS;
 	
 	try {
 		Vtf::HiresImageResource* vres = new Vtf::HiresImageResource;
-//		vres->setup (info.format, info.width, info.height, info);
-		vres->check ();
-		
 		vtf->addResource (vres);
+		vres->setup (format, width, height, mipmaps, frames, faces, slices);
+		vtf->setFlags (flags);
+		
+		/* read ahead of the threads, so a failure here leaves nothing running */
+		guint8 *first = file_vtf_read_layer (layers[0], width, height);
+		if (info.lowres || info.version < 3) {
+			try {
+				Vtf::LowresImageResource* lowres = new Vtf::LowresImageResource;
+				vtf->addResource (lowres);
+				gint lw = MIN (width, 16), lh = MIN (height, 16);
+				if (width > height)
+					lh = MAX (lw * height / width, 1);
+				else if (height > width)
+					lw = MAX (lh * width / height, 1);
+				std::vector<guint8> small (lw * lh * 4);
+				Vtf::resample (first, width, height, &small[0], lw, lh, Vtf::FilterBox);
+				lowres->setup (Vtf::FormatDXT1, lw, lh);
+				lowres->setImageRGBA (&small[0]);
+			} catch (...) {
+				g_free (first);
+				throw;
+			}
+		}
+		
+		bool encoded;
+		{
+			/* GIMP calls are made from this thread only; the pool gets
+				ready RGBA buffers and reports back through the queue */
+			EncodePool pool (vres, g_get_num_processors (), nlayers * mipmaps);
+			for (gint i = 0; i < nlayers; i++) {
+				guint8 *rgba = i == 0 ? first : file_vtf_read_layer (layers[i], width, height);
+				EncodeTask *task = g_slice_new (EncodeTask);
+				task->format = format;
+				task->width = width;
+				task->height = height;
+				task->mipmaps = mipmaps;
+				task->rgba = rgba;
+				task->frame = info.layer == 0 ? i : 0;
+				task->face = info.layer == 1 ? i : 0;
+				task->slice = info.layer == 2 ? i : 0;
+				task->dither = info.dither;
+				pool.push (task);
+			}
+			encoded = pool.finish ();
+		}
+		
+		if (!encoded || !vres->check ())
+			throw Vtf::Exception ("Could not encode image");
+		
+		if (info.crc && info.version >= 3) {
+			Vtf::CRCResource* crc = new Vtf::CRCResource;
+			crc->set (vres->checksum ());
+			vtf->addResource (crc);
+		}
+		
 		vtf->save (fname, info.version);
 	} catch (std::exception& e) {
+		g_set_error (error, 0, 0, "%s", e.what ());
+		status = GIMP_PDB_EXECUTION_ERROR;
 	}
 	
+	g_free (layers);
 	gimp_progress_update (1.0);
 	
-	return GIMP_PDB_SUCCESS;
+	return status;
 }
@@ -0,0 +1,409 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <iostream>
+#include <map>
+#include "vtf.h"
+#include "vtf-thread.h"
+
+
+/* Keeps a fingerprint index of every VTF under the given directories.
+	The index is a text file sorted by content hash, so duplicates sit on
+	adjacent lines; files whose mtime and size did not change since the
+	last run are taken from it without being opened. */
+
+
+#define INDEX_MAGIC		"vtf-index 1"
+
+
+struct Entry
+{
+	uint64_t content;
+	uint64_t perceptual;
+	uint64_t mtime;
+	uint64_t size;
+	std::string path;
+	Vtf::Status status;
+	bool changed;			/* size or mtime moved between walk and read */
+	
+	bool operator<(const Entry& other) const
+	{
+		if (content != other.content)
+			return content < other.content;
+		return path < other.path;
+	}
+};
+
+typedef std::map<std::string, Entry> EntryMap;
+
+
+/* Returns false if there is no usable index, which is not an error */
+static bool
+read_index (const char* fname, EntryMap& entries, bool& perceptual)
+{
+	FILE* fp = fopen(fname, "r");
+	if (!fp)
+		return false;
+	
+	char* line = NULL;
+	size_t size = 0;
+	ssize_t len = getline(&line, &size, fp);
+	int has_perceptual = 0;
+	bool ok = len > 0 && strncmp(line, INDEX_MAGIC " ", strlen(INDEX_MAGIC) + 1) == 0
+			&& sscanf(line + strlen(INDEX_MAGIC), "%d", &has_perceptual) == 1;
+	
+	while (ok && (len = getline(&line, &size, fp)) > 0) {
+		unsigned long long content, phash, mtime, length;
+		int path_start = 0;
+		if (line[len - 1] == '\n')
+			line[--len] = '\0';
+		if (sscanf(line, "%llx %llx %llu %llu %n", &content, &phash, &mtime, &length,
+				&path_start) < 4 || path_start == 0 || !line[path_start])
+			continue;
+		
+		Entry& entry = entries[line + path_start];
+		entry.content = content;
+		entry.perceptual = phash;
+		entry.mtime = mtime;
+		entry.size = length;
+		entry.path = line + path_start;
+		entry.status = Vtf::StatusOk;
+		entry.changed = false;
+	}
+	
+	free(line);
+	fclose(fp);
+	perceptual = has_perceptual != 0;
+	return ok;
+}
+
+
+/* Written aside and renamed, an interrupted run leaves the old index */
+static bool
+write_index (const char* fname, const std::vector<Entry>& entries, bool perceptual)
+{
+	std::string tmp = std::string(fname) + ".XXXXXX";
+	int fd = mkstemp(&tmp[0]);
+	FILE* fp = fd >= 0 ? fdopen(fd, "w") : NULL;
+	if (!fp) {
+		if (fd >= 0) {
+			close(fd);
+			unlink(tmp.c_str());
+		}
+		return false;
+	}
+	
+	fprintf(fp, INDEX_MAGIC " %d\n", perceptual ? 1 : 0);
+	for (std::size_t i = 0; i < entries.size(); i++) {
+		const Entry& e = entries[i];
+		fprintf(fp, "%016llx %016llx %llu %llu %s\n", (unsigned long long) e.content,
+				(unsigned long long) e.perceptual, (unsigned long long) e.mtime,
+				(unsigned long long) e.size, e.path.c_str());
+	}
+	
+	if (fclose(fp) != 0 || rename(tmp.c_str(), fname) < 0) {
+		unlink(tmp.c_str());
+		return false;
+	}
+	return true;
+}
+
+
+static bool
+has_vtf_suffix (const char* name)
+{
+	std::size_t len = strlen(name);
+	return len > 4 && strcasecmp(name + len - 4, ".vtf") == 0;
+}
+
+
+/* Symbolic links are not followed, so a tree is never counted twice */
+static void
+walk (const std::string& dir, std::vector<Entry>& files)
+{
+	DIR* dp = opendir(dir.c_str());
+	if (!dp) {
+		std::cerr << dir << ": " << strerror(errno) << std::endl;
+		return;
+	}
+	
+	struct dirent* de;
+	while ((de = readdir(dp))) {
+		const char* name = de->d_name;
+		if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0 || strchr(name, '\n'))
+			continue;
+		
+		std::string path = dir + "/" + name;
+		struct stat st;
+		if (lstat(path.c_str(), &st) < 0)
+			continue;
+		
+		if (S_ISDIR(st.st_mode)) {
+			walk(path, files);
+		} else if (S_ISREG(st.st_mode) && has_vtf_suffix(name)) {
+			Entry entry;
+			entry.content = 0;
+			entry.perceptual = 0;
+			entry.mtime = st.st_mtime;
+			entry.size = st.st_size;
+			entry.path = path;
+			entry.status = Vtf::StatusOk;
+			entry.changed = false;
+			files.push_back(entry);
+		}
+	}
+	closedir(dp);
+}
+
+
+class FingerprintTask : public Vtf::Task
+{
+public:
+	FingerprintTask(Entry& entry, bool perceptual)
+		: m_Entry(entry), m_Perceptual(perceptual) {}
+	
+	void run()
+	{
+		int fd = open(m_Entry.path.c_str(), O_RDONLY);
+		if (fd < 0) {
+			m_Entry.status = Vtf::StatusIoError;
+			return;
+		}
+		
+		/* the file may have changed since the walk; map only what is
+			there now, a mapping past the end would raise SIGBUS */
+		struct stat st;
+		if (fstat(fd, &st) < 0) {
+			m_Entry.status = Vtf::StatusIoError;
+		} else if (st.st_size == 0) {
+			m_Entry.status = Vtf::StatusHeaderTruncated;
+		} else {
+			m_Entry.changed = (uint64_t) st.st_mtime != m_Entry.mtime
+					|| (uint64_t) st.st_size != m_Entry.size;
+			m_Entry.mtime = st.st_mtime;
+			m_Entry.size = st.st_size;
+			void* data = mmap(NULL, m_Entry.size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (data == MAP_FAILED) {
+				m_Entry.status = Vtf::StatusIoError;
+			} else {
+				Vtf::Fingerprint fp;
+				m_Entry.status = Vtf::File::tryFingerprint((const char*) data, m_Entry.size,
+						fp, m_Perceptual);
+				m_Entry.content = fp.content;
+				m_Entry.perceptual = fp.perceptual;
+				munmap(data, m_Entry.size);
+			}
+		}
+		close(fd);
+	}
+
+private:
+	Entry& m_Entry;
+	bool m_Perceptual;
+};
+
+
+static void
+print_group (const char* what, uint64_t hash, const std::vector<const Entry*>& group)
+{
+	printf("%s %016llx, %u files\n", what, (unsigned long long) hash,
+			(unsigned int) group.size());
+	for (std::size_t i = 0; i < group.size(); i++)
+		printf("  %s\n", group[i]->path.c_str());
+}
+
+
+/* Perceptual hashes this many bits apart still count as the same
+	picture. Split into one more band than that, two such hashes agree
+	exactly on at least one band, so only band buckets are compared. */
+#define SIMILAR_BITS	3
+#define SIMILAR_BANDS	(SIMILAR_BITS + 1)
+
+
+static std::size_t
+find_root (std::vector<std::size_t>& parent, std::size_t i)
+{
+	while (parent[i] != i)
+		i = parent[i] = parent[parent[i]];
+	return i;
+}
+
+
+static int
+hamming (uint64_t a, uint64_t b)
+{
+	uint64_t x = a ^ b;
+	int n = 0;
+	for (; x; n++)
+		x &= x - 1;
+	return n;
+}
+
+
+/* Exact copies first, then files that only look alike */
+static void
+print_duplicates (const std::vector<Entry>& entries, bool perceptual)
+{
+	std::vector<const Entry*> group;
+	for (std::size_t i = 0; i < entries.size(); i++) {
+		group.push_back(&entries[i]);
+		if (i + 1 == entries.size() || entries[i + 1].content != entries[i].content) {
+			if (group.size() > 1)
+				print_group("duplicate", entries[i].content, group);
+			group.clear();
+		}
+	}
+	
+	if (!perceptual)
+		return;
+	
+	/* Copies share a perceptual hash too; band one of each */
+	std::vector<std::size_t> reps;
+	for (std::size_t i = 0; i < entries.size(); i++) {
+		if (entries[i].perceptual && (i == 0 || entries[i - 1].content != entries[i].content))
+			reps.push_back(i);
+	}
+	
+	std::vector<std::size_t> parent(reps.size());
+	for (std::size_t r = 0; r < reps.size(); r++)
+		parent[r] = r;
+	
+	const int band_bits = 64 / SIMILAR_BANDS;
+	for (int band = 0; band < SIMILAR_BANDS; band++) {
+		std::vector<std::pair<uint64_t, std::size_t> > order;
+		for (std::size_t r = 0; r < reps.size(); r++) {
+			uint64_t key = (entries[reps[r]].perceptual >> (band * band_bits))
+					& (((uint64_t) 1 << band_bits) - 1);
+			order.push_back(std::make_pair(key, r));
+		}
+		std::sort(order.begin(), order.end());
+		
+		for (std::size_t i = 0; i < order.size(); i++) {
+			for (std::size_t j = i + 1; j < order.size() && order[j].first == order[i].first; j++) {
+				const Entry& a = entries[reps[order[i].second]];
+				const Entry& b = entries[reps[order[j].second]];
+				if (hamming(a.perceptual, b.perceptual) <= SIMILAR_BITS)
+					parent[find_root(parent, order[i].second)] = find_root(parent, order[j].second);
+			}
+		}
+	}
+	
+	std::vector<std::pair<std::size_t, std::size_t> > clusters;
+	for (std::size_t r = 0; r < reps.size(); r++)
+		clusters.push_back(std::make_pair(find_root(parent, r), r));
+	std::sort(clusters.begin(), clusters.end());
+	
+	std::size_t distinct = 0;
+	for (std::size_t i = 0; i < clusters.size(); i++) {
+		std::size_t k = reps[clusters[i].second];
+		do
+			group.push_back(&entries[k]);
+		while (++k < entries.size() && entries[k].content == entries[k - 1].content);
+		distinct++;
+		if (i + 1 == clusters.size() || clusters[i + 1].first != clusters[i].first) {
+			if (distinct > 1)
+				print_group("similar", entries[reps[clusters[i].first]].perceptual, group);
+			group.clear();
+			distinct = 0;
+		}
+	}
+}
+
+
+int main (int argc, char* argv[])
+{
+	bool perceptual = false;
+	bool show_dups = false;
+	unsigned int jobs = 0;
+	const char* index_name = NULL;
+	std::vector<std::string> dirs;
+	
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--perceptual") == 0)
+			perceptual = true;
+		else if (strcmp(argv[i], "--dups") == 0)
+			show_dups = true;
+		else if (strcmp(argv[i], "--jobs") == 0 && i + 1 < argc)
+			jobs = atoi(argv[++i]);
+		else if (!index_name)
+			index_name = argv[i];
+		else
+			dirs.push_back(argv[i]);
+	}
+	
+	if (!index_name || dirs.empty()) {
+		std::cerr << "Usage: " << argv[0] << " [--perceptual] [--dups] [--jobs N] INDEX DIR..."
+				<< std::endl;
+		return 1;
+	}
+	
+	EntryMap known;
+	bool known_perceptual = false;
+	read_index(index_name, known, known_perceptual);
+	
+	std::vector<Entry> files;
+	for (std::size_t i = 0; i < dirs.size(); i++) {
+		std::string dir = dirs[i];
+		while (dir.size() > 1 && dir[dir.size() - 1] == '/')
+			dir.erase(dir.size() - 1);
+		walk(dir, files);
+	}
+	
+	/* entries from an index without perceptual hashes cannot be reused
+		when those are wanted now */
+	unsigned int reused = 0, hashed = 0, failed = 0, changed = 0;
+	bool reuse = known_perceptual || !perceptual;
+	/* mostly waiting on the disk, keep plenty of reads in flight */
+	Vtf::ThreadPool pool(jobs ? jobs : 4 * Vtf::ThreadPool::cpuCount());
+	for (std::size_t i = 0; i < files.size(); i++) {
+		EntryMap::const_iterator old = known.find(files[i].path);
+		if (reuse && old != known.end() && old->second.mtime == files[i].mtime
+				&& old->second.size == files[i].size) {
+			files[i].content = old->second.content;
+			files[i].perceptual = perceptual ? old->second.perceptual : 0;
+			reused++;
+		} else {
+			pool.push(new FingerprintTask(files[i], perceptual));
+			hashed++;
+		}
+	}
+	pool.wait();
+	
+	std::vector<Entry> entries;
+	entries.reserve(files.size());
+	for (std::size_t i = 0; i < files.size(); i++) {
+		if (files[i].changed)
+			changed++;
+		if (files[i].status == Vtf::StatusOk) {
+			entries.push_back(files[i]);
+		} else {
+			std::cerr << files[i].path << ": " << Vtf::statusToString(files[i].status)
+					<< std::endl;
+			failed++;
+		}
+	}
+	std::sort(entries.begin(), entries.end());
+	
+	if (!write_index(index_name, entries, perceptual)) {
+		std::cerr << index_name << ": Could not write index: " << strerror(errno) << std::endl;
+		return 1;
+	}
+	
+	std::cerr << files.size() << " files, " << hashed << " hashed, " << reused
+			<< " unchanged, " << failed << " failed";
+	if (changed)
+		std::cerr << ", " << changed << " changed while scanning";
+	std::cerr << std::endl;
+	
+	if (show_dups)
+		print_duplicates(entries, perceptual);
+	return 0;
+}
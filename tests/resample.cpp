@@ -0,0 +1,58 @@
+#include <stdlib.h>
+#include <iostream>
+#include <vector>
+#include "../vtf.h"
+
+
+/* Downscales a wide horizontal 0..255 ramp with both filters and checks
+	that every output column stays close to the ramp value at its centre.
+	8192 -> 3000 overflowed 32 bit source coordinates once. */
+
+
+static int
+check_ramp (uint16_t srcWidth, uint16_t dstWidth, Vtf::Filter filter, const char* name)
+{
+	const uint16_t height = 2;
+	std::vector<uint8_t> src((std::size_t) srcWidth * height * 4);
+	std::vector<uint8_t> dst((std::size_t) dstWidth * height * 4);
+	
+	for (uint32_t y = 0; y < height; y++) {
+		for (uint32_t x = 0; x < srcWidth; x++) {
+			uint8_t* p = &src[(y * srcWidth + x) * 4];
+			p[0] = p[1] = p[2] = x * 255 / (srcWidth - 1);
+			p[3] = 255;
+		}
+	}
+	
+	Vtf::resample(&src[0], srcWidth, height, &dst[0], dstWidth, height, filter);
+	
+	int errors = 0;
+	for (uint32_t x = 0; x < dstWidth; x++) {
+		int expected = (int) ((2.0 * x + 1) * srcWidth / (2.0 * dstWidth) * 255 / (srcWidth - 1));
+		int got = dst[x * 4];
+		if (abs(got - expected) > 2 || dst[x * 4 + 3] != 255) {
+			if (errors++ < 5)
+				std::cerr << name << " " << srcWidth << " -> " << dstWidth << ": x=" << x
+						<< " gave " << got << ", expected " << expected << std::endl;
+		}
+	}
+	return errors;
+}
+
+
+int main ()
+{
+	int errors = 0;
+	errors += check_ramp(8192, 3000, Vtf::FilterBilinear, "bilinear");
+	errors += check_ramp(8192, 3000, Vtf::FilterBox, "box");
+	errors += check_ramp(65535, 40000, Vtf::FilterBilinear, "bilinear");
+	errors += check_ramp(65535, 40000, Vtf::FilterBox, "box");
+	errors += check_ramp(300, 8192, Vtf::FilterBilinear, "bilinear");
+	
+	if (errors) {
+		std::cerr << errors << " bad columns" << std::endl;
+		return 1;
+	}
+	std::cout << "resample: ok" << std::endl;
+	return 0;
+}
@@ -0,0 +1,389 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <map>
+#include "vtf.h"
+#include "vtf-thread.h"
+
+
+namespace Vtf {
+
+
+#define CACHE_INDEX_NAME	"index"
+#define CACHE_INDEX_MAGIC	"vtf-cache 1"
+#define CACHE_BLOB_SUFFIX	".raw"
+/* stores and hits between two index writes */
+#define CACHE_FLUSH_CHANGES	64
+
+
+struct DiskCache::Private
+{
+	struct Entry {
+		uint64_t length;
+		uint64_t atime;
+	};
+	typedef std::map<uint64_t, Entry> EntryMap;
+	
+	std::string dir;
+	uint64_t budget;
+	uint64_t size;
+	uint64_t hits;
+	uint64_t misses;
+	uint32_t changes;
+	EntryMap entries;
+	Mutex mutex;
+	
+	std::string blobPath(uint64_t key) const
+	{
+		char name[32];
+		snprintf(name, sizeof(name), "/%016llx" CACHE_BLOB_SUFFIX, (unsigned long long) key);
+		return dir + name;
+	}
+	
+	void remove(EntryMap::iterator entry)
+	{
+		unlink(blobPath(entry->first).c_str());
+		size -= entry->second.length;
+		entries.erase(entry);
+	}
+	
+	/* Drops least recently used entries until NEEDED more bytes fit */
+	void evict(uint64_t needed)
+	{
+		if (size + needed <= budget)
+			return;
+		
+		std::vector<std::pair<uint64_t, uint64_t> > order;
+		for (EntryMap::iterator i = entries.begin(); i != entries.end(); ++i)
+			order.push_back(std::make_pair(i->second.atime, i->first));
+		std::sort(order.begin(), order.end());
+		
+		for (std::size_t i = 0; i < order.size() && size + needed > budget; i++)
+			remove(entries.find(order[i].second));
+	}
+	
+	/* Counts a store or a hit, writing the index every so often */
+	void changed()
+	{
+		if (++changes >= CACHE_FLUSH_CHANGES)
+			writeIndex();
+	}
+	
+	uint8_t* map(uint64_t key, std::size_t& length);
+	void readIndex(EntryMap& into) const;
+	void scanDir();
+	void writeIndex();
+};
+
+
+/* The index only remembers access times; blobs written by other
+	processes since it was saved are picked up by scanDir() */
+void DiskCache::Private::readIndex(EntryMap& into) const
+{
+	FILE* fp = fopen((dir + "/" CACHE_INDEX_NAME).c_str(), "r");
+	if (!fp)
+		return;
+	
+	char magic[32];
+	if (fgets(magic, sizeof(magic), fp) && strncmp(magic, CACHE_INDEX_MAGIC,
+			strlen(CACHE_INDEX_MAGIC)) == 0) {
+		unsigned long long key, length, atime;
+		while (fscanf(fp, "%llx %llu %llu", &key, &length, &atime) == 3) {
+			Entry& entry = into[key];
+			entry.length = length;
+			entry.atime = atime;
+		}
+	}
+	fclose(fp);
+}
+
+
+/* Reconciles the index with the blobs actually present */
+void DiskCache::Private::scanDir()
+{
+	DIR* dp = opendir(dir.c_str());
+	if (!dp)
+		return;
+	
+	EntryMap found;
+	struct dirent* de;
+	while ((de = readdir(dp))) {
+		const char* name = de->d_name;
+		if (strlen(name) != 16 + strlen(CACHE_BLOB_SUFFIX)
+				|| strcmp(name + 16, CACHE_BLOB_SUFFIX) != 0)
+			continue;
+		
+		char* end;
+		uint64_t key = strtoull(name, &end, 16);
+		struct stat st;
+		if (end != name + 16 || stat((dir + "/" + name).c_str(), &st) < 0)
+			continue;
+		
+		Entry& entry = found[key];
+		entry.length = st.st_size;
+		EntryMap::iterator known = entries.find(key);
+		entry.atime = known != entries.end() ? known->second.atime : st.st_mtime;
+	}
+	closedir(dp);
+	
+	entries.swap(found);
+	size = 0;
+	for (EntryMap::iterator i = entries.begin(); i != entries.end(); ++i)
+		size += i->second.length;
+}
+
+
+
+DiskCache::DiskCache(const std::string& dir, uint64_t budget)
+	: m_Priv(new Private)
+{
+	m_Priv->dir = dir;
+	m_Priv->budget = budget;
+	m_Priv->size = 0;
+	m_Priv->hits = 0;
+	m_Priv->misses = 0;
+	m_Priv->changes = 0;
+	
+	if (mkdir(dir.c_str(), 0700) < 0 && errno != EEXIST)
+		throw Exception(std::string("Could not create cache directory: ") + strerror(errno));
+	
+	m_Priv->readIndex(m_Priv->entries);
+	m_Priv->scanDir();
+	m_Priv->evict(0);
+}
+
+
+DiskCache::~DiskCache()
+{
+	flush();
+	delete m_Priv;
+}
+
+
+uint64_t DiskCache::makeKey(const uint8_t* payload, Format srcFormat, uint16_t width,
+		uint16_t height, Format dstFormat)
+{
+	uint64_t seed = ((uint64_t) (uint8_t) srcFormat << 48) | ((uint64_t) width << 32)
+			| ((uint64_t) height << 16) | (uint8_t) dstFormat;
+	return hash64(payload, getImageLength(srcFormat, width, height), seed);
+}
+
+
+uint8_t* DiskCache::Private::map(uint64_t key, std::size_t& length)
+{
+	EntryMap::iterator entry = entries.find(key);
+	if (entry == entries.end())
+		return NULL;
+	
+	int fd = open(blobPath(key).c_str(), O_RDONLY);
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st) < 0 || (uint64_t) st.st_size != entry->second.length
+			|| st.st_size == 0) {
+		/* removed or truncated behind our back */
+		if (fd >= 0)
+			close(fd);
+		remove(entry);
+		return NULL;
+	}
+	
+	/* private writable mapping, so callers may scribble over the pixels
+		without touching the cache */
+	void* data = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED)
+		return NULL;
+	
+	entry->second.atime = time(NULL);
+	length = st.st_size;
+	changed();
+	return static_cast<uint8_t*>(data);
+}
+
+
+uint8_t* DiskCache::find(uint64_t key, std::size_t& length)
+{
+	Lock lock(m_Priv->mutex);
+	uint8_t* data = m_Priv->map(key, length);
+	if (data)
+		m_Priv->hits++;
+	else
+		m_Priv->misses++;
+	return data;
+}
+
+
+bool DiskCache::store(uint64_t key, const uint8_t* data, std::size_t length)
+{
+	Lock lock(m_Priv->mutex);
+	
+	if (length > m_Priv->budget)
+		return false;
+	
+	Private::EntryMap::iterator entry = m_Priv->entries.find(key);
+	if (entry != m_Priv->entries.end())
+		m_Priv->remove(entry);
+	m_Priv->evict(length);
+	
+	/* write aside and rename, readers never see a partial blob */
+	std::string path = m_Priv->blobPath(key);
+	std::vector<char> tmp(path.begin(), path.end());
+	const char* suffix = ".XXXXXX";
+	tmp.insert(tmp.end(), suffix, suffix + strlen(suffix) + 1);
+	
+	int fd = mkstemp(&tmp[0]);
+	if (fd < 0)
+		return false;
+	
+	std::size_t done = 0;
+	while (done < length) {
+		ssize_t n = write(fd, data + done, length - done);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+		done += n;
+	}
+	
+	if (close(fd) < 0 || done < length || rename(&tmp[0], path.c_str()) < 0) {
+		unlink(&tmp[0]);
+		return false;
+	}
+	
+	Private::Entry& added = m_Priv->entries[key];
+	added.length = length;
+	added.atime = time(NULL);
+	m_Priv->size += length;
+	m_Priv->changed();
+	return true;
+}
+
+
+uint8_t* DiskCache::getImage(HiresImageResource* res, Format format, uint8_t mipmap,
+		uint16_t frame, uint16_t face, uint16_t slice, std::size_t& length)
+{
+	uint16_t width = std::max(res->width() >> mipmap, 1);
+	uint16_t height = std::max(res->height() >> mipmap, 1);
+	uint64_t key = makeKey(res->getImage(mipmap, frame, face, slice), res->format(),
+			width, height, format);
+	
+	uint8_t* data = find(key, length);
+	if (data)
+		return data;
+	
+	uint8_t* decoded = res->getImageAs(format, mipmap, frame, face, slice);
+	if (!decoded)
+		return NULL;
+	
+	length = getImageLength(format, width, height);
+	if (store(key, decoded, length)) {
+		Lock lock(m_Priv->mutex);
+		data = m_Priv->map(key, length);
+	}
+	
+	/* could not cache it; hand out an anonymous mapping so that
+		unmap() works the same either way */
+	if (!data) {
+		void* anon = mmap(NULL, length, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (anon != MAP_FAILED) {
+			data = static_cast<uint8_t*>(anon);
+			memcpy(data, decoded, length);
+		}
+	}
+	
+	delete[] decoded;
+	return data;
+}
+
+
+void DiskCache::unmap(uint8_t* data, std::size_t length)
+{
+	if (data)
+		munmap(data, length);
+}
+
+
+/* Other processes share the directory, so the index on disk is merged
+	rather than replaced: the later access time wins, and entries another
+	process added are kept as long as their blob is still there. */
+void DiskCache::Private::writeIndex()
+{
+	changes = 0;
+	
+	EntryMap saved;
+	readIndex(saved);
+	for (EntryMap::iterator i = saved.begin(); i != saved.end(); ++i) {
+		EntryMap::iterator known = entries.find(i->first);
+		if (known != entries.end()) {
+			known->second.atime = std::max(known->second.atime, i->second.atime);
+			continue;
+		}
+		
+		struct stat st;
+		if (stat(blobPath(i->first).c_str(), &st) == 0
+				&& (uint64_t) st.st_size == i->second.length) {
+			entries.insert(*i);
+			size += i->second.length;
+		}
+	}
+	
+	std::string path = dir + "/" CACHE_INDEX_NAME;
+	std::string tmp = path + ".XXXXXX";
+	int fd = mkstemp(&tmp[0]);
+	FILE* fp = fd >= 0 ? fdopen(fd, "w") : NULL;
+	if (!fp) {
+		if (fd >= 0) {
+			close(fd);
+			unlink(tmp.c_str());
+		}
+		return;
+	}
+	
+	fprintf(fp, CACHE_INDEX_MAGIC "\n");
+	for (EntryMap::const_iterator i = entries.begin(); i != entries.end(); ++i)
+		fprintf(fp, "%016llx %llu %llu\n", (unsigned long long) i->first,
+				(unsigned long long) i->second.length, (unsigned long long) i->second.atime);
+	
+	if (fclose(fp) != 0 || rename(tmp.c_str(), path.c_str()) < 0)
+		unlink(tmp.c_str());
+}
+
+
+void DiskCache::flush()
+{
+	Lock lock(m_Priv->mutex);
+	if (m_Priv->changes)
+		m_Priv->writeIndex();
+}
+
+
+uint64_t DiskCache::size() const
+{
+	Lock lock(m_Priv->mutex);
+	return m_Priv->size;
+}
+
+
+uint64_t DiskCache::hits() const
+{
+	Lock lock(m_Priv->mutex);
+	return m_Priv->hits;
+}
+
+
+uint64_t DiskCache::misses() const
+{
+	Lock lock(m_Priv->mutex);
+	return m_Priv->misses;
+}
+
+
+}
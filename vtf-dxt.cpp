@@ -0,0 +1,640 @@
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "vtf.h"
+#include "vtf-pixel.h"
+
+
+namespace Vtf {
+
+
+/* The QualityFast DXT encoder. Solid and two colour blocks are detected
+	up front and stored exactly (as far as 565 allows), everything else
+	gets the bounding box of its colours, inset by 1/16 of the range, as
+	endpoints. Far below squish's fits in quality on gradients, but good
+	enough for flat UI art and masks at a fraction of the cost. */
+
+
+static inline uint32_t
+quantize (uint32_t v, uint32_t bits)
+{
+	uint32_t x = v * ((1u << bits) - 1) + 127;
+	return (x + 1 + (x >> 8)) >> 8;
+}
+
+
+static inline uint32_t
+expand (uint32_t q, uint32_t bits)
+{
+	return (q << (8 - bits)) | (q >> (2 * bits - 8));
+}
+
+
+static inline uint16_t
+pack565 (uint32_t r, uint32_t g, uint32_t b)
+{
+	return (quantize(r, 5) << 11) | (quantize(g, 6) << 5) | quantize(b, 5);
+}
+
+
+static inline void
+unpack565 (uint16_t c, int32_t* rgb)
+{
+	rgb[0] = expand(c >> 11, 5);
+	rgb[1] = expand((c >> 5) & 0x3f, 6);
+	rgb[2] = expand(c & 0x1f, 5);
+}
+
+
+/* Endpoint pairs whose 2/3 : 1/3 mix comes closest to each 8 bit value,
+	so solid blocks are not limited to the 565 grid */
+struct SolidTable {
+	uint8_t hi5[256], lo5[256];
+	uint8_t hi6[256], lo6[256];
+	
+	SolidTable()
+	{
+		build(5, hi5, lo5);
+		build(6, hi6, lo6);
+	}
+	
+	/* every pair lands within 8 of its neighbours, so each only has to
+		be tried for the values around its own mix */
+	static void build(uint32_t bits, uint8_t* hi, uint8_t* lo)
+	{
+		uint32_t levels = 1u << bits;
+		int best[256];
+		std::fill(best, best + 256, 256);
+		for (uint32_t a = 0; a < levels; a++) {
+			for (uint32_t b = 0; b < levels; b++) {
+				int mix = (2 * expand(a, bits) + expand(b, bits)) / 3;
+				for (int v = std::max(mix - 8, 0); v <= std::min(mix + 8, 255); v++) {
+					if (std::abs(mix - v) < best[v]) {
+						best[v] = std::abs(mix - v);
+						hi[v] = a;
+						lo[v] = b;
+					}
+				}
+			}
+		}
+	}
+};
+
+
+static inline void
+writeColour (uint8_t* dst, uint16_t c0, uint16_t c1, uint32_t indices)
+{
+	dst[0] = c0;
+	dst[1] = c0 >> 8;
+	dst[2] = c1;
+	dst[3] = c1 >> 8;
+	dst[4] = indices;
+	dst[5] = indices >> 8;
+	dst[6] = indices >> 16;
+	dst[7] = indices >> 24;
+}
+
+
+/* True if all 16 pixels have the colour of the first one, alpha ignored */
+static inline bool
+isSolid (const uint32_t* px)
+{
+#ifdef __SSE2__
+	__m128i alpha = _mm_set1_epi32(0xff000000);
+	__m128i first = _mm_or_si128(_mm_set1_epi32(px[0]), alpha);
+	__m128i eq = _mm_set1_epi32(-1);
+	for (int i = 0; i < 16; i += 4) {
+		__m128i p = _mm_or_si128(_mm_loadu_si128((const __m128i*) (px + i)), alpha);
+		eq = _mm_and_si128(eq, _mm_cmpeq_epi32(p, first));
+	}
+	return _mm_movemask_epi8(eq) == 0xffff;
+#else
+	for (int i = 1; i < 16; i++)
+		if ((px[i] ^ px[0]) & 0xffffff)
+			return false;
+	return true;
+#endif
+}
+
+
+static void
+compressSolid (uint32_t p, uint8_t* dst)
+{
+	static const SolidTable table;
+	uint32_t r = p & 0xff, g = (p >> 8) & 0xff, b = (p >> 16) & 0xff;
+	uint16_t c0 = (table.hi5[r] << 11) | (table.hi6[g] << 5) | table.hi5[b];
+	uint16_t c1 = (table.lo5[r] << 11) | (table.lo6[g] << 5) | table.lo5[b];
+	
+	/* every pixel at 2/3 c0 + 1/3 c1; index 3 once the endpoints are
+		swapped to stay in the 4 colour mode */
+	if (c0 > c1)
+		writeColour(dst, c0, c1, 0xaaaaaaaa);
+	else if (c0 < c1)
+		writeColour(dst, c1, c0, 0xffffffff);
+	else
+		writeColour(dst, c0, c1, 0);
+}
+
+
+/* Exactly two colours: both become endpoints, every pixel picks one */
+static bool
+compressTwoColour (const uint32_t* px, uint8_t* dst)
+{
+	uint32_t a = px[0] & 0xffffff, b = a;
+	uint32_t mask = 0;
+	for (int i = 1; i < 16; i++) {
+		uint32_t p = px[i] & 0xffffff;
+		if (p == a)
+			continue;
+		if (b == a)
+			b = p;
+		else if (p != b)
+			return false;
+		mask |= 1u << i;
+	}
+	
+	uint16_t c0 = pack565(a & 0xff, (a >> 8) & 0xff, a >> 16);
+	uint16_t c1 = pack565(b & 0xff, (b >> 8) & 0xff, b >> 16);
+	if (c0 == c1) {
+		writeColour(dst, c0, c1, 0);
+		return true;
+	}
+	
+	/* 4 colour mode needs c0 > c1; index 0 is c0, 1 is c1 */
+	uint32_t idx_a = 0, idx_b = 1;
+	if (c0 < c1) {
+		std::swap(c0, c1);
+		std::swap(idx_a, idx_b);
+	}
+	
+	uint32_t indices = 0;
+	for (int i = 0; i < 16; i++)
+		indices |= ((mask >> i) & 1 ? idx_b : idx_a) << (i * 2);
+	writeColour(dst, c0, c1, indices);
+	return true;
+}
+
+
+/* Per byte minimum and maximum over the 16 pixels */
+static inline void
+blockRange (const uint32_t* px, uint32_t& lo, uint32_t& hi)
+{
+#ifdef __SSE2__
+	__m128i vlo = _mm_loadu_si128((const __m128i*) px);
+	__m128i vhi = vlo;
+	for (int i = 4; i < 16; i += 4) {
+		__m128i p = _mm_loadu_si128((const __m128i*) (px + i));
+		vlo = _mm_min_epu8(vlo, p);
+		vhi = _mm_max_epu8(vhi, p);
+	}
+	vlo = _mm_min_epu8(vlo, _mm_shuffle_epi32(vlo, _MM_SHUFFLE(1, 0, 3, 2)));
+	vlo = _mm_min_epu8(vlo, _mm_shuffle_epi32(vlo, _MM_SHUFFLE(2, 3, 0, 1)));
+	vhi = _mm_max_epu8(vhi, _mm_shuffle_epi32(vhi, _MM_SHUFFLE(1, 0, 3, 2)));
+	vhi = _mm_max_epu8(vhi, _mm_shuffle_epi32(vhi, _MM_SHUFFLE(2, 3, 0, 1)));
+	lo = _mm_cvtsi128_si32(vlo);
+	hi = _mm_cvtsi128_si32(vhi);
+#else
+	lo = hi = px[0];
+	for (int i = 1; i < 16; i++) {
+		uint32_t l = 0, h = 0;
+		for (int c = 0; c < 32; c += 8) {
+			uint32_t v = (px[i] >> c) & 0xff;
+			l |= std::min(v, (lo >> c) & 0xff) << c;
+			h |= std::max(v, (hi >> c) & 0xff) << c;
+		}
+		lo = l;
+		hi = h;
+	}
+#endif
+}
+
+
+/* Position of each pixel along AXIS from BASE (both R, G, B, A),
+	clamped to [0, LIMIT] and scaled to the nearest of 0..STEPS */
+static inline void
+project (const uint32_t* px, const int32_t* base, const int32_t* axis, int32_t limit,
+		uint32_t steps, uint32_t* pos)
+{
+	float scale = (float) steps / limit;
+	
+#ifdef __SSE2__
+	__m128i zero = _mm_setzero_si128();
+	__m128i vbase = _mm_setr_epi16(base[0], base[1], base[2], base[3],
+			base[0], base[1], base[2], base[3]);
+	__m128i vaxis = _mm_setr_epi16(axis[0], axis[1], axis[2], axis[3],
+			axis[0], axis[1], axis[2], axis[3]);
+	__m128 vlimit = _mm_set1_ps((float) limit);
+	__m128 vscale = _mm_set1_ps(scale);
+	__m128 half = _mm_set1_ps(0.5f);
+	
+	for (int i = 0; i < 16; i += 4) {
+		__m128i p = _mm_loadu_si128((const __m128i*) (px + i));
+		/* two pixels per register as 16 bit channels; madd leaves the
+			R+G and B+A halves of each dot product */
+		__m128i d01 = _mm_madd_epi16(_mm_sub_epi16(_mm_unpacklo_epi8(p, zero), vbase), vaxis);
+		__m128i d23 = _mm_madd_epi16(_mm_sub_epi16(_mm_unpackhi_epi8(p, zero), vbase), vaxis);
+		__m128 even = _mm_shuffle_ps(_mm_castsi128_ps(d01), _mm_castsi128_ps(d23),
+				_MM_SHUFFLE(2, 0, 2, 0));
+		__m128 odd = _mm_shuffle_ps(_mm_castsi128_ps(d01), _mm_castsi128_ps(d23),
+				_MM_SHUFFLE(3, 1, 3, 1));
+		__m128 d = _mm_cvtepi32_ps(_mm_add_epi32(_mm_castps_si128(even),
+				_mm_castps_si128(odd)));
+		d = _mm_min_ps(_mm_max_ps(d, _mm_setzero_ps()), vlimit);
+		__m128i k = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(d, vscale), half));
+		_mm_storeu_si128((__m128i*) (pos + i), k);
+	}
+#else
+	for (int i = 0; i < 16; i++) {
+		int32_t d = 0;
+		for (int c = 0; c < 4; c++)
+			d += ((int32_t) ((px[i] >> (c * 8)) & 0xff) - base[c]) * axis[c];
+		d = std::max(0, std::min(d, limit));
+		pos[i] = (uint32_t) (d * scale + 0.5f);
+	}
+#endif
+}
+
+
+/* Bounding box endpoints. With DXT1 alpha, pixels with alpha < 128 are
+	transparent and the block goes to the 3 colour mode, where index 3
+	is transparent. */
+static void
+compressBox (const uint32_t* px, uint8_t* dst, bool dxt1Alpha)
+{
+	uint32_t transparent = 0;
+	uint32_t opaque[16];
+	
+	/* transparent pixels take the colour of an opaque one, so that they
+		do not widen the box */
+	if (dxt1Alpha) {
+		int first = -1;
+		for (int i = 0; i < 16; i++) {
+			if ((px[i] >> 24) < 128)
+				transparent |= 1u << i;
+			else if (first < 0)
+				first = i;
+		}
+		if (first < 0) {
+			writeColour(dst, 0, 0, 0xffffffff);
+			return;
+		}
+		for (int i = 0; i < 16; i++)
+			opaque[i] = transparent & (1u << i) ? px[first] : px[i];
+		px = opaque;
+	}
+	
+	uint32_t range_lo, range_hi;
+	blockRange(px, range_lo, range_hi);
+	
+	int32_t lo[3], hi[3], mid[3];
+	for (int c = 0; c < 3; c++) {
+		lo[c] = (range_lo >> (c * 8)) & 0xff;
+		hi[c] = (range_hi >> (c * 8)) & 0xff;
+		int32_t inset = (hi[c] - lo[c]) >> 4;
+		lo[c] += inset;
+		hi[c] -= inset;
+		mid[c] = (lo[c] + hi[c]) >> 1;
+	}
+	
+	/* the box diagonal may run against a channel; follow the sign of its
+		covariance with green */
+	int32_t cov_r = 0, cov_b = 0;
+	for (int i = 0; i < 16; i++) {
+		int32_t dg = (int32_t) ((px[i] >> 8) & 0xff) - mid[1];
+		cov_r += ((int32_t) (px[i] & 0xff) - mid[0]) * dg;
+		cov_b += ((int32_t) ((px[i] >> 16) & 0xff) - mid[2]) * dg;
+	}
+	if (cov_r < 0)
+		std::swap(lo[0], hi[0]);
+	if (cov_b < 0)
+		std::swap(lo[2], hi[2]);
+	
+	uint16_t c0 = pack565(hi[0], hi[1], hi[2]);
+	uint16_t c1 = pack565(lo[0], lo[1], lo[2]);
+	bool four = !transparent;
+	if (four ? c0 < c1 : c0 > c1)
+		std::swap(c0, c1);
+	
+	/* project on the line between the decoded endpoints */
+	int32_t e0[3], e1[3];
+	unpack565(c0, e0);
+	unpack565(c1, e1);
+	int32_t base[4] = {e1[0], e1[1], e1[2], 0};
+	int32_t axis[4] = {e0[0] - e1[0], e0[1] - e1[1], e0[2] - e1[2], 0};
+	int32_t len2 = axis[0] * axis[0] + axis[1] * axis[1] + axis[2] * axis[2];
+	
+	static const uint32_t order4[4] = {1, 3, 2, 0};	/* from c1 to c0 */
+	static const uint32_t order3[3] = {1, 2, 0};
+	uint32_t pos[16] = {0};
+	if (len2)
+		project(px, base, axis, len2, four ? 3 : 2, pos);
+	
+	const uint32_t* order = four ? order4 : order3;
+	uint32_t indices = 0;
+	for (int i = 0; i < 16; i++)
+		indices |= (order[pos[i]] | ((transparent >> i) & 1) * 3) << (i * 2);
+	writeColour(dst, c0, c1, indices);
+}
+
+
+/* 8 alpha mode: a0 > a1, index 0 and 1 are the endpoints, 2..7 the steps
+	from a0 towards a1 */
+static void
+compressAlpha (const uint32_t* px, uint8_t* dst)
+{
+	uint32_t range_lo, range_hi;
+	blockRange(px, range_lo, range_hi);
+	int32_t lo = range_lo >> 24, hi = range_hi >> 24;
+	
+	if (lo == hi) {
+		memset(dst, 0, 8);
+		dst[0] = dst[1] = hi;
+		return;
+	}
+	
+	/* no inset when only the two extremes occur, e.g. masks */
+	bool two = true;
+	for (int i = 0; i < 16 && two; i++) {
+		int32_t a = px[i] >> 24;
+		two = a == lo || a == hi;
+	}
+	if (!two) {
+		int32_t inset = (hi - lo) >> 5;
+		lo += inset;
+		hi -= inset;
+	}
+	
+	static const int32_t axis[4] = {0, 0, 0, 1};
+	int32_t base[4] = {0, 0, 0, lo};
+	uint32_t pos[16];
+	project(px, base, axis, hi - lo, 7, pos);
+	
+	/* 7 -> 0, 0 -> 1 and the rest to 8 - pos, without branches */
+	uint64_t bits = 0;
+	for (int i = 0; i < 16; i++) {
+		uint64_t idx = (8 - pos[i]) & 7;
+		bits |= (idx ^ (idx < 2)) << (i * 3);
+	}
+	
+	dst[0] = hi;
+	dst[1] = lo;
+	for (int i = 0; i < 6; i++)
+		dst[2 + i] = bits >> (i * 8);
+}
+
+
+static void
+compressExplicitAlpha (const uint32_t* px, uint8_t* dst)
+{
+	for (int i = 0; i < 16; i += 2)
+		dst[i / 2] = quantize(px[i] >> 24, 4) | (quantize(px[i + 1] >> 24, 4) << 4);
+}
+
+
+void
+compressFast (const uint8_t* rgba, uint16_t width, uint16_t height, uint8_t* dst,
+		int flags)
+{
+	bool alpha = !(flags & squish::kDxt1);
+	uint32_t px[16];
+	
+	for (uint32_t by = 0; by < height; by += 4) {
+		for (uint32_t bx = 0; bx < width; bx += 4) {
+			/* edge blocks repeat the last row and column */
+			for (uint32_t y = 0; y < 4; y++) {
+				const uint8_t* row = rgba + std::min<uint32_t>(by + y, height - 1) * width * 4;
+				for (uint32_t x = 0; x < 4; x++)
+					memcpy(&px[y * 4 + x], row + std::min<uint32_t>(bx + x, width - 1) * 4, 4);
+			}
+			
+			if (flags & squish::kDxt5) {
+				compressAlpha(px, dst);
+				dst += 8;
+			} else if (flags & squish::kDxt3) {
+				compressExplicitAlpha(px, dst);
+				dst += 8;
+			}
+			
+			bool dxt1_alpha = false;
+			if (!alpha)
+				for (int i = 0; i < 16 && !dxt1_alpha; i++)
+					dxt1_alpha = (px[i] >> 24) < 128;
+			
+			if (dxt1_alpha)
+				compressBox(px, dst, true);
+			else if (isSolid(px))
+				compressSolid(px[0], dst);
+			else if (!compressTwoColour(px, dst))
+				compressBox(px, dst, false);
+			dst += 8;
+		}
+	}
+}
+
+/* Alpha plane only. DXT3 and DXT5 never read the colour half of a block;
+	DXT1 reads the endpoints and only looks at the indices in 3 colour
+	blocks, the only ones that can be transparent. Values match squish's
+	decoder bit for bit. */
+
+
+static inline void
+decompressAlphaDXT1 (const uint8_t* src, uint8_t* alpha)
+{
+	uint16_t c0 = src[0] | (src[1] << 8);
+	uint16_t c1 = src[2] | (src[3] << 8);
+	if (c0 > c1) {
+		memset(alpha, 255, 16);
+		return;
+	}
+	
+	for (int i = 0; i < 16; i++)
+		alpha[i] = ((src[4 + i / 4] >> ((i % 4) * 2)) & 3) == 3 ? 0 : 255;
+}
+
+
+static inline void
+decompressAlphaDXT3 (const uint8_t* src, uint8_t* alpha)
+{
+	for (int i = 0; i < 8; i++) {
+		uint8_t lo = src[i] & 0x0f;
+		uint8_t hi = src[i] & 0xf0;
+		alpha[i * 2] = lo | (lo << 4);
+		alpha[i * 2 + 1] = hi | (hi >> 4);
+	}
+}
+
+
+static inline void
+decompressAlphaDXT5 (const uint8_t* src, uint8_t* alpha)
+{
+	uint32_t a0 = src[0];
+	uint32_t a1 = src[1];
+	uint64_t bits = 0;
+	for (int i = 0; i < 6; i++)
+		bits |= (uint64_t) src[2 + i] << (i * 8);
+	
+	/* all on the first endpoint, typical for opaque and cut out areas */
+	if (bits == 0) {
+		memset(alpha, a0, 16);
+		return;
+	}
+	
+	uint8_t codes[8];
+	codes[0] = a0;
+	codes[1] = a1;
+	if (a0 > a1) {
+		for (uint32_t i = 1; i < 7; i++)
+			codes[1 + i] = ((7 - i) * a0 + i * a1) / 7;
+	} else {
+		for (uint32_t i = 1; i < 5; i++)
+			codes[1 + i] = ((5 - i) * a0 + i * a1) / 5;
+		codes[6] = 0;
+		codes[7] = 255;
+	}
+	
+	for (int i = 0; i < 16; i++, bits >>= 3)
+		alpha[i] = codes[bits & 7];
+}
+
+
+void
+decompressAlpha (const uint8_t* src, int flags, uint8_t* dst, uint16_t width,
+		uint16_t height)
+{
+	uint32_t block_size = (flags & squish::kDxt1) ? 8 : 16;
+	uint8_t alpha[16];
+	
+	for (uint32_t by = 0; by < height; by += 4) {
+		for (uint32_t bx = 0; bx < width; bx += 4, src += block_size) {
+			if (flags & squish::kDxt5)
+				decompressAlphaDXT5(src, alpha);
+			else if (flags & squish::kDxt3)
+				decompressAlphaDXT3(src, alpha);
+			else
+				decompressAlphaDXT1(src, alpha);
+			
+			uint32_t w = std::min<uint32_t>(4, width - bx);
+			for (uint32_t py = 0; py < 4 && by + py < height; py++)
+				memcpy(dst + (by + py) * width + bx, alpha + py * 4, w);
+		}
+	}
+}
+
+/* Statistics without decoding. A block holds at most four colours and
+	eight alphas, so each palette entry is weighted by the number of
+	pixels inside the image that use it. Palettes are built as squish
+	builds them, so the results equal those of a full decode. */
+
+
+static inline uint32_t
+popcount (uint32_t x)
+{
+	x = x - ((x >> 1) & 0x55555555);
+	x = (x & 0x33333333) + ((x >> 2) & 0x33333333);
+	return (((x + (x >> 4)) & 0x0f0f0f0f) * 0x01010101) >> 24;
+}
+
+
+static inline uint32_t
+luminance (const int32_t* rgb)
+{
+	return (rgb[0] * 77 + rgb[1] * 150 + rgb[2] * 29) >> 8;
+}
+
+
+void
+statsDXT (const uint8_t* src, int flags, uint16_t width, uint16_t height,
+		uint64_t* sum, ImageStats& stats)
+{
+	bool dxt1 = flags & squish::kDxt1;
+	uint32_t block_size = dxt1 ? 8 : 16;
+	
+	for (uint32_t by = 0; by < height; by += 4) {
+		uint32_t rows = std::min<uint32_t>(4, height - by);
+		for (uint32_t bx = 0; bx < width; bx += 4, src += block_size) {
+			/* low bit of each 2 bit index slot that lies inside the image */
+			uint32_t cols = std::min<uint32_t>(4, width - bx);
+			uint32_t valid = 0;
+			for (uint32_t py = 0; py < rows; py++)
+				valid |= (0x55u >> (8 - cols * 2)) << (py * 8);
+			
+			const uint8_t* colour = dxt1 ? src : src + 8;
+			uint16_t c0 = colour[0] | (colour[1] << 8);
+			uint16_t c1 = colour[2] | (colour[3] << 8);
+			bool three = dxt1 && c0 <= c1;
+			int32_t pal[4][3];
+			unpack565(c0, pal[0]);
+			unpack565(c1, pal[1]);
+			for (int c = 0; c < 3; c++) {
+				if (three) {
+					pal[2][c] = (pal[0][c] + pal[1][c]) / 2;
+					pal[3][c] = 0;
+				} else {
+					pal[2][c] = (2 * pal[0][c] + pal[1][c]) / 3;
+					pal[3][c] = (pal[0][c] + 2 * pal[1][c]) / 3;
+				}
+			}
+			
+			uint32_t indices = colour[4] | (colour[5] << 8) | (colour[6] << 16)
+					| ((uint32_t) colour[7] << 24);
+			uint32_t lo = indices & 0x55555555;
+			uint32_t hi = (indices >> 1) & 0x55555555;
+			uint32_t used[4];
+			used[0] = popcount(~(lo | hi) & valid);
+			used[1] = popcount(lo & ~hi & valid);
+			used[2] = popcount(hi & ~lo & valid);
+			used[3] = popcount(lo & hi & valid);
+			
+			for (int k = 0; k < 4; k++) {
+				if (!used[k])
+					continue;
+				for (int c = 0; c < 3; c++)
+					sum[c] += used[k] * pal[k][c];
+				stats.luminance[luminance(pal[k])] += used[k];
+			}
+			
+			if (dxt1) {
+				uint32_t transparent = three ? used[3] : 0;
+				stats.alpha[0] += transparent;
+				stats.alpha[255] += rows * cols - transparent;
+			} else if (flags & squish::kDxt3) {
+				for (int i = 0; i < 16; i++) {
+					if (!((valid >> (i * 2)) & 1))
+						continue;
+					uint8_t a = (src[i / 2] >> ((i % 2) * 4)) & 0x0f;
+					stats.alpha[a | (a << 4)]++;
+				}
+			} else {
+				uint32_t a0 = src[0];
+				uint32_t a1 = src[1];
+				uint64_t bits = 0;
+				for (int i = 0; i < 6; i++)
+					bits |= (uint64_t) src[2 + i] << (i * 8);
+				
+				uint32_t codes[8], counts[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+				codes[0] = a0;
+				codes[1] = a1;
+				if (a0 > a1) {
+					for (uint32_t i = 1; i < 7; i++)
+						codes[1 + i] = ((7 - i) * a0 + i * a1) / 7;
+				} else {
+					for (uint32_t i = 1; i < 5; i++)
+						codes[1 + i] = ((5 - i) * a0 + i * a1) / 5;
+					codes[6] = 0;
+					codes[7] = 255;
+				}
+				
+				for (int i = 0; i < 16; i++, bits >>= 3)
+					counts[bits & 7] += (valid >> (i * 2)) & 1;
+				for (int k = 0; k < 8; k++)
+					stats.alpha[codes[k]] += counts[k];
+			}
+		}
+	}
+}
+
+
+}
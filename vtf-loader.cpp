@@ -0,0 +1,402 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <map>
+#include "vtf.h"
+#include "vtf-thread.h"
+
+
+namespace Vtf {
+
+
+/* Reads whole file into memory with as few pread(2) calls as possible.
+	The kernel is told up front that all of it is going to be needed,
+	so on network file systems read-ahead is issued for the entire file. */
+static void
+readFile (const std::string& fname, std::vector<char>& buffer)
+{
+	int fd = open(fname.c_str(), O_RDONLY);
+	if (fd < 0)
+		throw Exception(std::string("Could not open file: ") + strerror(errno));
+	
+	struct stat st;
+	if (fstat(fd, &st) < 0) {
+		close(fd);
+		throw Exception(std::string("Could not stat file: ") + strerror(errno));
+	}
+	
+#ifdef POSIX_FADV_WILLNEED
+	posix_fadvise(fd, 0, st.st_size, POSIX_FADV_WILLNEED);
+#endif
+	
+	buffer.resize(st.st_size);
+	std::size_t done = 0;
+	while (done < buffer.size()) {
+		ssize_t n = pread(fd, &buffer[done], buffer.size() - done, done);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			close(fd);
+			throw Exception("Could not read file");
+		}
+		done += n;
+	}
+	
+	close(fd);
+}
+
+
+
+struct Loader::Private
+{
+	Private(unsigned int threads) : pool(threads), nextTicket(0), pending(0)
+		{}
+	
+	ThreadPool pool;
+	Mutex mutex;
+	Cond done;
+	std::deque<Result> results;
+	uint32_t nextTicket;
+	uint32_t pending;
+};
+
+
+class LoadTask : public Task
+{
+public:
+	LoadTask(Loader::Private* priv, uint32_t ticket, const std::string& fname)
+		: m_Priv(priv), m_Ticket(ticket), m_FileName(fname)
+		{}
+	
+	void run()
+	{
+		Loader::Result res;
+		res.ticket = m_Ticket;
+		res.fname = m_FileName;
+		res.file = NULL;
+		
+		File* file = new File;
+		try {
+			std::vector<char> buffer;
+			readFile(m_FileName, buffer);
+			Status status = file->tryLoad(buffer.empty() ? NULL : &buffer[0], buffer.size());
+			if (status == StatusOk)
+				res.file = file;
+			else
+				res.error = statusToString(status);
+		} catch (std::exception& e) {
+			res.error = e.what();
+		}
+		if (!res.file)
+			delete file;
+		
+		Lock lock(m_Priv->mutex);
+		m_Priv->results.push_back(res);
+		m_Priv->done.signal();
+	}
+	
+private:
+	Loader::Private* m_Priv;
+	uint32_t m_Ticket;
+	std::string m_FileName;
+};
+
+
+
+Loader::Loader(unsigned int threads)
+	: m_Priv(new Private(threads))
+{
+}
+
+
+Loader::~Loader()
+{
+	m_Priv->pool.wait();
+	
+	for (std::deque<Result>::iterator i = m_Priv->results.begin();
+			i != m_Priv->results.end(); ++i)
+		delete i->file;
+	
+	delete m_Priv;
+}
+
+
+uint32_t Loader::submit(const std::string& fname)
+{
+	uint32_t ticket;
+	{
+		Lock lock(m_Priv->mutex);
+		ticket = m_Priv->nextTicket++;
+		m_Priv->pending++;
+	}
+	
+	m_Priv->pool.push(new LoadTask(m_Priv, ticket, fname));
+	return ticket;
+}
+
+
+bool Loader::wait(Result& result)
+{
+	Lock lock(m_Priv->mutex);
+	if (m_Priv->pending == 0)
+		return false;
+	
+	while (m_Priv->results.empty())
+		m_Priv->done.wait(m_Priv->mutex);
+	
+	result = m_Priv->results.front();
+	m_Priv->results.pop_front();
+	m_Priv->pending--;
+	return true;
+}
+
+
+bool Loader::poll(Result& result)
+{
+	Lock lock(m_Priv->mutex);
+	if (m_Priv->results.empty())
+		return false;
+	
+	result = m_Priv->results.front();
+	m_Priv->results.pop_front();
+	m_Priv->pending--;
+	return true;
+}
+
+
+uint32_t Loader::pending() const
+{
+	Lock lock(m_Priv->mutex);
+	return m_Priv->pending;
+}
+
+
+
+
+
+struct BatchLoader::Private
+{
+	Private(unsigned int threads) : decoders(threads), reader(1), readAhead(0),
+		budget(64 * 1024 * 1024), inputOrder(false)
+		{}
+	
+	ThreadPool decoders;
+	ThreadPool reader;
+	unsigned int readAhead;
+	uint64_t budget;
+	bool inputOrder;
+	LoadOptions options;
+	
+	/* state of the running batch */
+	Mutex mutex;
+	Cond changed;
+	const std::vector<std::string>* files;
+	std::map<uint32_t, Loader::Result> results;
+	std::map<uint32_t, uint64_t> sizes;
+	unsigned int inFlight;
+	uint64_t inFlightBytes;
+	bool cancelled;
+	
+	void finish(uint32_t index, const Loader::Result& result)
+	{
+		Lock lock(mutex);
+		results[index] = result;
+		changed.broadcast();
+	}
+};
+
+
+class BatchDecodeTask : public Task
+{
+public:
+	BatchDecodeTask(BatchLoader::Private* priv, uint32_t index, std::vector<char>* buffer)
+		: m_Priv(priv), m_Index(index), m_Buffer(buffer)
+		{}
+	
+	~BatchDecodeTask()
+		{delete m_Buffer;}
+	
+	void run()
+	{
+		Loader::Result res;
+		res.ticket = m_Index;
+		res.fname = (*m_Priv->files)[m_Index];
+		res.file = NULL;
+		
+		File* file = new File;
+		Status status = file->tryLoad(m_Buffer->empty() ? NULL : &(*m_Buffer)[0],
+				m_Buffer->size(), NULL, NULL, &m_Priv->options);
+		if (status == StatusOk) {
+			res.file = file;
+		} else {
+			res.error = statusToString(status);
+			delete file;
+		}
+		
+		/* the compressed copy is not needed any more */
+		delete m_Buffer;
+		m_Buffer = NULL;
+		m_Priv->finish(m_Index, res);
+	}
+	
+private:
+	BatchLoader::Private* m_Priv;
+	uint32_t m_Index;
+	std::vector<char>* m_Buffer;
+};
+
+
+/* Reads the files one after another, so the disk sees a sequential
+	stream, and hands them to the decoders. Stalls while too many files
+	or bytes are in flight. */
+class BatchReadTask : public Task
+{
+public:
+	BatchReadTask(BatchLoader::Private* priv)
+		: m_Priv(priv)
+		{}
+	
+	void run()
+	{
+		const std::vector<std::string>& files = *m_Priv->files;
+		
+		for (uint32_t i = 0; i < files.size(); i++) {
+			struct stat st;
+			uint64_t size = stat(files[i].c_str(), &st) == 0 ? st.st_size : 0;
+			
+			{
+				Lock lock(m_Priv->mutex);
+				while (!m_Priv->cancelled && m_Priv->inFlight > 0
+						&& (m_Priv->inFlight >= m_Priv->readAhead
+						|| m_Priv->inFlightBytes + size > m_Priv->budget))
+					m_Priv->changed.wait(m_Priv->mutex);
+				if (m_Priv->cancelled)
+					return;
+				m_Priv->inFlight++;
+				m_Priv->inFlightBytes += size;
+				m_Priv->sizes[i] = size;
+			}
+			
+			std::vector<char>* buffer = new std::vector<char>;
+			try {
+				readFile(files[i], *buffer);
+			} catch (std::exception& e) {
+				delete buffer;
+				Loader::Result res;
+				res.ticket = i;
+				res.fname = files[i];
+				res.file = NULL;
+				res.error = e.what();
+				m_Priv->finish(i, res);
+				continue;
+			}
+			
+			m_Priv->decoders.push(new BatchDecodeTask(m_Priv, i, buffer));
+		}
+	}
+	
+private:
+	BatchLoader::Private* m_Priv;
+};
+
+
+
+BatchLoader::BatchLoader(unsigned int threads)
+	: m_Priv(new Private(threads))
+{
+	m_Priv->readAhead = m_Priv->decoders.threadCount() * 2;
+}
+
+
+BatchLoader::~BatchLoader()
+{
+	delete m_Priv;
+}
+
+
+void BatchLoader::setReadAhead(unsigned int files)
+{
+	m_Priv->readAhead = files > 0 ? files : 1;
+}
+
+
+void BatchLoader::setByteBudget(uint64_t bytes)
+{
+	m_Priv->budget = bytes;
+}
+
+
+void BatchLoader::setInputOrder(bool inputOrder)
+{
+	m_Priv->inputOrder = inputOrder;
+}
+
+
+void BatchLoader::setLoadOptions(const LoadOptions& options)
+{
+	m_Priv->options = options;
+}
+
+
+void BatchLoader::run(const std::vector<std::string>& files, Callback callback, void* data)
+{
+	Private* priv = m_Priv;
+	
+	priv->files = &files;
+	priv->results.clear();
+	priv->sizes.clear();
+	priv->inFlight = 0;
+	priv->inFlightBytes = 0;
+	priv->cancelled = false;
+	priv->reader.push(new BatchReadTask(priv));
+	
+	uint32_t next = 0;
+	try {
+		for (uint32_t delivered = 0; delivered < files.size(); delivered++) {
+			Loader::Result res;
+			{
+				Lock lock(priv->mutex);
+				std::map<uint32_t, Loader::Result>::iterator it;
+				for (;;) {
+					it = priv->inputOrder ? priv->results.find(next) : priv->results.begin();
+					if (it != priv->results.end())
+						break;
+					priv->changed.wait(priv->mutex);
+				}
+				res = it->second;
+				priv->results.erase(it);
+				next++;
+			}
+			
+			callback(res, data);
+			
+			Lock lock(priv->mutex);
+			priv->inFlight--;
+			priv->inFlightBytes -= priv->sizes[res.ticket];
+			priv->sizes.erase(res.ticket);
+			priv->changed.broadcast();
+		}
+	} catch (...) {
+		/* stop reading, let running decodes finish and drop their files */
+		{
+			Lock lock(priv->mutex);
+			priv->cancelled = true;
+			priv->changed.broadcast();
+		}
+		priv->reader.wait();
+		priv->decoders.wait();
+		for (std::map<uint32_t, Loader::Result>::iterator i = priv->results.begin();
+				i != priv->results.end(); ++i)
+			delete i->second.file;
+		priv->results.clear();
+		throw;
+	}
+	
+	priv->reader.wait();
+	priv->decoders.wait();
+}
+
+
+}
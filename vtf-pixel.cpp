@@ -0,0 +1,1198 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "vtf.h"
+#include "vtf-pixel.h"
+
+
+namespace Vtf {
+
+
+/* Source span [spans[i], spans[i + 1]) covered by destination column or row i.
+	When upscaling a span may be empty; the single pixel at its start is used. */
+static void
+calcSpans (uint16_t src, uint16_t dst, std::vector<uint32_t>& spans)
+{
+	spans.resize(dst + 1);
+	for (uint32_t i = 0; i <= dst; i++)
+		spans[i] = (uint32_t) i * src / dst;
+}
+
+
+static void
+resampleBox (const uint8_t* src, uint16_t srcWidth, uint16_t srcHeight,
+		uint8_t* dst, uint16_t dstWidth, uint16_t dstHeight)
+{
+	std::vector<uint32_t> xs, ys;
+	calcSpans(srcWidth, dstWidth, xs);
+	calcSpans(srcHeight, dstHeight, ys);
+	
+	for (uint32_t y = 0; y < dstHeight; y++) {
+		uint32_t y0 = ys[y], y1 = ys[y + 1] > y0 ? ys[y + 1] : y0 + 1;
+		
+		for (uint32_t x = 0; x < dstWidth; x++) {
+			uint32_t x0 = xs[x], x1 = xs[x + 1] > x0 ? xs[x + 1] : x0 + 1;
+			uint32_t count = (x1 - x0) * (y1 - y0);
+			uint8_t* out = dst + (y * dstWidth + x) * 4;
+			
+#ifdef __SSE2__
+			const __m128i zero = _mm_setzero_si128();
+			__m128i sum = _mm_setzero_si128();
+			for (uint32_t sy = y0; sy < y1; sy++) {
+				const uint8_t* row = src + (sy * srcWidth + x0) * 4;
+				uint32_t n = x1 - x0, sx = 0;
+				__m128i acc16 = _mm_setzero_si128();
+				/* two pixels per step; 16 bit lanes are safe for 128 pixels */
+				for (; sx + 2 <= n; sx += 2) {
+					__m128i px = _mm_loadl_epi64((const __m128i*) (row + sx * 4));
+					acc16 = _mm_add_epi16(acc16, _mm_unpacklo_epi8(px, zero));
+					if ((sx & 0xfe) == 0xfe) {
+						sum = _mm_add_epi32(sum, _mm_unpacklo_epi16(acc16, zero));
+						sum = _mm_add_epi32(sum, _mm_unpackhi_epi16(acc16, zero));
+						acc16 = _mm_setzero_si128();
+					}
+				}
+				sum = _mm_add_epi32(sum, _mm_unpacklo_epi16(acc16, zero));
+				sum = _mm_add_epi32(sum, _mm_unpackhi_epi16(acc16, zero));
+				if (sx < n) {
+					__m128i px = _mm_cvtsi32_si128(*(const int*) (row + sx * 4));
+					sum = _mm_add_epi32(sum, _mm_unpacklo_epi16(
+							_mm_unpacklo_epi8(px, zero), zero));
+				}
+			}
+			/* rounded division by the pixel count */
+			__m128 avg = _mm_mul_ps(_mm_cvtepi32_ps(sum), _mm_set1_ps(1.0f / count));
+			__m128i res = _mm_cvtps_epi32(avg);
+			res = _mm_packs_epi32(res, res);
+			res = _mm_packus_epi16(res, res);
+			*(int*) out = _mm_cvtsi128_si32(res);
+#else
+			uint32_t sum[4] = {0, 0, 0, 0};
+			for (uint32_t sy = y0; sy < y1; sy++) {
+				const uint8_t* row = src + (sy * srcWidth + x0) * 4;
+				for (uint32_t sx = 0; sx < x1 - x0; sx++) {
+					sum[0] += row[sx * 4 + 0];
+					sum[1] += row[sx * 4 + 1];
+					sum[2] += row[sx * 4 + 2];
+					sum[3] += row[sx * 4 + 3];
+				}
+			}
+			for (int c = 0; c < 4; c++)
+				out[c] = (sum[c] + count / 2) / count;
+#endif
+		}
+	}
+}
+
+
+/* Fixed point bilinear sampling at pixel centres, 8 bit weights. Rows are
+	blended vertically into 16 bit first, which is exact: no blend of two
+	8 bit values with weights summing to 256 exceeds 65280. */
+static void
+resampleBilinear (const uint8_t* src, uint16_t srcWidth, uint16_t srcHeight,
+		uint8_t* dst, uint16_t dstWidth, uint16_t dstHeight)
+{
+	std::vector<uint32_t> x0(dstWidth), x1(dstWidth), fx(dstWidth);
+	std::vector<uint16_t> row((std::size_t) srcWidth * 4);
+	
+	/* 64 bit, 2 * dstWidth * srcWidth * 128 does not fit 32 */
+	for (uint32_t x = 0; x < dstWidth; x++) {
+		int64_t sx = (int64_t) (((2 * (uint64_t) x + 1) * srcWidth * 128) / dstWidth) - 128;
+		if (sx < 0)
+			sx = 0;
+		x0[x] = sx >> 8;
+		x1[x] = x0[x] + 1 < srcWidth ? x0[x] + 1 : x0[x];
+		fx[x] = sx & 0xff;
+	}
+	
+	for (uint32_t y = 0; y < dstHeight; y++) {
+		int64_t sy = (int64_t) (((2 * (uint64_t) y + 1) * srcHeight * 128) / dstHeight) - 128;
+		if (sy < 0)
+			sy = 0;
+		uint32_t y0 = sy >> 8;
+		uint32_t y1 = y0 + 1 < srcHeight ? y0 + 1 : y0;
+		uint32_t fy = sy & 0xff;
+		const uint8_t* r0 = src + (std::size_t) y0 * srcWidth * 4;
+		const uint8_t* r1 = src + (std::size_t) y1 * srcWidth * 4;
+		uint8_t* out = dst + (std::size_t) y * dstWidth * 4;
+		uint32_t n = (uint32_t) srcWidth * 4, i = 0;
+		
+#ifdef __SSE2__
+		const __m128i zero = _mm_setzero_si128();
+		const __m128i wy0 = _mm_set1_epi16(256 - fy);
+		const __m128i wy1 = _mm_set1_epi16(fy);
+		for (; i + 8 <= n; i += 8) {
+			__m128i a = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*) (r0 + i)), zero);
+			__m128i b = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*) (r1 + i)), zero);
+			__m128i v = _mm_add_epi16(_mm_mullo_epi16(a, wy0), _mm_mullo_epi16(b, wy1));
+			_mm_storeu_si128((__m128i*) &row[i], v);
+		}
+#endif
+		for (; i < n; i++)
+			row[i] = r0[i] * (256 - fy) + r1[i] * fy;
+		
+		for (uint32_t x = 0; x < dstWidth; x++) {
+			const uint16_t* p0 = &row[x0[x] * 4];
+			const uint16_t* p1 = &row[x1[x] * 4];
+#ifdef __SSE2__
+			/* 16 x 16 -> 32 bit products from the low and high halves */
+			__m128i a = _mm_loadl_epi64((const __m128i*) p0);
+			__m128i b = _mm_loadl_epi64((const __m128i*) p1);
+			__m128i wa = _mm_set1_epi16(256 - fx[x]);
+			__m128i wb = _mm_set1_epi16(fx[x]);
+			__m128i pa = _mm_unpacklo_epi16(_mm_mullo_epi16(a, wa), _mm_mulhi_epu16(a, wa));
+			__m128i pb = _mm_unpacklo_epi16(_mm_mullo_epi16(b, wb), _mm_mulhi_epu16(b, wb));
+			__m128i sum = _mm_add_epi32(_mm_add_epi32(pa, pb), _mm_set1_epi32(32768));
+			__m128i res = _mm_srli_epi32(sum, 16);
+			res = _mm_packs_epi32(res, res);
+			res = _mm_packus_epi16(res, res);
+			*(int*) (out + x * 4) = _mm_cvtsi128_si32(res);
+#else
+			for (int c = 0; c < 4; c++)
+				out[x * 4 + c] = (p0[c] * (256 - fx[x]) + p1[c] * fx[x] + 32768) >> 16;
+#endif
+		}
+	}
+}
+
+
+void resample (const uint8_t* src, uint16_t srcWidth, uint16_t srcHeight,
+		uint8_t* dst, uint16_t dstWidth, uint16_t dstHeight, Filter filter)
+{
+	if (srcWidth == dstWidth && srcHeight == dstHeight) {
+		memcpy(dst, src, (std::size_t) srcWidth * srcHeight * 4);
+		return;
+	}
+	
+	switch (filter) {
+	case FilterBox:
+		resampleBox(src, srcWidth, srcHeight, dst, dstWidth, dstHeight);
+		break;
+	case FilterBilinear:
+		resampleBilinear(src, srcWidth, srcHeight, dst, dstWidth, dstHeight);
+		break;
+	}
+}
+
+
+
+
+/* Byte layout of the uncompressed formats that are plain permutations of
+	8 bit channels. Offsets of R, G, B and A within a pixel; -1 means the
+	channel is not stored (read as 255, and written as 255 when the layout
+	still has a padding byte for it). */
+struct Layout {
+	uint8_t bpp;
+	int8_t ch[4];
+};
+
+
+static bool
+getLayout (Format format, Layout& layout)
+{
+	static const Layout rgba = {4, {0, 1, 2, 3}};
+	static const Layout abgr = {4, {3, 2, 1, 0}};
+	static const Layout argb = {4, {1, 2, 3, 0}};
+	static const Layout bgra = {4, {2, 1, 0, 3}};
+	static const Layout bgrx = {4, {2, 1, 0, -1}};
+	static const Layout rgb = {3, {0, 1, 2, -1}};
+	static const Layout bgr = {3, {2, 1, 0, -1}};
+	
+	switch (format) {
+		case FormatRGBA8888:	layout = rgba; return true;
+		case FormatABGR8888:	layout = abgr; return true;
+		case FormatARGB8888:	layout = argb; return true;
+		case FormatBGRA8888:	layout = bgra; return true;
+		case FormatBGRX8888:	layout = bgrx; return true;
+		case FormatRGB888:		layout = rgb; return true;
+		case FormatBGR888:		layout = bgr; return true;
+		default:				return false;
+	}
+}
+
+
+/* 4 -> 4 byte formats. The shifts are loop invariant, so the loop is a
+	handful of vector shifts, ands and ors per 4 pixels. Bytes of the
+	destination that no source channel feeds are set to 255. Assumes a
+	little endian host, as does the rest of the library. */
+static void
+swizzle32 (const Layout& from, const Layout& to, const uint8_t* src, uint8_t* dst,
+		uint32_t count)
+{
+	uint32_t shift_in[4], shift_out[4], mask[4], fill = 0xffffffff;
+	bool same = true;
+	
+	for (int c = 0; c < 4; c++) {
+		if (from.ch[c] < 0 || to.ch[c] < 0) {
+			shift_in[c] = shift_out[c] = mask[c] = 0;
+			continue;
+		}
+		shift_in[c] = from.ch[c] * 8;
+		shift_out[c] = to.ch[c] * 8;
+		mask[c] = 0xff;
+		fill &= ~(0xffu << shift_out[c]);
+		same = same && shift_in[c] == shift_out[c];
+	}
+	
+	const uint32_t* in = (const uint32_t*) src;
+	uint32_t* out = (uint32_t*) dst;
+	
+	/* channels stay in place, e.g. BGRA8888 -> BGRX8888 */
+	if (same) {
+		for (uint32_t i = 0; i < count; i++)
+			out[i] = in[i] | fill;
+		return;
+	}
+	
+	for (uint32_t i = 0; i < count; i++) {
+		uint32_t p = in[i];
+		out[i] = (((p >> shift_in[0]) & mask[0]) << shift_out[0])
+				| (((p >> shift_in[1]) & mask[1]) << shift_out[1])
+				| (((p >> shift_in[2]) & mask[2]) << shift_out[2])
+				| (((p >> shift_in[3]) & mask[3]) << shift_out[3])
+				| fill;
+	}
+}
+
+
+/* Any other combination of byte layouts, one byte at a time */
+static void
+swizzleBytes (const Layout& from, const Layout& to, const uint8_t* src, uint8_t* dst,
+		uint32_t count)
+{
+	int8_t map[4];
+	
+	memset(map, -1, sizeof(map));
+	for (int c = 0; c < 4; c++)
+		if (to.ch[c] >= 0)
+			map[(int) to.ch[c]] = from.ch[c];
+	
+	for (uint32_t i = 0; i < count; i++) {
+		for (int b = 0; b < to.bpp; b++)
+			dst[b] = map[b] >= 0 ? src[(int) map[b]] : 0xff;
+		src += from.bpp;
+		dst += to.bpp;
+	}
+}
+
+
+/* Formats with channels narrower than a byte, or luminance, packed into
+	1 or 2 bytes. Bits and position of R, G, B and A from the least
+	significant bit, 0 bits when the channel is not stored. A luminance
+	format keeps Y in the R slot. */
+struct Packed {
+	uint8_t bpp;
+	uint8_t bits[4];
+	uint8_t shift[4];
+	uint16_t fill;		/* padding bits, set to 1 on write */
+	bool luminance;
+};
+
+
+static bool
+getPacked (Format format, Packed& packed)
+{
+	static const Packed rgb565 = {2, {5, 6, 5, 0}, {0, 5, 11, 0}, 0, false};
+	static const Packed bgr565 = {2, {5, 6, 5, 0}, {11, 5, 0, 0}, 0, false};
+	static const Packed bgrx5551 = {2, {5, 5, 5, 0}, {10, 5, 0, 0}, 0x8000, false};
+	static const Packed bgra5551 = {2, {5, 5, 5, 1}, {10, 5, 0, 15}, 0, false};
+	static const Packed bgra4444 = {2, {4, 4, 4, 4}, {8, 4, 0, 12}, 0, false};
+	static const Packed i8 = {1, {8, 0, 0, 0}, {0, 0, 0, 0}, 0, true};
+	static const Packed ia88 = {2, {8, 0, 0, 8}, {0, 0, 0, 8}, 0, true};
+	static const Packed a8 = {1, {0, 0, 0, 8}, {0, 0, 0, 0}, 0, false};
+	
+	switch (format) {
+		case FormatRGB565:		packed = rgb565; return true;
+		case FormatBGR565:		packed = bgr565; return true;
+		case FormatBGRX5551:	packed = bgrx5551; return true;
+		case FormatBGRA5551:	packed = bgra5551; return true;
+		case FormatBGRA4444:	packed = bgra4444; return true;
+		case FormatI8:			packed = i8; return true;
+		case FormatIA88:		packed = ia88; return true;
+		case FormatA8:			packed = a8; return true;
+		default:				return false;
+	}
+}
+
+
+/* 4x4 Bayer matrix, as rounding biases in the v * max domain: the
+	quantised value is (v * max + bias) / 255. Without dithering the bias
+	is 127, which rounds to nearest. */
+static const uint8_t ditherBias[4][4] = {
+	{  7, 135,  39, 167},
+	{199,  71, 231, 103},
+	{ 55, 183,  23, 151},
+	{247, 119, 215,  87}
+};
+
+
+/* Exact x / 255 for x < 65535 */
+static inline uint32_t
+div255 (uint32_t x)
+{
+	return (x + 1 + (x >> 8)) >> 8;
+}
+
+
+/* RGBA8888 to a packed format. BIAS holds the rounding bias of pixels
+	0, 1, 2 and 3 (mod 4) of the run. Luminance uses the Rec. 601
+	weights, which sum to 256 so grey stays unchanged. */
+static void
+packPixels (const Packed& packed, const uint8_t* src, uint8_t* dst, uint32_t count,
+		const uint8_t* bias)
+{
+	uint32_t max[4];
+	for (int c = 0; c < 4; c++)
+		max[c] = (1u << packed.bits[c]) - 1;
+	
+	uint32_t i = 0;
+	
+#ifdef __SSE2__
+	__m128i v_bias = _mm_setr_epi32(bias[0], bias[1], bias[2], bias[3]);
+	__m128i v_fill = _mm_set1_epi32(packed.fill);
+	__m128i byte = _mm_set1_epi32(0xff);
+	__m128i one = _mm_set1_epi32(1);
+	__m128i v_max[4], v_shift[4];
+	for (int c = 0; c < 4; c++) {
+		v_max[c] = _mm_set1_epi32(max[c]);
+		v_shift[c] = _mm_cvtsi32_si128(packed.shift[c]);
+	}
+	__m128i w_r = _mm_set1_epi32(77), w_g = _mm_set1_epi32(150);
+	__m128i w_b = _mm_set1_epi32(29), half = _mm_set1_epi32(128);
+	
+	for (; i + 4 <= count; i += 4, src += 16) {
+		__m128i p = _mm_loadu_si128((const __m128i*) src);
+		__m128i ch[4];
+		for (int c = 0; c < 4; c++)
+			ch[c] = _mm_and_si128(_mm_srli_epi32(p, 8 * c), byte);
+		
+		if (packed.luminance)
+			ch[0] = _mm_srli_epi32(_mm_add_epi32(_mm_add_epi32(
+					_mm_mullo_epi16(ch[0], w_r), _mm_mullo_epi16(ch[1], w_g)),
+					_mm_add_epi32(_mm_mullo_epi16(ch[2], w_b), half)), 8);
+		
+		/* products stay below 2^16, so 16 bit multiplies do */
+		__m128i out = v_fill;
+		for (int c = 0; c < 4; c++) {
+			if (!packed.bits[c])
+				continue;
+			__m128i x = _mm_add_epi32(_mm_mullo_epi16(ch[c], v_max[c]), v_bias);
+			x = _mm_srli_epi32(_mm_add_epi32(_mm_add_epi32(x, one),
+					_mm_srli_epi32(x, 8)), 8);
+			out = _mm_or_si128(out, _mm_sll_epi32(x, v_shift[c]));
+		}
+		
+		if (packed.bpp == 2) {
+			/* unsigned 32 -> 16 bit through the signed saturating pack */
+			__m128i bias16 = _mm_set1_epi32(0x8000);
+			out = _mm_packs_epi32(_mm_sub_epi32(out, bias16), _mm_sub_epi32(out, bias16));
+			out = _mm_xor_si128(out, _mm_set1_epi16((short) 0x8000));
+			_mm_storel_epi64((__m128i*) dst, out);
+			dst += 8;
+		} else {
+			out = _mm_packs_epi32(out, out);
+			out = _mm_packus_epi16(out, out);
+			uint32_t bytes = _mm_cvtsi128_si32(out);
+			memcpy(dst, &bytes, 4);
+			dst += 4;
+		}
+	}
+#endif
+	
+	for (; i < count; i++, src += 4, dst += packed.bpp) {
+		uint32_t ch[4] = {src[0], src[1], src[2], src[3]};
+		if (packed.luminance)
+			ch[0] = (ch[0] * 77 + ch[1] * 150 + ch[2] * 29 + 128) >> 8;
+		
+		uint32_t out = packed.fill;
+		for (int c = 0; c < 4; c++)
+			if (packed.bits[c])
+				out |= div255(ch[c] * max[c] + bias[i & 3]) << packed.shift[c];
+		
+		dst[0] = out;
+		if (packed.bpp == 2)
+			dst[1] = out >> 8;
+	}
+}
+
+
+/* Packed to RGBA8888, widening each channel by bit replication.
+	Channels that are not stored read as 255. */
+static void
+unpackPixels (const Packed& packed, const uint8_t* src, uint8_t* dst, uint32_t count)
+{
+	for (uint32_t i = 0; i < count; i++, src += packed.bpp, dst += 4) {
+		uint32_t in = src[0];
+		if (packed.bpp == 2)
+			in |= src[1] << 8;
+		
+		for (int c = 0; c < 4; c++) {
+			uint32_t bits = packed.bits[c];
+			if (!bits) {
+				dst[c] = 0xff;
+				continue;
+			}
+			uint32_t v = (in >> packed.shift[c]) & ((1u << bits) - 1);
+			v <<= 8 - bits;
+			for (uint32_t have = bits; have < 8; have *= 2)
+				v |= v >> have;
+			dst[c] = v;
+		}
+		if (packed.luminance)
+			dst[1] = dst[2] = dst[0];
+	}
+}
+
+
+static bool
+convertLayouts (Format srcFormat, const uint8_t* src, Format dstFormat, uint8_t* dst,
+		uint32_t count)
+{
+	Layout from, to;
+	if (!getLayout(srcFormat, from) || !getLayout(dstFormat, to))
+		return false;
+	
+	if (count == 0)
+		return true;
+	if (srcFormat == dstFormat)
+		memcpy(dst, src, count * from.bpp);
+	else if (from.bpp == 4 && to.bpp == 4)
+		swizzle32(from, to, src, dst, count);
+	else
+		swizzleBytes(from, to, src, dst, count);
+	return true;
+}
+
+
+/* Packed formats go through RGBA8888 in chunks that stay in cache */
+static bool
+convertPacked (Format srcFormat, const uint8_t* src, Format dstFormat, uint8_t* dst,
+		uint32_t count)
+{
+	static const uint8_t round[4] = {127, 127, 127, 127};
+	Packed from, to;
+	bool src_packed = getPacked(srcFormat, from);
+	bool dst_packed = getPacked(dstFormat, to);
+	Layout layout;
+	if ((!src_packed && !getLayout(srcFormat, layout))
+			|| (!dst_packed && !getLayout(dstFormat, layout)))
+		return false;
+	
+	uint8_t rgba[1024 * 4];
+	for (uint32_t done = 0; done < count; done += 1024) {
+		uint32_t n = std::min<uint32_t>(1024, count - done);
+		const uint8_t* in = rgba;
+		
+		if (src_packed)
+			unpackPixels(from, src, rgba, n);
+		else if (srcFormat == FormatRGBA8888)
+			in = src;
+		else
+			convertLayouts(srcFormat, src, FormatRGBA8888, rgba, n);
+		
+		if (dst_packed)
+			packPixels(to, in, dst, n, round);
+		else
+			convertLayouts(FormatRGBA8888, in, dstFormat, dst, n);
+		
+		src += n * (src_packed ? from.bpp : layout.bpp);
+		dst += n * (dst_packed ? to.bpp : layout.bpp);
+	}
+	return true;
+}
+
+
+bool
+convertPixels (Format srcFormat, const uint8_t* src, Format dstFormat, uint8_t* dst,
+		uint32_t count)
+{
+	Packed packed;
+	if (srcFormat == dstFormat && getPacked(srcFormat, packed)) {
+		memcpy(dst, src, count * packed.bpp);
+		return true;
+	}
+	if (getPacked(srcFormat, packed) || getPacked(dstFormat, packed))
+		return convertPacked(srcFormat, src, dstFormat, dst, count);
+	return convertLayouts(srcFormat, src, dstFormat, dst, count);
+}
+
+
+void
+compressImage (const uint8_t* rgba, uint16_t width, uint16_t height, uint8_t* dst,
+		int flags, Quality quality)
+{
+	switch (quality) {
+		case QualityFast:
+			compressFast(rgba, width, height, dst, flags);
+			return;
+		case QualityRange:
+			flags |= squish::kColourRangeFit;
+			break;
+		case QualityIterative:
+			flags |= squish::kColourIterativeClusterFit;
+			break;
+		default:
+			flags |= squish::kColourClusterFit;
+			break;
+	}
+	squish::CompressImage(rgba, width, height, dst, flags);
+}
+
+
+double
+psnr (const uint8_t* a, const uint8_t* b, uint32_t count, bool alpha)
+{
+	uint64_t sum = 0;
+	uint32_t channels = alpha ? 4 : 3;
+	for (uint32_t i = 0; i < count; i++, a += 4, b += 4) {
+		for (uint32_t c = 0; c < channels; c++) {
+			int32_t d = a[c] - b[c];
+			sum += d * d;
+		}
+	}
+	
+	if (sum == 0)
+		return INFINITY;
+	double mse = (double) sum / ((double) count * channels);
+	return 10.0 * log10(255.0 * 255.0 / mse);
+}
+
+
+/* Flags blocks of BLOCKSIZE (8 or 16) bytes that differ, 16 bytes per
+	compare */
+static void
+compareBlocks (const uint8_t* a, const uint8_t* b, uint32_t count, uint32_t blockSize,
+		uint8_t* changed)
+{
+	uint32_t i = 0;
+	
+#ifdef __SSE2__
+	uint32_t per = 16 / blockSize;
+	for (; i + per <= count; i += per) {
+		__m128i va = _mm_loadu_si128((const __m128i*) (a + i * blockSize));
+		__m128i vb = _mm_loadu_si128((const __m128i*) (b + i * blockSize));
+		int same = _mm_movemask_epi8(_mm_cmpeq_epi8(va, vb));
+		if (same == 0xffff)
+			continue;
+		if (per == 1) {
+			changed[i] = 1;
+		} else {
+			changed[i] = (same & 0xff) != 0xff;
+			changed[i + 1] = (same >> 8) != 0xff;
+		}
+	}
+#endif
+	
+	for (; i < count; i++)
+		changed[i] = memcmp(a + i * blockSize, b + i * blockSize, blockSize) != 0;
+}
+
+
+/* RGBA8888 of the block at BX, BY; pixels outside the image are left alone */
+static void
+decodeBlock (const uint8_t* image, Format format, int flags, uint16_t width,
+		uint32_t bx, uint32_t by, uint32_t rows, uint32_t cols, uint8_t* rgba)
+{
+	if (flags) {
+		uint32_t block_size = (flags & squish::kDxt1) ? 8 : 16;
+		squish::Decompress(rgba, image + (by * ((width + 3) / 4) + bx) * block_size, flags);
+		return;
+	}
+	
+	uint32_t bpp = getImageLength(format, 1, 1);
+	for (uint32_t y = 0; y < rows; y++)
+		convertToRGBA(format, image + ((by * 4 + y) * width + bx * 4) * bpp,
+				rgba + y * 16, cols);
+}
+
+
+bool
+diffImages (const uint8_t* a, const uint8_t* b, Format format, uint16_t width,
+		uint16_t height, BlockDiff& diff)
+{
+	int flags = squishFlags(format);
+	if (!flags && (getImageLength(format, 1, 1) == 0
+			|| !convertToRGBA(format, NULL, NULL, 0)))
+		return false;
+	
+	uint32_t bw = (width + 3) / 4, bh = (height + 3) / 4;
+	diff.blocksWide = bw;
+	diff.blocksHigh = bh;
+	diff.changed.assign(bw * bh, 0);
+	
+	if (flags) {
+		compareBlocks(a, b, bw * bh, (flags & squish::kDxt1) ? 8 : 16, &diff.changed[0]);
+	} else {
+		/* a row segment of 4 pixels at a time */
+		uint32_t bpp = getImageLength(format, 1, 1);
+		for (uint32_t y = 0; y < height; y++) {
+			uint8_t* changed = &diff.changed[(y / 4) * bw];
+			uint32_t offset = y * width * bpp;
+			for (uint32_t bx = 0; bx < bw; bx++, offset += 4 * bpp) {
+				uint32_t cols = std::min<uint32_t>(4, width - bx * 4);
+				if (!changed[bx] && memcmp(a + offset, b + offset, cols * bpp) != 0)
+					changed[bx] = 1;
+			}
+		}
+	}
+	
+	/* error and bounds over the changed blocks only */
+	uint32_t x0 = width, y0 = height, x1 = 0, y1 = 0;
+	uint64_t sum = 0, samples = 0;
+	uint32_t max_error = 0;
+	diff.changedCount = 0;
+	
+	for (uint32_t by = 0; by < bh; by++) {
+		for (uint32_t bx = 0; bx < bw; bx++) {
+			if (!diff.changed[by * bw + bx])
+				continue;
+			
+			diff.changedCount++;
+			uint32_t rows = std::min<uint32_t>(4, height - by * 4);
+			uint32_t cols = std::min<uint32_t>(4, width - bx * 4);
+			x0 = std::min(x0, bx * 4);
+			y0 = std::min(y0, by * 4);
+			x1 = std::max(x1, bx * 4 + cols);
+			y1 = std::max(y1, by * 4 + rows);
+			
+			uint8_t pa[16 * 4], pb[16 * 4];
+			decodeBlock(a, format, flags, width, bx, by, rows, cols, pa);
+			decodeBlock(b, format, flags, width, bx, by, rows, cols, pb);
+			for (uint32_t y = 0; y < rows; y++) {
+				for (uint32_t i = y * 16; i < y * 16 + cols * 4; i++) {
+					int32_t d = pa[i] - pb[i];
+					sum += d * d;
+					max_error = std::max<uint32_t>(max_error, std::abs(d));
+				}
+			}
+			samples += rows * cols * 4;
+		}
+	}
+	
+	if (diff.changedCount) {
+		diff.x0 = x0;
+		diff.y0 = y0;
+		diff.x1 = x1;
+		diff.y1 = y1;
+	} else {
+		diff.x0 = diff.y0 = diff.x1 = diff.y1 = 0;
+	}
+	diff.maxError = max_error;
+	diff.psnr = sum ? 10.0 * log10(255.0 * 255.0 * samples / sum) : INFINITY;
+	return true;
+}
+
+
+bool
+packRGBA (const uint8_t* rgba, Format format, uint8_t* dst, uint16_t width,
+		uint16_t height, bool dither, Quality quality)
+{
+	int flags = squishFlags(format);
+	if (flags) {
+		compressImage(rgba, width, height, dst, flags, quality);
+		return true;
+	}
+	
+	Packed packed;
+	if (!getPacked(format, packed))
+		return convert(rgba, FormatRGBA8888, dst, format, width, height);
+	
+	static const uint8_t round[4] = {127, 127, 127, 127};
+	for (uint32_t y = 0; y < height; y++) {
+		packPixels(packed, rgba, dst, width, dither ? ditherBias[y & 3] : round);
+		rgba += width * 4;
+		dst += width * packed.bpp;
+	}
+	return true;
+}
+
+
+/* DXT straight into any byte layout, a block at a time */
+static void
+decompressInto (const uint8_t* src, int flags, uint8_t* dst, const Layout& to,
+		uint16_t width, uint16_t height)
+{
+	Layout rgba;
+	getLayout(FormatRGBA8888, rgba);
+	
+	uint32_t block_size = (flags & squish::kDxt1) ? 8 : 16;
+	uint8_t block[16 * 4];
+	
+	for (uint32_t by = 0; by < height; by += 4) {
+		for (uint32_t bx = 0; bx < width; bx += 4) {
+			squish::Decompress(block, src, flags);
+			src += block_size;
+			
+			uint32_t w = std::min<uint32_t>(4, width - bx);
+			for (uint32_t py = 0; py < 4 && by + py < height; py++) {
+				uint8_t* out = dst + ((by + py) * width + bx) * to.bpp;
+				if (to.bpp == 4)
+					swizzle32(rgba, to, block + py * 16, out, w);
+				else
+					swizzleBytes(rgba, to, block + py * 16, out, w);
+			}
+		}
+	}
+}
+
+
+bool
+convert (const uint8_t* src, Format srcFormat, uint8_t* dst, Format dstFormat,
+		uint16_t width, uint16_t height)
+{
+	int src_flags = squishFlags(srcFormat);
+	int dst_flags = squishFlags(dstFormat);
+	uint32_t count = (uint32_t) width * height;
+	Layout to;
+	
+	if (srcFormat == dstFormat) {
+		uint32_t length = getImageLength(srcFormat, width, height);
+		if (length == 0)
+			return false;
+		memcpy(dst, src, length);
+		return true;
+	}
+	
+	/* direct kernels */
+	if (!src_flags && !dst_flags)
+		return convertPixels(srcFormat, src, dstFormat, dst, count);
+	
+	if (src_flags && dstFormat == FormatA8) {
+		decompressAlpha(src, src_flags, dst, width, height);
+		return true;
+	}
+	if (src_flags && !dst_flags && getLayout(dstFormat, to)) {
+		decompressInto(src, src_flags, dst, to, width, height);
+		return true;
+	}
+	
+	/* two steps through RGBA8888 */
+	std::vector<uint8_t> rgba(count * 4);
+	if (src_flags)
+		squish::DecompressImage(&rgba[0], width, height, src, src_flags);
+	else if (!convertToRGBA(srcFormat, src, &rgba[0], count))
+		return false;
+	
+	if (dst_flags)
+		compressImage(&rgba[0], width, height, dst, dst_flags, QualityCluster);
+	else if (!convertFromRGBA(dstFormat, &rgba[0], dst, count))
+		return false;
+	
+	return true;
+}
+
+
+
+
+/* A DXT1 block is transparent only in the 3 colour mode (color0 <= color1)
+	and only if some pixel inside the image uses index 3 */
+static bool
+isOpaqueDXT1 (const uint8_t* data, uint16_t width, uint16_t height)
+{
+	for (uint32_t by = 0; by < height; by += 4) {
+		uint32_t rows = std::min<uint32_t>(4, height - by);
+		for (uint32_t bx = 0; bx < width; bx += 4, data += 8) {
+			uint16_t c0 = data[0] | (data[1] << 8);
+			uint16_t c1 = data[2] | (data[3] << 8);
+			if (c0 > c1)
+				continue;
+			
+			uint32_t indices = data[4] | (data[5] << 8) | (data[6] << 16)
+					| ((uint32_t) data[7] << 24);
+			uint32_t cols = std::min<uint32_t>(4, width - bx);
+			uint32_t valid = 0;
+			for (uint32_t py = 0; py < rows; py++)
+				valid |= (0x55u >> (8 - cols * 2)) << (py * 8);
+			if (indices & (indices >> 1) & valid)
+				return false;
+		}
+	}
+	return true;
+}
+
+
+bool
+isOpaque (const uint8_t* data, Format format, uint16_t width, uint16_t height)
+{
+	switch (format) {
+		case FormatRGB888:
+		case FormatBGR888:
+		case FormatBGRX8888:
+		case FormatRGB565:
+		case FormatBGR565:
+		case FormatBGRX5551:
+		case FormatI8:
+			return true;
+		case FormatDXT1:
+		case FormatDXT1_1bitAlpha:
+			return isOpaqueDXT1(data, width, height);
+		default:
+			return false;
+	}
+}
+
+
+void
+premultiplyAlpha (uint8_t* data, uint32_t count)
+{
+	for (uint32_t i = 0; i < count; i++, data += 4) {
+		uint32_t a = data[3];
+		if (a == 255)
+			continue;
+		for (int c = 0; c < 3; c++) {
+			/* exact division by 255, rounded */
+			uint32_t t = data[c] * a + 128;
+			data[c] = (t + (t >> 8)) >> 8;
+		}
+	}
+}
+
+
+/* Three accumulators over the packed pixels: AND of all of them (alpha
+	stays 0xff only if opaque), OR of R^G and G^B (zero only if grey) and
+	OR of a mask of pixels with partial alpha */
+void
+analyzeRGBA (const uint8_t* rgba, uint32_t count, ImageTraits& traits)
+{
+	uint32_t all = 0xffffffff, chroma = 0, partial = 0;
+	uint32_t i = 0;
+	
+	while (i < count && (!chroma || !partial)) {
+		/* in chunks, so that a colour image with soft alpha stops early */
+		uint32_t end = std::min<uint32_t>(count, i + 4096);
+		
+#ifdef __SSE2__
+		__m128i v_all = _mm_set1_epi32(-1);
+		__m128i v_chroma = _mm_setzero_si128();
+		__m128i v_partial = _mm_setzero_si128();
+		__m128i zero = _mm_setzero_si128();
+		__m128i full = _mm_set1_epi32(0xff);
+		__m128i rg_gb = _mm_set1_epi32(0xffff);
+		
+		for (; i + 4 <= end; i += 4) {
+			__m128i p = _mm_loadu_si128((const __m128i*) (rgba + i * 4));
+			__m128i a = _mm_srli_epi32(p, 24);
+			v_all = _mm_and_si128(v_all, p);
+			v_chroma = _mm_or_si128(v_chroma,
+					_mm_and_si128(_mm_xor_si128(p, _mm_srli_epi32(p, 8)), rg_gb));
+			v_partial = _mm_or_si128(v_partial, _mm_andnot_si128(_mm_or_si128(
+					_mm_cmpeq_epi32(a, zero), _mm_cmpeq_epi32(a, full)), full));
+		}
+		
+		uint32_t lanes[3][4];
+		_mm_storeu_si128((__m128i*) lanes[0], v_all);
+		_mm_storeu_si128((__m128i*) lanes[1], v_chroma);
+		_mm_storeu_si128((__m128i*) lanes[2], v_partial);
+		for (int k = 0; k < 4; k++) {
+			all &= lanes[0][k];
+			chroma |= lanes[1][k];
+			partial |= lanes[2][k];
+		}
+#endif
+		
+		for (; i < end; i++) {
+			uint32_t p;
+			memcpy(&p, rgba + i * 4, 4);
+			uint32_t a = p >> 24;
+			all &= p;
+			chroma |= (p ^ (p >> 8)) & 0xffff;
+			partial |= a != 0 && a != 0xff;
+		}
+	}
+	
+	traits.opaque = traits.opaque && (all >> 24) == 0xff && !partial;
+	traits.binaryAlpha = traits.binaryAlpha && !partial;
+	traits.grey = traits.grey && !chroma;
+}
+
+
+Format
+chooseFormat (const ImageTraits& traits, uint32_t& flags, bool lossless)
+{
+	flags &= ~(VTF_FLAG_ONEBITALPHA | VTF_FLAG_EIGHTBITALPHA);
+	if (!traits.opaque)
+		flags |= traits.binaryAlpha ? VTF_FLAG_ONEBITALPHA : VTF_FLAG_EIGHTBITALPHA;
+	
+	if (lossless && traits.grey)
+		return traits.opaque ? FormatI8 : FormatIA88;
+	if (lossless)
+		return traits.opaque ? FormatBGR888 : FormatBGRA8888;
+	if (traits.opaque)
+		return FormatDXT1;
+	return traits.binaryAlpha ? FormatDXT1_1bitAlpha : FormatDXT5;
+}
+
+
+/* RGB sums with SAD against zero, one channel masked out at a time;
+	luminance with a multiply-add over the widened pixels. Only the
+	histogram updates are left to scalar code. */
+static void
+statsRGBA (const uint8_t* rgba, uint32_t count, uint64_t* sum, ImageStats& stats)
+{
+	uint32_t i = 0;
+	
+#ifdef __SSE2__
+	__m128i zero = _mm_setzero_si128();
+	__m128i low = _mm_set1_epi32(0xff);
+	__m128i weights = _mm_setr_epi16(77, 150, 29, 0, 77, 150, 29, 0);
+	__m128i acc[3] = {zero, zero, zero};
+	uint32_t luma[4];
+	
+	for (; i + 4 <= count; i += 4) {
+		__m128i p = _mm_loadu_si128((const __m128i*) (rgba + i * 4));
+		for (int c = 0; c < 3; c++)
+			acc[c] = _mm_add_epi64(acc[c], _mm_sad_epu8(
+					_mm_and_si128(_mm_srli_epi32(p, c * 8), low), zero));
+		
+		/* (77 R + 150 G, 29 B) per pixel, then the two halves added */
+		__m128i m0 = _mm_madd_epi16(_mm_unpacklo_epi8(p, zero), weights);
+		__m128i m1 = _mm_madd_epi16(_mm_unpackhi_epi8(p, zero), weights);
+		m0 = _mm_shuffle_epi32(_mm_add_epi32(m0, _mm_srli_epi64(m0, 32)), _MM_SHUFFLE(3, 1, 2, 0));
+		m1 = _mm_shuffle_epi32(_mm_add_epi32(m1, _mm_srli_epi64(m1, 32)), _MM_SHUFFLE(3, 1, 2, 0));
+		_mm_storeu_si128((__m128i*) luma, _mm_srli_epi32(_mm_unpacklo_epi64(m0, m1), 8));
+		
+		for (int k = 0; k < 4; k++) {
+			stats.luminance[luma[k]]++;
+			stats.alpha[rgba[(i + k) * 4 + 3]]++;
+		}
+	}
+	
+	for (int c = 0; c < 3; c++) {
+		uint64_t lanes[2];
+		_mm_storeu_si128((__m128i*) lanes, acc[c]);
+		sum[c] += lanes[0] + lanes[1];
+	}
+#endif
+	
+	for (; i < count; i++) {
+		const uint8_t* p = rgba + i * 4;
+		for (int c = 0; c < 3; c++)
+			sum[c] += p[c];
+		stats.luminance[(p[0] * 77 + p[1] * 150 + p[2] * 29) >> 8]++;
+		stats.alpha[p[3]]++;
+	}
+}
+
+
+bool
+computeStats (const uint8_t* data, Format format, uint16_t width, uint16_t height,
+		ImageStats& stats)
+{
+	uint32_t count = (uint32_t) width * height;
+	uint64_t sum[3] = {0, 0, 0};
+	int flags = squishFlags(format);
+	
+	memset(stats.luminance, 0, sizeof(stats.luminance));
+	memset(stats.alpha, 0, sizeof(stats.alpha));
+	
+	if (flags) {
+		statsDXT(data, flags, width, height, sum, stats);
+	} else if (format == FormatRGBA8888) {
+		statsRGBA(data, count, sum, stats);
+	} else {
+		/* other layouts through a small RGBA buffer that stays in cache */
+		uint8_t rgba[1024 * 4];
+		uint32_t bpp = getImageLength(format, 1, 1);
+		if (bpp == 0 || !convertToRGBA(format, data, rgba, 0))
+			return false;
+		for (uint32_t i = 0; i < count; i += 1024) {
+			uint32_t n = std::min<uint32_t>(1024, count - i);
+			if (!convertToRGBA(format, data + i * bpp, rgba, n))
+				return false;
+			statsRGBA(rgba, n, sum, stats);
+		}
+	}
+	
+	uint64_t alpha_sum = 0, covered = 0;
+	for (uint32_t v = 0; v < 256; v++) {
+		alpha_sum += (uint64_t) v * stats.alpha[v];
+		if (v >= 128)
+			covered += stats.alpha[v];
+	}
+	
+	stats.width = width;
+	stats.height = height;
+	for (int c = 0; c < 3; c++)
+		stats.average[c] = count ? (double) sum[c] / count : 0.0;
+	stats.average[3] = count ? (double) alpha_sum / count : 0.0;
+	stats.coverage = count ? (double) covered / count : 0.0;
+	
+	stats.minLuminance = 0;
+	stats.maxLuminance = 0;
+	if (count) {
+		int lo = 0, hi = 255;
+		while (!stats.luminance[lo])
+			lo++;
+		while (!stats.luminance[hi])
+			hi--;
+		stats.minLuminance = lo;
+		stats.maxLuminance = hi;
+	}
+	return true;
+}
+
+
+
+
+NormalEncoding
+normalEncoding (Format format)
+{
+	if (format == FormatUV88 || format == FormatUVWQ8888)
+		return NormalSigned;
+	return NormalRGB;
+}
+
+
+/* z = sqrt(1 - x^2 - y^2), clamped for vectors slightly off the unit disc */
+static void
+reconstructZ (const float* x, const float* y, float* z, uint32_t count)
+{
+	uint32_t i = 0;
+#ifdef __SSE2__
+	const __m128 one = _mm_set1_ps(1.0f);
+	const __m128 zero = _mm_setzero_ps();
+	for (; i + 4 <= count; i += 4) {
+		__m128 vx = _mm_loadu_ps(x + i);
+		__m128 vy = _mm_loadu_ps(y + i);
+		__m128 d = _mm_sub_ps(one, _mm_add_ps(_mm_mul_ps(vx, vx), _mm_mul_ps(vy, vy)));
+		_mm_storeu_ps(z + i, _mm_sqrt_ps(_mm_max_ps(d, zero)));
+	}
+#endif
+	for (; i < count; i++) {
+		float d = 1.0f - x[i] * x[i] - y[i] * y[i];
+		z[i] = d > 0.0f ? sqrtf(d) : 0.0f;
+	}
+}
+
+
+/* Up to 16 RGBA8888 pixels (one DXT block or a row piece) to normals.
+	Exactly one of rgb and xyz is set. */
+static void
+normalsFromRGBA (const uint8_t* rgba, NormalEncoding encoding, uint32_t count,
+		uint8_t* rgb, float* xyz)
+{
+	float x[16] = {0}, y[16] = {0}, z[16];
+	
+	switch (encoding) {
+		case NormalDXT5nm:
+			for (uint32_t i = 0; i < count; i++) {
+				x[i] = rgba[i * 4 + 3] * (2.0f / 255.0f) - 1.0f;
+				y[i] = rgba[i * 4 + 1] * (2.0f / 255.0f) - 1.0f;
+			}
+			reconstructZ(x, y, z, count);
+			break;
+		case NormalSigned:
+			/* two's complement, -128 clamps to -1 */
+			for (uint32_t i = 0; i < count; i++) {
+				x[i] = std::max((int8_t) rgba[i * 4] / 127.0f, -1.0f);
+				y[i] = std::max((int8_t) rgba[i * 4 + 1] / 127.0f, -1.0f);
+			}
+			reconstructZ(x, y, z, count);
+			break;
+		default:
+			for (uint32_t i = 0; i < count; i++) {
+				x[i] = rgba[i * 4] * (2.0f / 255.0f) - 1.0f;
+				y[i] = rgba[i * 4 + 1] * (2.0f / 255.0f) - 1.0f;
+				z[i] = rgba[i * 4 + 2] * (2.0f / 255.0f) - 1.0f;
+			}
+			break;
+	}
+	
+	if (xyz) {
+		for (uint32_t i = 0; i < count; i++) {
+			xyz[i * 3] = x[i];
+			xyz[i * 3 + 1] = y[i];
+			xyz[i * 3 + 2] = z[i];
+		}
+	} else {
+		for (uint32_t i = 0; i < count; i++) {
+			rgb[i * 3] = (uint8_t) (x[i] * 127.5f + 128.0f);
+			rgb[i * 3 + 1] = (uint8_t) (y[i] * 127.5f + 128.0f);
+			rgb[i * 3 + 2] = (uint8_t) (z[i] * 127.5f + 128.0f);
+		}
+	}
+}
+
+
+/* One pass over the source: DXT is decompressed a block at a time and
+	other formats are widened a row piece at a time into a small buffer
+	that stays in L1 while the normals are written out. */
+static bool
+decodeNormals (const uint8_t* src, Format format, NormalEncoding encoding,
+		uint16_t width, uint16_t height, uint8_t* rgb, float* xyz)
+{
+	uint8_t buffer[16 * 4];
+	int flags = squishFlags(format);
+	
+	if (flags) {
+		uint32_t block_size = (flags & squish::kDxt1) ? 8 : 16;
+		for (uint32_t by = 0; by < height; by += 4) {
+			for (uint32_t bx = 0; bx < width; bx += 4) {
+				squish::Decompress(buffer, src, flags);
+				src += block_size;
+				
+				uint32_t w = std::min<uint32_t>(4, width - bx);
+				for (uint32_t py = 0; py < 4 && by + py < height; py++) {
+					uint32_t offset = ((by + py) * width + bx) * 3;
+					normalsFromRGBA(buffer + py * 16, encoding, w,
+							rgb ? rgb + offset : NULL, xyz ? xyz + offset : NULL);
+				}
+			}
+		}
+		return true;
+	}
+	
+	uint32_t bpp;
+	switch (format) {
+		case FormatUV88:		bpp = 2; break;
+		case FormatUVWQ8888:	bpp = 4; break;
+		default:
+			bpp = getImageLength(format, 1, 1);
+			if (!convertPixels(format, src, FormatRGBA8888, buffer, 0))
+				return false;
+			break;
+	}
+	
+	uint32_t count = (uint32_t) width * height;
+	for (uint32_t i = 0; i < count; i += 16) {
+		uint32_t n = std::min<uint32_t>(16, count - i);
+		if (format == FormatUV88) {
+			for (uint32_t k = 0; k < n; k++) {
+				buffer[k * 4] = src[k * 2];
+				buffer[k * 4 + 1] = src[k * 2 + 1];
+			}
+		} else if (format == FormatUVWQ8888) {
+			memcpy(buffer, src, n * 4);
+		} else {
+			convertPixels(format, src, FormatRGBA8888, buffer, n);
+		}
+		normalsFromRGBA(buffer, encoding, n, rgb ? rgb + i * 3 : NULL,
+				xyz ? xyz + i * 3 : NULL);
+		src += n * bpp;
+	}
+	return true;
+}
+
+
+bool
+decodeNormals (const uint8_t* src, Format format, NormalEncoding encoding,
+		uint16_t width, uint16_t height, uint8_t* rgb)
+{
+	return decodeNormals(src, format, encoding, width, height, rgb, NULL);
+}
+
+
+bool
+decodeNormals (const uint8_t* src, Format format, NormalEncoding encoding,
+		uint16_t width, uint16_t height, float* xyz)
+{
+	return decodeNormals(src, format, encoding, width, height, NULL, xyz);
+}
+
+
+}
@@ -0,0 +1,63 @@
+#ifndef __VTF_PIXEL_H__
+#define __VTF_PIXEL_H__
+
+#include <squish.h>
+#include "vtf.h"
+
+
+namespace Vtf {
+
+
+/* Internal pixel kernels shared by the library sources. Not a part of the
+	public API, do not install. */
+
+
+static inline int
+squishFlags (Format format)
+{
+	switch (format) {
+		case FormatDXT1:
+		case FormatDXT1_1bitAlpha:
+							return squish::kDxt1;
+		case FormatDXT3:	return squish::kDxt3;
+		case FormatDXT5:	return squish::kDxt5;
+		default:			return 0;
+	}
+}
+
+
+/* RGBA8888 to DXT, FLAGS as from squishFlags() */
+void compressImage (const uint8_t* rgba, uint16_t width, uint16_t height, uint8_t* dst,
+		int flags, Quality quality);
+void compressFast (const uint8_t* rgba, uint16_t width, uint16_t height, uint8_t* dst,
+		int flags);
+/* DXT to A8, reading as little of each block as the format allows */
+void decompressAlpha (const uint8_t* src, int flags, uint8_t* dst, uint16_t width,
+		uint16_t height);
+/* Adds DXT blocks to the histograms in STATS and the RGB sums in SUM */
+void statsDXT (const uint8_t* src, int flags, uint16_t width, uint16_t height,
+		uint64_t* sum, ImageStats& stats);
+
+
+/* Converts COUNT pixels between two uncompressed formats */
+bool convertPixels (Format srcFormat, const uint8_t* src,
+		Format dstFormat, uint8_t* dst, uint32_t count);
+
+
+static inline bool
+convertToRGBA (Format format, const uint8_t* src, uint8_t* dst, uint32_t count)
+{
+	return convertPixels(format, src, FormatRGBA8888, dst, count);
+}
+
+
+static inline bool
+convertFromRGBA (Format format, const uint8_t* src, uint8_t* dst, uint32_t count)
+{
+	return convertPixels(FormatRGBA8888, src, format, dst, count);
+}
+
+
+}
+
+#endif
@@ -0,0 +1,96 @@
+#include <unistd.h>
+#include "vtf.h"
+#include "vtf-thread.h"
+
+
+namespace Vtf {
+
+
+ThreadPool::ThreadPool(unsigned int threads)
+	: m_Busy(0), m_Quit(false)
+{
+	if (threads == 0)
+		threads = cpuCount();
+	
+	for (unsigned int i = 0; i < threads; i++) {
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, worker, this) != 0)
+			break;
+		m_Threads.push_back(thread);
+	}
+	
+	if (m_Threads.empty())
+		throw Exception("Could not start worker threads");
+}
+
+
+ThreadPool::~ThreadPool()
+{
+	{
+		Lock lock(m_Mutex);
+		m_Quit = true;
+		m_Ready.broadcast();
+	}
+	
+	for (std::vector<pthread_t>::iterator i = m_Threads.begin(); i != m_Threads.end(); ++i)
+		pthread_join(*i, NULL);
+	
+	for (std::deque<Task*>::iterator i = m_Queue.begin(); i != m_Queue.end(); ++i)
+		delete *i;
+}
+
+
+void ThreadPool::push(Task* task)
+{
+	Lock lock(m_Mutex);
+	m_Queue.push_back(task);
+	m_Ready.signal();
+}
+
+
+void ThreadPool::wait()
+{
+	Lock lock(m_Mutex);
+	while (!m_Queue.empty() || m_Busy > 0)
+		m_Idle.wait(m_Mutex);
+}
+
+
+unsigned int ThreadPool::cpuCount()
+{
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n > 0 ? n : 1;
+}
+
+
+void* ThreadPool::worker(void* data)
+{
+	ThreadPool* pool = static_cast<ThreadPool*>(data);
+	
+	pool->m_Mutex.lock();
+	for (;;) {
+		while (pool->m_Queue.empty() && !pool->m_Quit)
+			pool->m_Ready.wait(pool->m_Mutex);
+		if (pool->m_Quit)
+			break;
+		
+		Task* task = pool->m_Queue.front();
+		pool->m_Queue.pop_front();
+		pool->m_Busy++;
+		pool->m_Mutex.unlock();
+		
+		task->run();
+		delete task;
+		
+		pool->m_Mutex.lock();
+		pool->m_Busy--;
+		if (pool->m_Queue.empty() && pool->m_Busy == 0)
+			pool->m_Idle.broadcast();
+	}
+	pool->m_Mutex.unlock();
+	
+	return NULL;
+}
+
+
+}
@@ -0,0 +1,113 @@
+#ifndef __VTF_THREAD_H__
+#define __VTF_THREAD_H__
+
+#include <pthread.h>
+#include <deque>
+#include <vector>
+
+
+namespace Vtf {
+
+
+/* Internal helpers. Not a part of the public API, do not install. */
+
+
+class Mutex
+{
+public:
+	inline Mutex()
+		{pthread_mutex_init(&m_Mutex, NULL);}
+	inline ~Mutex()
+		{pthread_mutex_destroy(&m_Mutex);}
+
+	inline void lock()
+		{pthread_mutex_lock(&m_Mutex);}
+	inline void unlock()
+		{pthread_mutex_unlock(&m_Mutex);}
+
+private:
+	friend class Cond;
+	pthread_mutex_t m_Mutex;
+
+	Mutex(const Mutex&);
+	Mutex& operator=(const Mutex&);
+};
+
+
+class Lock
+{
+public:
+	inline Lock(Mutex& mutex) : m_Mutex(mutex)
+		{m_Mutex.lock();}
+	inline ~Lock()
+		{m_Mutex.unlock();}
+
+private:
+	Mutex& m_Mutex;
+};
+
+
+class Cond
+{
+public:
+	inline Cond()
+		{pthread_cond_init(&m_Cond, NULL);}
+	inline ~Cond()
+		{pthread_cond_destroy(&m_Cond);}
+
+	inline void wait(Mutex& mutex)
+		{pthread_cond_wait(&m_Cond, &mutex.m_Mutex);}
+	inline void signal()
+		{pthread_cond_signal(&m_Cond);}
+	inline void broadcast()
+		{pthread_cond_broadcast(&m_Cond);}
+
+private:
+	pthread_cond_t m_Cond;
+
+	Cond(const Cond&);
+	Cond& operator=(const Cond&);
+};
+
+
+class Task
+{
+public:
+	virtual inline ~Task()
+		{}
+	virtual void run() = 0;
+};
+
+
+/* Fixed set of worker threads pulling tasks from a FIFO queue.
+	The pool owns pushed tasks and deletes them once they have run. */
+class ThreadPool
+{
+public:
+	ThreadPool(unsigned int threads = 0);
+	~ThreadPool();
+
+	void push(Task* task);
+	void wait();
+
+	inline unsigned int threadCount() const
+		{return m_Threads.size();}
+
+	static unsigned int cpuCount();
+
+private:
+	static void* worker(void* data);
+
+	Mutex m_Mutex;
+	Cond m_Ready;
+	Cond m_Idle;
+	std::deque<Task*> m_Queue;
+	std::vector<pthread_t> m_Threads;
+	unsigned int m_Busy;
+	bool m_Quit;
+};
+
+
+}
+
+#endif
@@ -1,44 +1,21 @@
 #include <squish.h>
 #include <math.h>
+#include <string.h>
+#include <time.h>
+#include <algorithm>
+#include <map>
 #include <fstream>
 #include <boost/iostreams/device/array.hpp>
 #include <boost/iostreams/device/file.hpp>
 #include <boost/iostreams/device/file_descriptor.hpp>
 #include <boost/iostreams/stream.hpp>
 #include "vtf.h"
+#include "vtf-pixel.h"
 
 
 namespace Vtf {
 
 
-/* flags */
-#define VTF_FLAG_POINTSAMPLE			0x00000001
-#define VTF_FLAG_TRILINEAR				0x00000002
-#define VTF_FLAG_CLAMPS					0x00000004
-#define VTF_FLAG_CLAMPT					0x00000008
-#define VTF_FLAG_ANISOTROPIC			0x00000010
-#define VTF_FLAG_HINT_DXT5				0x00000020
-#define VTF_FLAG_PWL_CORRECTED			0x00000040
-#define VTF_FLAG_NORMAL					0x00000080
-#define VTF_FLAG_NOMIP					0x00000100
-#define VTF_FLAG_NOLOD					0x00000200
-#define VTF_FLAG_ALL_MIPS				0x00000400
-#define VTF_FLAG_PROCEDURAL				0x00000800
-#define VTF_FLAG_ONEBITALPHA			0x00001000
-#define VTF_FLAG_EIGHTBITALPHA			0x00002000
-#define VTF_FLAG_ENVMAP					0x00004000
-#define VTF_FLAG_RENDERTARGET			0x00008000
-#define VTF_FLAG_DEPTHRENDERTARGET		0x00010000
-#define VTF_FLAG_NODEBUGOVERRIDE		0x00020000
-#define VTF_FLAG_SINGLECOPY				0x00040000
-#define VTF_FLAG_PRE_SRGB				0x00080000
-#define VTF_FLAG_NODEPTHBUFFER			0x00800000
-#define VTF_FLAG_CLAMPU					0x02000000
-#define VTF_FLAG_VERTEXTEXTURE			0x04000000
-#define VTF_FLAG_SSBUMP					0x08000000
-#define VTF_FLAG_BORDER					0x20000000
-
-
 #define VTF_VERSION(hdr, major, minor)	\
 	(hdr.version[0] >= major && hdr.version[1] >= minor)
 
@@ -79,7 +56,7 @@ struct Header {
 
 
 struct HeaderResource {
-	Resource::Type type;
+	uint32_t type;		/* Resource::Type, may be garbage in a corrupted file */
 	uint32_t offset;
 } __attribute__((packed));
 
@@ -93,7 +70,7 @@ calcMipmapSize (uint16_t size, uint8_t mipmap)
 }
 
 
-static uint32_t
+uint32_t
 getImageLength (Format format, uint16_t width, uint16_t height)
 {
 	uint32_t npixels = width * height;
@@ -104,6 +81,7 @@ getImageLength (Format format, uint16_t width, uint16_t height)
 		case FormatARGB8888:
 		case FormatBGRA8888:
 		case FormatBGRX8888:
+		case FormatUVWQ8888:
 			return npixels * 4;
 		case FormatRGB888:
 		case FormatBGR888:
@@ -115,17 +93,154 @@ getImageLength (Format format, uint16_t width, uint16_t height)
 		case FormatBGRX5551:
 		case FormatBGRA4444:
 		case FormatBGRA5551:
+		case FormatUV88:
+		case FormatIA88:
 			return npixels * 2;
+		case FormatI8:
+		case FormatA8:
+			return npixels;
 		case FormatDXT1:
-			return npixels < 16 ? 8 : npixels / 2;
+		case FormatDXT1_1bitAlpha:
+			return ((width + 3) / 4) * ((height + 3) / 4) * 8;
 		case FormatDXT3:
 		case FormatDXT5:
-			return npixels < 16 ? 16 : npixels;
+			return ((width + 3) / 4) * ((height + 3) / 4) * 16;
 		default:
 			return 0;
 	}
 }
 
+
+uint8_t*
+encodeImage (Format format, const uint8_t* rgba, uint16_t width, uint16_t height,
+		bool dither, Quality quality)
+{
+	uint32_t length = getImageLength(format, width, height);
+	if (length == 0)
+		throw Exception(std::string("Could not encode to ") + formatToString(format));
+	
+	uint8_t* data = new uint8_t[length];
+	if (!packRGBA(rgba, format, data, width, height, dither, quality)) {
+		delete[] data;
+		throw Exception(std::string("Could not encode to ") + formatToString(format));
+	}
+	
+	return data;
+}
+
+
+uint32_t
+crc32 (const uint8_t* data, std::size_t length, uint32_t crc)
+{
+	struct Table {
+		uint32_t v[256];
+		Table() {
+			for (uint32_t i = 0; i < 256; i++) {
+				uint32_t c = i;
+				for (int k = 0; k < 8; k++)
+					c = c & 1 ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+				v[i] = c;
+			}
+		}
+	};
+	static const Table table;
+	
+	crc = ~crc;
+	for (std::size_t i = 0; i < length; i++)
+		crc = table.v[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+	return ~crc;
+}
+
+
+uint64_t
+hash64 (const uint8_t* data, std::size_t length, uint64_t seed)
+{
+	const uint64_t k = 0x9e3779b97f4a7c15ull;
+	uint64_t h = seed ^ (length * k);
+	std::size_t i = 0;
+	
+	for (; i + 8 <= length; i += 8) {
+		uint64_t v;
+		memcpy(&v, data + i, 8);
+		h = (h ^ v) * k;
+		h ^= h >> 29;
+	}
+	for (; i < length; i++)
+		h = (h ^ data[i]) * k;
+	
+	h ^= h >> 32;
+	h *= k;
+	h ^= h >> 29;
+	return h;
+}
+
+
+static inline uint64_t
+now ()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+static inline void
+recordRead (Stats* stats, std::size_t length)
+{
+	if (stats) {
+		stats->bytesRead += length;
+		stats->readCalls++;
+	}
+}
+
+
+static inline void
+recordAlloc (Stats* stats, std::size_t length)
+{
+	if (stats) {
+		stats->allocBytes += length;
+		stats->allocCount++;
+	}
+}
+
+
+static inline void
+recordSubimage (Stats* stats, Stats::Operation op, uint8_t mipmap, uint16_t frame,
+		uint16_t face, uint16_t slice, uint32_t length, uint64_t allocTime,
+		uint64_t ioTime, uint64_t decodeTime)
+{
+	if (!stats)
+		return;
+	
+	Stats::Subimage sub;
+	sub.op = op;
+	sub.mipmap = mipmap;
+	sub.frame = frame;
+	sub.face = face;
+	sub.slice = slice;
+	sub.length = length;
+	sub.allocTime = allocTime;
+	sub.ioTime = ioTime;
+	sub.decodeTime = decodeTime;
+	stats->subimages.push_back(sub);
+}
+
+
+void Stats::reset()
+{
+	bytesRead = 0;
+	bytesWritten = 0;
+	readCalls = 0;
+	writeCalls = 0;
+	allocCount = 0;
+	allocBytes = 0;
+	headerTime = 0;
+	totalTime = 0;
+	subimages.clear();
+}
+
+
+
 const char *
 formatToString (Format format)
 {
@@ -164,6 +279,32 @@ formatToString (Format format)
 
 
 
+const char *
+statusToString (Status status)
+{
+	switch (status) {
+		case StatusOk:					return "Success";
+		case StatusIoError:				return "Could not read file";
+		case StatusHeaderTruncated:		return "Header is too small";
+		case StatusNotVtf:				return "Not a VTF file";
+		case StatusBadVersion:			return "Unknown version";
+		case StatusBadDimensions:		return "Dimensions of the image are not power of 2";
+		case StatusNoMipmaps:			return "Number of mipmap images equals 0";
+		case StatusBadLowres:			return "Lowres image dimensions are not power of 2";
+		case StatusBadDepth:			return "Texture depth equals 0";
+		case StatusBadResource:			return "Unknown resource type";
+		case StatusLowresTruncated:		return "Could not read Low-resolution image";
+		case StatusHiresTruncated:		return "Could not read high-resolution image";
+		case StatusNoImage:				return "Could not find high-resolution image resource";
+		case StatusUnsupportedFormat:	return "Format is not supported";
+		case StatusBadArgument:			return "Invalid argument";
+		case StatusOutOfMemory:			return "Out of memory";
+		default:						return "Unknown error";
+	}
+}
+
+
+
 Exception::Exception(const std::string& message) throw ()
 	: mMessage(message)
 {
@@ -182,17 +323,57 @@ const char* Exception::what() const throw ()
 
 /* Vtf::LowresImageResource */
 void LowresImageResource::read(std::istream& stm, uint32_t offset,
-		Format format, uint16_t width, uint16_t height)
+		Format format, uint16_t width, uint16_t height, Stats* stats)
+{
+	Status status = tryRead(stm, offset, format, width, height, stats);
+	if (status != StatusOk)
+		throw Exception(statusToString(status));
+}
+
+
+Status LowresImageResource::tryRead(std::istream& stm, uint32_t offset,
+		Format format, uint16_t width, uint16_t height, Stats* stats)
 {
 	if (m_Image)
 		delete[] m_Image;
 	
+	setup (format, width, height);
 	uint32_t length = getImageLength (format, width, height);
 	m_Image = new uint8_t[length];
+	recordAlloc (stats, length);
 	stm.seekg (offset);
 	stm.read ((std::istream::char_type*) m_Image, length);
+	recordRead (stats, length);
 	if (stm.fail ())
-		throw Exception ("Could not read Low-resolution image");
+		return StatusLowresTruncated;
+	return StatusOk;
+}
+
+
+uint8_t* LowresImageResource::getImageRGBA() const
+{
+	return getImageAs(FormatRGBA8888);
+}
+
+
+uint8_t* LowresImageResource::getImageAs(Format format) const
+{
+	uint32_t length = getImageLength(format, m_Width, m_Height);
+	if (!m_Image || length == 0)
+		return NULL;
+	
+	uint8_t* data = new uint8_t[length];
+	if (!convert(m_Image, m_Format, data, format, m_Width, m_Height)) {
+		delete[] data;
+		return NULL;
+	}
+	return data;
+}
+
+
+bool LowresImageResource::isOpaque() const
+{
+	return m_Image && Vtf::isOpaque(m_Image, m_Format, m_Width, m_Height);
 }
 
 
@@ -204,57 +385,160 @@ void LowresImageResource::setup(Format format, uint16_t width, uint16_t height)
 }
 
 
-void LowresImageResource::write (std::ostream& stm) const
+void LowresImageResource::setImage(uint8_t* data)
+{
+	delete[] m_Image;
+	m_Image = data;
+}
+
+
+void LowresImageResource::setImageRGBA(const uint8_t* rgba)
+{
+	setImage(encodeImage(m_Format, rgba, m_Width, m_Height));
+}
+
+
+void LowresImageResource::write (std::ostream& stm, Stats* stats) const
 {
 	uint32_t length = getImageLength (m_Format, m_Width, m_Height);
 	stm.write ((std::istream::char_type*) m_Image, length);
+	if (stats) {
+		stats->bytesWritten += length;
+		stats->writeCalls++;
+	}
 	if (stm.fail ())
 		throw Exception ("Could not write Low-resolution image");
 }
 
 
+std::size_t LowresImageResource::memoryUsage() const
+{
+	std::size_t size = sizeof(*this);
+	if (m_Image)
+		size += getImageLength (m_Format, m_Width, m_Height);
+	return size;
+}
+
+
 
 /* Vtf::HiresImage */
 HiresImageResource::HiresImageResource()
-	: ImageResource(TypeHires), m_Depth(0), m_MipmapCount(0), m_FrameCount(0)
+	: ImageResource(TypeHires), m_Depth(0), m_MipmapCount(0), m_FrameCount(0),
+	m_FaceCount(0)
 {
 }
 
 
 void HiresImageResource::clear()
 {
-	for (MipmapList::iterator mm = mImages.begin(); mm != mImages.end(); ++mm)
-		for (FrameList::iterator fr = mm->begin(); fr != mm->end(); ++fr)
+	/* shared subimages are owned by their original */
+	for (uint8_t mm = 0; mm < mImages.size(); mm++) {
+		uint32_t index = 0;
+		for (FrameList::iterator fr = mImages[mm].begin(); fr != mImages[mm].end(); ++fr)
 			for (FaceList::iterator fc = fr->begin(); fc != fr->end(); ++fc)
-				for (SliceList::iterator sl = fc->begin(); sl != fc->end(); ++sl)
-					delete[] *sl;
+				for (SliceList::iterator sl = fc->begin(); sl != fc->end(); ++sl, ++index) {
+					if (mOriginals[mm][index] == index)
+						delete[] *sl;
+					*sl = NULL;
+					mOriginals[mm][index] = index;
+				}
+	}
+}
+
+
+uint32_t HiresImageResource::subimageIndex(uint16_t frame, uint16_t face,
+		uint16_t slice) const
+{
+	return ((uint32_t) frame * m_FaceCount + face) * m_Depth + slice;
 }
 
 
 void HiresImageResource::read(std::istream& stm, uint32_t offset, Format format,
 			uint16_t width, uint16_t height, uint16_t depth,
-			uint8_t mipmaps, uint16_t frames)
+			uint8_t mipmaps, uint16_t frames, uint16_t faces, Stats* stats,
+			uint8_t skipMips)
+{
+	Status status = tryRead(stm, offset, format, width, height, depth, mipmaps,
+			frames, faces, stats, skipMips);
+	if (status != StatusOk)
+		throw Exception(statusToString(status));
+}
+
+
+Status HiresImageResource::tryRead(std::istream& stm, uint32_t offset, Format format,
+			uint16_t width, uint16_t height, uint16_t depth,
+			uint8_t mipmaps, uint16_t frames, uint16_t faces, Stats* stats,
+			uint8_t skipMips, uint64_t* errorOffset)
 {
-	setup(format, width, height, mipmaps, frames, 1, depth);
+	/* the largest mipmaps are stored last, so skipping them just means
+		stopping early; the resource then looks like a smaller texture */
+	skipMips = std::min<uint8_t>(skipMips, mipmaps - 1);
+	width = calcMipmapSize(width, skipMips);
+	height = calcMipmapSize(height, skipMips);
+	mipmaps -= skipMips;
 	
+	setup(format, width, height, mipmaps, frames, faces, depth);
+	stm.seekg(offset);
+	
+	/* identical subimages (typically repeated animation frames) share the
+		storage of the first one; a buffer that turned out to be a duplicate
+		is reused for the next read */
+	uint8_t* data = NULL;
+	uint64_t position = offset;
 	for (int mm = 0; mm < mipmaps; mm++) {
-		uint16_t w = calcMipmapSize(width, mipmaps - mm - 1);
-		uint16_t h = calcMipmapSize(height, mipmaps - mm - 1);
+		uint8_t mipmap = mipmaps - mm - 1;
+		uint16_t w = calcMipmapSize(width, mipmap);
+		uint16_t h = calcMipmapSize(height, mipmap);
+		uint32_t len = getImageLength(format, w, h);
+		std::multimap<uint64_t, uint32_t> seen;
+		
+		delete[] data;
+		data = NULL;
+		
 		for (int fr = 0; fr < frames; fr++) {
-			for (int fc = 0; fc < 1; fc++) {
+			for (int fc = 0; fc < faces; fc++) {
 				for (int sl = 0; sl < depth; sl++) {
-					uint32_t len = getImageLength(format, w, h);
-					uint8_t* data = new uint8_t[len];
+					uint64_t t0 = stats ? now() : 0;
+					if (!data) {
+						data = new uint8_t[len];
+						recordAlloc(stats, len);
+					}
+					uint64_t t1 = stats ? now() : 0;
 					stm.read((std::istream::char_type*) data, len);
 					if (stm.fail()) {
-						delete data;
-						throw Exception("Could not read high-resolution image");
+						delete[] data;
+						if (errorOffset)
+							*errorOffset = position;
+						return StatusHiresTruncated;
+					}
+					recordRead(stats, len);
+					position += len;
+					
+					uint32_t index = subimageIndex(fr, fc, sl);
+					uint64_t hash = hash64(data, len);
+					std::multimap<uint64_t, uint32_t>::iterator it = seen.lower_bound(hash);
+					for (; it != seen.end() && it->first == hash; ++it)
+						if (memcmp(data, getImage(mipmap, it->second), len) == 0)
+							break;
+					
+					if (it != seen.end() && it->first == hash) {
+						mImages[mipmap][fr][fc][sl] = getImage(mipmap, it->second);
+						mOriginals[mipmap][index] = it->second;
+					} else {
+						mImages[mipmap][fr][fc][sl] = data;
+						seen.insert(std::make_pair(hash, index));
+						data = NULL;
 					}
-					setImage(mipmaps - mm - 1, fr, fc, sl, data);
+					
+					if (stats)
+						recordSubimage(stats, Stats::OpLoad, mipmap, fr, fc, sl,
+								len, t1 - t0, now() - t1, 0);
 				}
 			}
 		}
 	}
+	delete[] data;
+	return StatusOk;
 }
 
 
@@ -263,91 +547,355 @@ uint8_t* HiresImageResource::getImage(uint8_t mipmap, uint16_t frame,
 {
 	assert(mipmap < m_MipmapCount);
 	assert(frame < m_FrameCount);
-	assert(face < 1);
+	assert(face < m_FaceCount);
 	assert(slice < m_Depth);
 	
 	return mImages[mipmap][frame][face][slice];
 }
 
 
+const uint8_t* HiresImageResource::getImage(uint8_t mipmap, uint16_t frame,
+		uint16_t face, uint16_t slice) const
+{
+	assert(mipmap < m_MipmapCount);
+	assert(frame < m_FrameCount);
+	assert(face < m_FaceCount);
+	assert(slice < m_Depth);
+	
+	return mImages[mipmap][frame][face][slice];
+}
+
+
+uint8_t* HiresImageResource::getImage(uint8_t mipmap, uint32_t index)
+{
+	uint16_t slice = index % m_Depth;
+	index /= m_Depth;
+	return getImage(mipmap, index / m_FaceCount, index % m_FaceCount, slice);
+}
+
+
+bool HiresImageResource::findOriginal(uint8_t mipmap, uint16_t& frame, uint16_t& face,
+		uint16_t& slice) const
+{
+	uint32_t index = subimageIndex(frame, face, slice);
+	uint32_t original = mOriginals[mipmap][index];
+	if (original == index)
+		return false;
+	
+	slice = original % m_Depth;
+	original /= m_Depth;
+	face = original % m_FaceCount;
+	frame = original / m_FaceCount;
+	return true;
+}
+
+
+uint32_t HiresImageResource::uniqueCount() const
+{
+	uint32_t count = 0;
+	for (uint8_t mm = 0; mm < mOriginals.size(); mm++)
+		for (uint32_t i = 0; i < mOriginals[mm].size(); i++)
+			if (mOriginals[mm][i] == i)
+				count++;
+	return count;
+}
+
+
+bool HiresImageResource::validRegion(uint8_t mipmap, uint16_t frame, uint16_t face,
+		uint16_t slice, uint16_t x, uint16_t y, uint16_t width, uint16_t height) const
+{
+	if (mipmap >= m_MipmapCount || frame >= m_FrameCount || face >= m_FaceCount
+			|| slice >= m_Depth || !mImages[mipmap][frame][face][slice])
+		return false;
+	return (uint32_t) x + width <= calcMipmapSize(m_Width, mipmap)
+			&& (uint32_t) y + height <= calcMipmapSize(m_Height, mipmap);
+}
+
+
 uint8_t* HiresImageResource::getImageRGBA(uint8_t mipmap, uint16_t frame,
-		uint16_t face, uint16_t slice)
+		uint16_t face, uint16_t slice, uint16_t x, uint16_t y,
+		uint16_t width, uint16_t height, Stats* stats) const
+{
+	if (!validRegion(mipmap, frame, face, slice, x, y, width, height))
+		return NULL;
+	
+	uint32_t length = getImageLength(FormatRGBA8888, width, height);
+	uint64_t t0 = stats ? now() : 0;
+	uint8_t* data = new uint8_t[length];
+	uint64_t t1 = stats ? now() : 0;
+	
+	if (!decodeRegion(mipmap, frame, face, slice, x, y, width, height, data, width * 4)) {
+		delete[] data;
+		return NULL;
+	}
+	
+	if (stats) {
+		recordAlloc(stats, length);
+		recordSubimage(stats, Stats::OpDecode, mipmap, frame, face, slice,
+				length, t1 - t0, 0, now() - t1);
+	}
+	
+	return data;
+}
+
+
+bool HiresImageResource::decodeRegion(uint8_t mipmap, uint16_t frame, uint16_t face,
+		uint16_t slice, uint16_t x, uint16_t y, uint16_t width, uint16_t height,
+		uint8_t* dst, uint32_t rowstride) const
+{
+	if (!validRegion(mipmap, frame, face, slice, x, y, width, height))
+		return false;
+	
+	return Vtf::decodeRegion(getImage(mipmap, frame, face, slice), m_Format,
+			calcMipmapSize(m_Width, mipmap), calcMipmapSize(m_Height, mipmap),
+			x, y, width, height, dst, rowstride);
+}
+
+
+bool
+decodeRegion (const uint8_t* data, Format format, uint16_t imageWidth, uint16_t imageHeight,
+		uint16_t x, uint16_t y, uint16_t width, uint16_t height, uint8_t* dst,
+		uint32_t rowstride)
+{
+	if (!data || !dst || (uint32_t) x + width > imageWidth
+			|| (uint32_t) y + height > imageHeight)
+		return false;
+	if (width == 0 || height == 0)
+		return true;
+	
+	int flags = squishFlags(format);
+	if (flags) {
+		/* touch only the 4x4 blocks that intersect the region */
+		uint32_t block_size = (flags & squish::kDxt1) ? 8 : 16;
+		uint32_t blocks_per_row = (imageWidth + 3) / 4;
+		uint8_t block[16 * 4];
+		
+		for (uint32_t by = y / 4; by <= (uint32_t) (y + height - 1) / 4; by++) {
+			for (uint32_t bx = x / 4; bx <= (uint32_t) (x + width - 1) / 4; bx++) {
+				squish::Decompress(block, data + ((std::size_t) by * blocks_per_row + bx) * block_size,
+						flags);
+				
+				uint32_t x0 = std::max<uint32_t>(bx * 4, x);
+				uint32_t x1 = std::min<uint32_t>(bx * 4 + 4, x + width);
+				for (uint32_t py = 0; py < 4; py++) {
+					uint32_t iy = by * 4 + py;
+					if (iy < y || iy >= (uint32_t) (y + height))
+						continue;
+					memcpy(dst + (iy - y) * rowstride + (x0 - x) * 4,
+							block + (py * 4 + x0 - bx * 4) * 4, (x1 - x0) * 4);
+				}
+			}
+		}
+		return true;
+	}
+	
+	/* uncompressed formats; convert only the requested part of each row */
+	uint32_t bpp = getImageLength(format, 1, 1);
+	for (uint32_t row = 0; row < height; row++) {
+		const uint8_t* src = data + ((std::size_t) (y + row) * imageWidth + x) * bpp;
+		if (!convertToRGBA(format, src, dst + row * rowstride, width))
+			return false;
+	}
+	return true;
+}
+
+
+uint8_t* HiresImageResource::getImageRGBA(uint8_t mipmap, uint16_t frame,
+		uint16_t face, uint16_t slice, Stats* stats) const
 {
 	/* let's clear it up. SIZE is dimension / resolution. LENGTH is data length */
 	uint16_t img_width = calcMipmapSize (m_Width, mipmap);
 	uint16_t img_height = calcMipmapSize (m_Height, mipmap);
-	uint8_t* img_data = getImage(mipmap, frame, face, slice);
+	const uint8_t* img_data = getImage(mipmap, frame, face, slice);
 	uint32_t rgba_length = getImageLength(FormatRGBA8888, img_width, img_height);
+	uint64_t t0 = stats ? now() : 0;
 	uint8_t *rgba_data = new uint8_t[rgba_length];
-	uint32_t c, i;
-	
-	switch (m_Format) {
-	case FormatRGBA8888:
-		memcpy (rgba_data, img_data, rgba_length);
-		break;
-	case FormatABGR8888:
-		c = img_width * img_height;
-		for (i = 0; i < c; i++) {
-			rgba_data[i * 4 + 0] = img_data[i * 4 + 3];
-			rgba_data[i * 4 + 1] = img_data[i * 4 + 2];
-			rgba_data[i * 4 + 2] = img_data[i * 4 + 1];
-			rgba_data[i * 4 + 3] = img_data[i * 4 + 0];
-		}
-		break;
-	case FormatRGB888:
-		c = img_width * img_height;
-		for (i = 0; i < c; i++) {
-			rgba_data[i * 4 + 0] = img_data[i * 3 + 0];
-			rgba_data[i * 4 + 1] = img_data[i * 3 + 1];
-			rgba_data[i * 4 + 2] = img_data[i * 3 + 2];
-			rgba_data[i * 4 + 3] = 255;
-		}		
-		break;
-	case FormatBGR888:
-		c = img_width * img_height;
-		for (i = 0; i < c; i++) {
-			rgba_data[i * 4 + 0] = img_data[i * 3 + 2];
-			rgba_data[i * 4 + 1] = img_data[i * 3 + 1];
-			rgba_data[i * 4 + 2] = img_data[i * 3 + 0];
-			rgba_data[i * 4 + 3] = 255;
-		}
-		break;
-	case FormatARGB8888:
-		c = img_width * img_height;
-		for (i = 0; i < c; i++) {
-			rgba_data[i * 4 + 0] = img_data[i * 4 + 3];
-			rgba_data[i * 4 + 1] = img_data[i * 4 + 0];
-			rgba_data[i * 4 + 2] = img_data[i * 4 + 1];
-			rgba_data[i * 4 + 3] = img_data[i * 4 + 2];
-		}
-		break;
-	case FormatBGRA8888:
-		c = img_width * img_height;
-		for (i = 0; i < c; i++) {
-			rgba_data[i * 4 + 0] = img_data[i * 4 + 2];
-			rgba_data[i * 4 + 1] = img_data[i * 4 + 1];
-			rgba_data[i * 4 + 2] = img_data[i * 4 + 0];
-			rgba_data[i * 4 + 3] = img_data[i * 4 + 3];
-		}
-		break;
-	case FormatDXT1:
-		squish::DecompressImage(rgba_data, img_width, img_height, img_data, squish::kDxt1);
-		break;
-	case FormatDXT3:
-		squish::DecompressImage(rgba_data, img_width, img_height, img_data, squish::kDxt3);
-		break;
-	case FormatDXT5:
-		squish::DecompressImage(rgba_data, img_width, img_height, img_data, squish::kDxt5);
-		break;
-	default:
+	uint64_t t1 = stats ? now() : 0;
+	
+	if (!convert(img_data, m_Format, rgba_data, FormatRGBA8888, img_width, img_height)) {
 		delete[] rgba_data;
 		return NULL;
 	}
 	
+	if (stats) {
+		recordAlloc(stats, rgba_length);
+		recordSubimage(stats, Stats::OpDecode, mipmap, frame, face, slice,
+				rgba_length, t1 - t0, 0, now() - t1);
+	}
+	
 	return rgba_data;
 }
 
 
+uint8_t* HiresImageResource::getImageAs(Format format, uint8_t mipmap, uint16_t frame,
+		uint16_t face, uint16_t slice) const
+{
+	uint16_t img_width = calcMipmapSize (m_Width, mipmap);
+	uint16_t img_height = calcMipmapSize (m_Height, mipmap);
+	uint32_t length = getImageLength(format, img_width, img_height);
+	if (length == 0)
+		return NULL;
+	
+	uint8_t* data = new uint8_t[length];
+	if (tryDecode(format, mipmap, frame, face, slice, data) != StatusOk) {
+		delete[] data;
+		return NULL;
+	}
+	return data;
+}
+
+
+Status HiresImageResource::tryDecode(Format format, uint8_t mipmap, uint16_t frame,
+		uint16_t face, uint16_t slice, uint8_t* dst) const throw ()
+{
+	if (mipmap >= m_MipmapCount || frame >= m_FrameCount || face >= m_FaceCount
+			|| slice >= m_Depth || !dst)
+		return StatusBadArgument;
+	
+	const uint8_t* src = mImages[mipmap][frame][face][slice];
+	if (!src)
+		return StatusNoImage;
+	
+	/* the kernels do not allocate except for the generic two step
+		conversion */
+	try {
+		if (!convert(src, m_Format, dst, format, calcMipmapSize(m_Width, mipmap),
+				calcMipmapSize(m_Height, mipmap)))
+			return StatusUnsupportedFormat;
+	} catch (std::bad_alloc&) {
+		return StatusOutOfMemory;
+	}
+	return StatusOk;
+}
+
+
+bool HiresImageResource::isOpaque(uint8_t mipmap, uint16_t frame, uint16_t face,
+		uint16_t slice) const
+{
+	return Vtf::isOpaque(getImage(mipmap, frame, face, slice), m_Format,
+			calcMipmapSize(m_Width, mipmap), calcMipmapSize(m_Height, mipmap));
+}
+
+
+bool HiresImageResource::computeStats(std::vector<ImageStats>& stats) const
+{
+	uint32_t count = (uint32_t) m_FrameCount * m_FaceCount * m_Depth;
+	stats.clear();
+	stats.resize(count * m_MipmapCount);
+	
+	for (uint8_t mm = 0; mm < m_MipmapCount; mm++) {
+		uint16_t img_width = calcMipmapSize(m_Width, mm);
+		uint16_t img_height = calcMipmapSize(m_Height, mm);
+		ImageStats* mip_stats = &stats[mm * count];
+		
+		for (uint16_t fr = 0; fr < m_FrameCount; fr++) {
+			for (uint16_t fc = 0; fc < m_FaceCount; fc++) {
+				for (uint16_t sl = 0; sl < m_Depth; sl++) {
+					uint16_t orig_frame = fr, orig_face = fc, orig_slice = sl;
+					ImageStats& st = mip_stats[subimageIndex(fr, fc, sl)];
+					
+					if (findOriginal(mm, orig_frame, orig_face, orig_slice))
+						st = mip_stats[subimageIndex(orig_frame, orig_face, orig_slice)];
+					else if (!Vtf::computeStats(getImage(mm, fr, fc, sl), m_Format,
+							img_width, img_height, st))
+						return false;
+					
+					st.mipmap = mm;
+					st.frame = fr;
+					st.face = fc;
+					st.slice = sl;
+				}
+			}
+		}
+	}
+	return true;
+}
+
+
+uint8_t* HiresImageResource::getNormals(uint8_t mipmap, uint16_t frame, uint16_t face,
+		uint16_t slice, NormalEncoding encoding) const
+{
+	uint16_t img_width = calcMipmapSize (m_Width, mipmap);
+	uint16_t img_height = calcMipmapSize (m_Height, mipmap);
+	uint8_t* rgb = new uint8_t[(uint32_t) img_width * img_height * 3];
+	if (!decodeNormals(getImage(mipmap, frame, face, slice), m_Format, encoding,
+			img_width, img_height, rgb)) {
+		delete[] rgb;
+		return NULL;
+	}
+	return rgb;
+}
+
+
+float* HiresImageResource::getNormalsFloat(uint8_t mipmap, uint16_t frame, uint16_t face,
+		uint16_t slice, NormalEncoding encoding) const
+{
+	uint16_t img_width = calcMipmapSize (m_Width, mipmap);
+	uint16_t img_height = calcMipmapSize (m_Height, mipmap);
+	float* xyz = new float[(uint32_t) img_width * img_height * 3];
+	if (!decodeNormals(getImage(mipmap, frame, face, slice), m_Format, encoding,
+			img_width, img_height, xyz)) {
+		delete[] xyz;
+		return NULL;
+	}
+	return xyz;
+}
+
+
+uint8_t* HiresImageResource::getImageARGB32(uint8_t mipmap, uint16_t frame,
+		uint16_t face, uint16_t slice) const
+{
+	/* native endian ARGB is BGRA in memory on the little endian hosts
+		we support */
+	uint8_t* data = getImageAs(FormatBGRA8888, mipmap, frame, face, slice);
+	if (data && !isOpaque(mipmap, frame, face, slice))
+		premultiplyAlpha(data, (uint32_t) calcMipmapSize(m_Width, mipmap)
+				* calcMipmapSize(m_Height, mipmap));
+	return data;
+}
+
+
+uint8_t HiresImageResource::findMipmap(uint16_t targetWidth, uint16_t targetHeight) const
+{
+	uint8_t mipmap = 0;
+	while (mipmap + 1 < m_MipmapCount
+			&& calcMipmapSize(m_Width, mipmap + 1) >= targetWidth
+			&& calcMipmapSize(m_Height, mipmap + 1) >= targetHeight)
+		mipmap++;
+	return mipmap;
+}
+
+
+uint8_t* HiresImageResource::decode(uint16_t frame, uint16_t face, uint16_t slice,
+		uint16_t targetWidth, uint16_t targetHeight, Filter filter, Stats* stats) const
+{
+	assert(targetWidth > 0 && targetHeight > 0);
+	
+	uint8_t mipmap = findMipmap(targetWidth, targetHeight);
+	uint16_t w = calcMipmapSize(m_Width, mipmap);
+	uint16_t h = calcMipmapSize(m_Height, mipmap);
+	
+	uint8_t* rgba = getImageRGBA(mipmap, frame, face, slice, stats);
+	if (!rgba || (w == targetWidth && h == targetHeight))
+		return rgba;
+	
+	uint32_t length = getImageLength(FormatRGBA8888, targetWidth, targetHeight);
+	uint64_t t0 = stats ? now() : 0;
+	uint8_t* out = new uint8_t[length];
+	uint64_t t1 = stats ? now() : 0;
+	resample(rgba, w, h, out, targetWidth, targetHeight, filter);
+	delete[] rgba;
+	
+	if (stats) {
+		recordAlloc(stats, length);
+		recordSubimage(stats, Stats::OpDecode, mipmap, frame, face, slice,
+				length, t1 - t0, 0, now() - t1);
+	}
+	
+	return out;
+}
+
+
 void HiresImageResource::setup(Format format, uint16_t width, uint16_t height,
 		uint8_t mipmaps, uint16_t frames, uint16_t faces, uint16_t slices)
 {
@@ -357,6 +905,14 @@ void HiresImageResource::setup(Format format, uint16_t width, uint16_t height,
 	m_Depth = slices;
 	m_MipmapCount = mipmaps;
 	m_FrameCount = frames;
+	m_FaceCount = faces;
+	
+	mOriginals.resize(mipmaps);
+	for (OriginalList::iterator mm = mOriginals.begin(); mm != mOriginals.end(); ++mm) {
+		mm->resize((uint32_t) frames * faces * slices);
+		for (uint32_t i = 0; i < mm->size(); i++)
+			(*mm)[i] = i;
+	}
 	
 	mImages.resize(mipmaps);
 	for (MipmapList::iterator mm = mImages.begin(); mm != mImages.end(); ++mm) {
@@ -373,12 +929,12 @@ void HiresImageResource::setup(Format format, uint16_t width, uint16_t height,
 }
 
 
-bool HiresImageResource::check()
+bool HiresImageResource::check() const
 {
-	for (MipmapList::iterator mm = mImages.begin(); mm != mImages.end(); ++mm)
-		for (FrameList::iterator fr = mm->begin(); fr != mm->end(); ++fr)
-			for (FaceList::iterator fc = fr->begin(); fc != fr->end(); ++fc)
-				for (SliceList::iterator sl = fc->begin(); sl != fc->end(); ++sl)
+	for (MipmapList::const_iterator mm = mImages.begin(); mm != mImages.end(); ++mm)
+		for (FrameList::const_iterator fr = mm->begin(); fr != mm->end(); ++fr)
+			for (FaceList::const_iterator fc = fr->begin(); fc != fr->end(); ++fc)
+				for (SliceList::const_iterator sl = fc->begin(); sl != fc->end(); ++sl)
 					if (!*sl)
 						return false;
 	return true;
@@ -388,24 +944,72 @@ bool HiresImageResource::check()
 void HiresImageResource::setImage(uint8_t mipmap, uint16_t frame, uint16_t face,
 		uint16_t slice, uint8_t* data)
 {
+	std::vector<uint32_t>& originals = mOriginals[mipmap];
+	uint32_t index = subimageIndex(frame, face, slice);
+	uint8_t* old = mImages[mipmap][frame][face][slice];
+	
+	/* unshare: a duplicate just lets go, an original hands its storage
+		over to the first of its duplicates */
+	if (originals[index] == index) {
+		uint32_t heir = index;
+		for (uint32_t i = index + 1; i < originals.size(); i++)
+			if (originals[i] == index) {
+				if (heir == index)
+					heir = i;
+				originals[i] = heir;
+			}
+		if (heir == index)
+			delete[] old;
+	}
+	
+	originals[index] = index;
 	mImages[mipmap][frame][face][slice] = data;
 }
 
 
-void HiresImageResource::write (std::ostream& stm)
+void HiresImageResource::setImageRGBA(uint8_t mipmap, uint16_t frame, uint16_t face,
+		uint16_t slice, const uint8_t* rgba, bool dither, Quality quality)
+{
+	setImage(mipmap, frame, face, slice, encodeImage(m_Format, rgba,
+			calcMipmapSize(m_Width, mipmap), calcMipmapSize(m_Height, mipmap), dither,
+			quality));
+}
+
+
+uint32_t HiresImageResource::checksum() const
+{
+	uint32_t crc = 0;
+	for (int mm = m_MipmapCount - 1; mm >= 0; mm--) {
+		uint32_t len = getImageLength(m_Format, calcMipmapSize(m_Width, mm),
+				calcMipmapSize(m_Height, mm));
+		for (int fr = 0; fr < m_FrameCount; fr++)
+			for (int fc = 0; fc < m_FaceCount; fc++)
+				for (int sl = 0; sl < m_Depth; sl++)
+					crc = crc32(getImage(mm, fr, fc, sl), len, crc);
+	}
+	return crc;
+}
+
+
+void HiresImageResource::write (std::ostream& stm, Stats* stats)
 {
 	for (int mm = 0; mm < m_MipmapCount; mm++) {
 		uint16_t w = calcMipmapSize(m_Width, m_MipmapCount - mm - 1);
 		uint16_t h = calcMipmapSize(m_Height, m_MipmapCount - mm - 1);
 		for (int fr = 0; fr < m_FrameCount; fr++) {
-			for (int fc = 0; fc < 1; fc++) {
+			for (int fc = 0; fc < m_FaceCount; fc++) {
 				for (int sl = 0; sl < m_Depth; sl++) {
 					uint32_t len = getImageLength(m_Format, w, h);
-					uint8_t* data = getImage (mm, fr, fc, sl);
+					uint8_t* data = getImage (m_MipmapCount - mm - 1, fr, fc, sl);
+					uint64_t t0 = stats ? now() : 0;
 					stm.write((std::ostream::char_type*) data, len);
-					if (stm.fail()) {
-						delete data;
+					if (stm.fail())
 						throw Exception("Could not write high-resolution image");
+					if (stats) {
+						stats->bytesWritten += len;
+						stats->writeCalls++;
+						recordSubimage(stats, Stats::OpSave, m_MipmapCount - mm - 1, fr, fc, sl,
+								len, 0, now() - t0, 0);
 					}
 				}
 			}
@@ -415,7 +1019,30 @@ void HiresImageResource::write (std::ostream& stm)
 
 
 
+std::size_t HiresImageResource::memoryUsage() const
+{
+	std::size_t size = sizeof(*this);
+	for (uint8_t mm = 0; mm < mImages.size(); mm++) {
+		uint16_t w = calcMipmapSize(m_Width, mm);
+		uint16_t h = calcMipmapSize(m_Height, mm);
+		uint32_t len = getImageLength(m_Format, w, h);
+		uint32_t index = 0;
+		size += mOriginals[mm].capacity() * sizeof(uint32_t);
+		for (FrameList::const_iterator fr = mImages[mm].begin(); fr != mImages[mm].end(); ++fr)
+			for (FaceList::const_iterator fc = fr->begin(); fc != fr->end(); ++fc) {
+				size += fc->capacity() * sizeof(uint8_t*);
+				for (SliceList::const_iterator sl = fc->begin(); sl != fc->end(); ++sl, ++index)
+					if (*sl && mOriginals[mm][index] == index)
+						size += len;
+			}
+	}
+	return size;
+}
+
+
+
 File::File()
+	: m_Flags(0)
 {
 }
 
@@ -427,88 +1054,228 @@ File::~File()
 }
 
 
-void File::load(const std::string& fname)
+uint8_t LoadOptions::mipmapsToSkip(uint16_t width, uint16_t height, uint8_t mipmaps) const
 {
-	std::ifstream stm;
-	stm.open(fname.c_str(), std::ios::binary);
-	load(stm);
-	stm.close();
+	uint8_t skip = skipTopMips;
+	if (maxDimension > 0)
+		while (skip + 1 < mipmaps && std::max(calcMipmapSize(width, skip),
+				calcMipmapSize(height, skip)) > maxDimension)
+			skip++;
+	return std::min<uint8_t>(skip, mipmaps - 1);
+}
+
+
+void File::load(const std::string& fname, Stats* stats, const LoadOptions* options)
+{
+	Status status = tryLoad(fname, NULL, stats, options);
+	if (status != StatusOk)
+		throw Exception(statusToString(status));
+}
+
+
+void File::load(const char* data, std::size_t length, Stats* stats,
+		const LoadOptions* options)
+{
+	Status status = tryLoad(data, length, NULL, stats, options);
+	if (status != StatusOk)
+		throw Exception(statusToString(status));
 }
 
 
-void File::load(const char* data, std::size_t length)
+void File::load(FILE* f, Stats* stats, const LoadOptions* options)
 {
-	using namespace boost::iostreams;
-	stream<array_source> stm(data, length);
-	load(stm);
+	Status status = tryLoad(f, NULL, stats, options);
+	if (status != StatusOk)
+		throw Exception(statusToString(status));
 }
 
 
-void File::load(FILE* f)
+void File::load(std::istream& stm, Stats* stats, const LoadOptions* options)
 {
-	using namespace boost::iostreams;
-	stream<file_descriptor_source> stm(fileno(f), never_close_handle);
-	load(stm);
+	Status status = tryLoad(stm, NULL, stats, options);
+	if (status != StatusOk)
+		throw Exception(statusToString(status));
 }
 
 
-void File::load(std::istream& stm)
+Status File::tryLoad(const std::string& fname, uint64_t* offset, Stats* stats,
+		const LoadOptions* options) throw ()
+{
+	try {
+		std::ifstream stm;
+		stm.open(fname.c_str(), std::ios::binary);
+		if (!stm.is_open())
+			return StatusIoError;
+		return tryLoad(stm, offset, stats, options);
+	} catch (std::bad_alloc&) {
+		return StatusOutOfMemory;
+	} catch (std::exception&) {
+		return StatusIoError;
+	}
+}
+
+
+Status File::tryLoad(const char* data, std::size_t length, uint64_t* offset,
+		Stats* stats, const LoadOptions* options) throw ()
+{
+	/* the whole file is at hand, so reject truncated and corrupted ones
+		before anything gets allocated */
+	Status status = tryProbe(data, length, NULL, offset);
+	if (status != StatusOk)
+		return status;
+	
+	try {
+		using namespace boost::iostreams;
+		stream<array_source> stm(data, length);
+		return tryLoad(stm, offset, stats, options);
+	} catch (std::bad_alloc&) {
+		return StatusOutOfMemory;
+	} catch (std::exception&) {
+		return StatusIoError;
+	}
+}
+
+
+Status File::tryLoad(FILE* f, uint64_t* offset, Stats* stats,
+		const LoadOptions* options) throw ()
+{
+	try {
+		using namespace boost::iostreams;
+		stream<file_descriptor_source> stm(fileno(f), never_close_handle);
+		return tryLoad(stm, offset, stats, options);
+	} catch (std::bad_alloc&) {
+		return StatusOutOfMemory;
+	} catch (std::exception&) {
+		return StatusIoError;
+	}
+}
+
+
+/* Real files carry a handful; anything more is a corrupted header */
+#define VTF_MAX_RESOURCES	32
+
+
+/* Header fields that make the rest of the file impossible to read */
+static Status
+checkHeader (const Header& hdr)
+{
+	if (hdr.magic != 0x00465456)
+		return StatusNotVtf;
+	if (hdr.version[0] != 7)
+		return StatusBadVersion;
+	if (!(IS_POWER_OF_TWO(hdr.width) && IS_POWER_OF_TWO(hdr.height)))
+		return StatusBadDimensions;
+	if (hdr.mipmapCount == 0)
+		return StatusNoMipmaps;
+	if (hdr.lowresFormat != FormatNone
+			&& !(IS_POWER_OF_TWO(hdr.lowresWidth) && IS_POWER_OF_TWO(hdr.lowresHeight)))
+		return StatusBadLowres;
+	if (hdr.version[1] >= 2 && hdr.depth == 0)
+		return StatusBadDepth;
+	if (hdr.version[1] >= 3 && hdr.resourceCount > VTF_MAX_RESOURCES)
+		return StatusBadResource;
+	return StatusOk;
+}
+
+
+/* before 7.5 environment maps carry a spheremap as the seventh face */
+static uint16_t
+faceCount (const Header& hdr)
+{
+	if (!(hdr.flags & VTF_FLAG_ENVMAP))
+		return 1;
+	return (hdr.version[1] < 5 && hdr.firstFrame != 0xffff) ? 7 : 6;
+}
+
+
+Status File::tryLoad(std::istream& stm, uint64_t* offset, Stats* stats,
+		const LoadOptions* options) throw ()
+{
+	try {
+		uint64_t dummy;
+		return loadStream(stm, offset ? *offset : dummy, stats, options);
+	} catch (std::bad_alloc&) {
+		return StatusOutOfMemory;
+	} catch (std::exception&) {
+		return StatusIoError;
+	}
+}
+
+
+Status File::loadStream(std::istream& stm, uint64_t& offset, Stats* stats,
+		const LoadOptions* options)
 {
 	Header hdr;
+	uint64_t start = stats ? now() : 0;
+	uint64_t images = 0;
 	
 	/* read magic, version and header size */
+	offset = 0;
 	stm.read((char*) &hdr, 16);
+	recordRead(stats, 16);
 	if (stm.fail())
-		throw Exception("Header is too small");
+		return StatusHeaderTruncated;
 	
 	if (hdr.magic != 0x00465456)
-		throw Exception("Not a VTF file");
+		return StatusNotVtf;
 	
 	if (hdr.version[0] != 7)
-		throw Exception("Unknown version");
+		return StatusBadVersion;
 	
 	stm.seekg(0);
 	stm.read((char*) &hdr, sizeof(hdr));
+	recordRead(stats, sizeof(hdr));
 	if (stm.fail())
-		throw Exception("Header is too small");
+		return StatusHeaderTruncated;
 	
-	if (!(IS_POWER_OF_TWO(hdr.width) && IS_POWER_OF_TWO(hdr.height)))
-		throw Exception("Dimensions of the image are not power of 2");
-	
-	if (hdr.mipmapCount == 0)
-		throw Exception("Number of mipmap images equals 0");
-	
-	if (!(IS_POWER_OF_TWO(hdr.lowresWidth) && IS_POWER_OF_TWO(hdr.lowresHeight)))
-		throw Exception("Lowres image dimensions are not power of 2");
-	
-	if (hdr.version[0] >= 7 && hdr.version[1] >= 2) {
-		if (hdr.depth == 0)
-			throw Exception("Texture depth equals 0");
-	} else {
+	Status status = checkHeader(hdr);
+	if (status != StatusOk)
+		return status;
+	if (hdr.version[1] < 2)
 		hdr.depth = 1;
-	}
 	
-	if (hdr.version[0] >= 7 && hdr.version[1] >= 3) {
-		HeaderResource* rsrc = new HeaderResource[hdr.resourceCount];
-		stm.read((char*) rsrc, sizeof(rsrc) * hdr.resourceCount);
-		if (stm.fail()) {
-			delete rsrc;
-			throw Exception("Header is too small");
-		}
+	uint16_t faces = faceCount(hdr);
+	m_Flags = hdr.flags;
+	uint8_t skip = options ? options->mipmapsToSkip(hdr.width, hdr.height,
+			hdr.mipmapCount) : 0;
+	
+	if (hdr.version[1] >= 3) {
+		std::vector<HeaderResource> rsrc(hdr.resourceCount);
+		offset = sizeof(hdr);
+		if (hdr.resourceCount > 0)
+			stm.read((char*) &rsrc[0], sizeof(HeaderResource) * hdr.resourceCount);
+		recordRead(stats, sizeof(HeaderResource) * hdr.resourceCount);
+		if (stm.fail())
+			return StatusHeaderTruncated;
 		
 		for (uint32_t i = 0; i < hdr.resourceCount; i++) {
 			switch (rsrc[i].type) {
 			case Resource::TypeLowres: {
+				uint64_t t0 = stats ? now() : 0;
 				LowresImageResource* res = new LowresImageResource;
-				res->read(stm, rsrc[i].offset, hdr.lowresFormat,
-						hdr.lowresWidth, hdr.lowresHeight);
+				offset = rsrc[i].offset;
+				status = res->tryRead(stm, rsrc[i].offset, hdr.lowresFormat,
+						hdr.lowresWidth, hdr.lowresHeight, stats);
+				if (status != StatusOk) {
+					delete res;
+					return status;
+				}
 				addResource(res);
+				images += stats ? now() - t0 : 0;
 				} break;
 			case Resource::TypeHires: {
+				uint64_t t0 = stats ? now() : 0;
 				HiresImageResource* res = new HiresImageResource;
-				res->read(stm, rsrc[i].offset, hdr.format, hdr.width, hdr.height,
-						hdr.depth, hdr.mipmapCount, hdr.frameCount);
+				offset = rsrc[i].offset;
+				status = res->tryRead(stm, rsrc[i].offset, hdr.format, hdr.width, hdr.height,
+						hdr.depth, hdr.mipmapCount, hdr.frameCount, faces, stats, skip,
+						&offset);
+				if (status != StatusOk) {
+					delete res;
+					return status;
+				}
 				addResource(res);
+				images += stats ? now() - t0 : 0;
 				}break;
 			case Resource::TypeCRC: {
 				CRCResource* res = new CRCResource;
@@ -516,39 +1283,261 @@ void File::load(std::istream& stm)
 				addResource(res);
 				} break;
 			default:
-				throw Exception("Unknown resource type");
+				offset = sizeof(hdr) + i * sizeof(HeaderResource);
+				return StatusBadResource;
 			}
 		}
 		
-		delete[] rsrc;
+		if (!findResource(Resource::TypeHires))
+			return StatusNoImage;
 	} else {
 		/* This version does not support resources, but we add them anyway.
 			First read lowres image, if needed. */
+		uint64_t t0 = stats ? now() : 0;
+		offset = hdr.headerSize;
 		if (hdr.lowresFormat != FormatNone) {
 			LowresImageResource* res = new LowresImageResource;
-			res->read(stm, hdr.headerSize, hdr.lowresFormat,
-					hdr.lowresWidth, hdr.lowresHeight);
+			status = res->tryRead(stm, hdr.headerSize, hdr.lowresFormat,
+					hdr.lowresWidth, hdr.lowresHeight, stats);
+			if (status != StatusOk) {
+				delete res;
+				return status;
+			}
 			addResource(res);
 		}
-		/* then read actual image */
+		/* then read actual image, which follows the header and lowres
+			image; where the header ends is headerSize, not sizeof(hdr) */
 		HiresImageResource* res = new HiresImageResource;
-		res->read(stm, stm.tellg(), hdr.format, hdr.width, hdr.height,
-				hdr.depth, hdr.mipmapCount, hdr.frameCount);
+		offset = hdr.headerSize;
+		if (hdr.lowresFormat != FormatNone)
+			offset += getImageLength(hdr.lowresFormat, hdr.lowresWidth, hdr.lowresHeight);
+		status = res->tryRead(stm, offset, hdr.format, hdr.width, hdr.height,
+				hdr.depth, hdr.mipmapCount, hdr.frameCount, faces, stats, skip, &offset);
+		if (status != StatusOk) {
+			delete res;
+			return status;
+		}
 		addResource(res);
+		images += stats ? now() - t0 : 0;
+	}
+	
+	if (stats) {
+		uint64_t total = now() - start;
+		stats->headerTime += total - images;
+		stats->totalTime += total;
+	}
+	return StatusOk;
+}
+
+
+Status File::tryProbe(const char* data, std::size_t length, FileInfo* info,
+		uint64_t* offset) throw ()
+{
+	uint64_t dummy;
+	uint64_t& where = offset ? *offset : dummy;
+	Header hdr;
+	
+	where = 0;
+	if (length < 16)
+		return StatusHeaderTruncated;
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(&hdr, data, std::min(length, sizeof(hdr)));
+	if (hdr.magic != 0x00465456)
+		return StatusNotVtf;
+	if (hdr.version[0] != 7)
+		return StatusBadVersion;
+	if (length < sizeof(hdr))
+		return StatusHeaderTruncated;
+	
+	Status status = checkHeader(hdr);
+	if (status != StatusOk)
+		return status;
+	if (hdr.version[1] < 2)
+		hdr.depth = 1;
+	
+	uint16_t faces = faceCount(hdr);
+	uint64_t lowres_length = hdr.lowresFormat == FormatNone ? 0
+			: getImageLength(hdr.lowresFormat, hdr.lowresWidth, hdr.lowresHeight);
+	uint64_t hires_length = 0;
+	for (uint8_t mm = 0; mm < hdr.mipmapCount; mm++)
+		hires_length += (uint64_t) getImageLength(hdr.format, calcMipmapSize(hdr.width, mm),
+				calcMipmapSize(hdr.height, mm)) * hdr.frameCount * faces * hdr.depth;
+	
+	/* where each image starts, then check that it fits */
+	uint64_t lowres_offset = hdr.headerSize;
+	uint64_t hires_offset = hdr.headerSize + lowres_length;
+	if (hdr.version[1] >= 3) {
+		uint64_t table_end = sizeof(hdr) + (uint64_t) hdr.resourceCount * sizeof(HeaderResource);
+		if (length < table_end) {
+			where = length;
+			return StatusHeaderTruncated;
+		}
+		
+		bool has_hires = false;
+		for (uint32_t i = 0; i < hdr.resourceCount; i++) {
+			uint32_t rsrc[2];	/* type, offset */
+			memcpy(rsrc, data + sizeof(hdr) + i * sizeof(HeaderResource), sizeof(rsrc));
+			if (rsrc[0] == Resource::TypeLowres) {
+				lowres_offset = rsrc[1];
+			} else if (rsrc[0] == Resource::TypeHires) {
+				hires_offset = rsrc[1];
+				has_hires = true;
+			} else if (rsrc[0] != Resource::TypeCRC) {
+				where = sizeof(hdr) + i * sizeof(HeaderResource);
+				return StatusBadResource;
+			}
+		}
+		if (!has_hires)
+			return StatusNoImage;
+	}
+	
+	if (hdr.lowresFormat != FormatNone && lowres_offset + lowres_length > length) {
+		where = lowres_offset;
+		return StatusLowresTruncated;
+	}
+	if (hires_offset + hires_length > length) {
+		where = std::min<uint64_t>(hires_offset, length);
+		return StatusHiresTruncated;
+	}
+	
+	if (info) {
+		info->version = hdr.version[1];
+		info->format = hdr.format;
+		info->width = hdr.width;
+		info->height = hdr.height;
+		info->depth = hdr.depth;
+		info->frames = hdr.frameCount;
+		info->faces = faces;
+		info->mipmaps = hdr.mipmapCount;
+		info->flags = hdr.flags;
+		info->lowresFormat = hdr.lowresFormat;
+		info->lowresWidth = hdr.lowresWidth;
+		info->lowresHeight = hdr.lowresHeight;
+		info->lowresOffset = lowres_offset;
+		info->hiresOffset = hires_offset;
 	}
+	return StatusOk;
 }
 
 
-void File::save(const std::string& fname, uint32_t version)
+uint64_t FileInfo::subimageOffset(uint8_t mipmap, uint16_t frame, uint16_t face,
+		uint16_t slice) const
+{
+	uint64_t count = (uint64_t) frames * faces * depth;
+	uint64_t offset = hiresOffset;
+	
+	/* smaller mipmaps come first */
+	for (uint8_t mm = mipmaps - 1; mm > mipmap; mm--)
+		offset += getImageLength(format, calcMipmapSize(width, mm),
+				calcMipmapSize(height, mm)) * count;
+	
+	uint64_t index = ((uint64_t) frame * faces + face) * depth + slice;
+	return offset + index * getImageLength(format, calcMipmapSize(width, mipmap),
+			calcMipmapSize(height, mipmap));
+}
+
+
+/* Difference hash: 9x8 luminance thumbnail, one bit per pair of
+	horizontal neighbours. Survives rescaling and recompression. */
+static uint64_t
+perceptualHash (const uint8_t* data, Format format, uint16_t width, uint16_t height)
+{
+	std::vector<uint8_t> rgba((std::size_t) width * height * 4);
+	if (!convert(data, format, &rgba[0], FormatRGBA8888, width, height))
+		return 0;
+	
+	uint8_t thumb[9 * 8 * 4];
+	resample(&rgba[0], width, height, thumb, 9, 8,
+			width >= 9 && height >= 8 ? FilterBox : FilterBilinear);
+	
+	uint64_t hash = 0;
+	for (int y = 0; y < 8; y++) {
+		for (int x = 0; x < 8; x++) {
+			const uint8_t* a = thumb + (y * 9 + x) * 4;
+			const uint8_t* b = a + 4;
+			uint32_t la = a[0] * 77 + a[1] * 150 + a[2] * 29;
+			uint32_t lb = b[0] * 77 + b[1] * 150 + b[2] * 29;
+			if (la < lb)
+				hash |= (uint64_t) 1 << (y * 8 + x);
+		}
+	}
+	return hash;
+}
+
+
+/* Hashes the stored payload straight from memory, nothing is decoded
+	unless the perceptual hash is asked for */
+Status File::tryFingerprint(const char* data, std::size_t length, Fingerprint& fp,
+		bool perceptual) throw ()
+{
+	FileInfo info;
+	Status status = tryProbe(data, length, &info);
+	if (status != StatusOk)
+		return status;
+	
+	try {
+		/* same pixels in a different layout are a different file */
+		uint32_t layout[7] = {(uint32_t) info.format, info.width, info.height, info.depth,
+				info.frames, info.faces, info.mipmaps};
+		uint32_t count = (uint32_t) info.frames * info.faces * info.depth;
+		const uint8_t* p = (const uint8_t*) data + info.hiresOffset;
+		const uint8_t* thumb = NULL;
+		uint16_t thumb_width = 0, thumb_height = 0;
+		
+		fp.content = hash64((const uint8_t*) layout, sizeof(layout));
+		fp.perceptual = 0;
+		fp.subimages.clear();
+		fp.subimages.reserve((std::size_t) count * info.mipmaps);
+		
+		for (int mm = info.mipmaps - 1; mm >= 0; mm--) {
+			uint16_t width = calcMipmapSize(info.width, mm);
+			uint16_t height = calcMipmapSize(info.height, mm);
+			uint32_t image_length = getImageLength(info.format, width, height);
+			
+			/* the smallest mipmap still big enough for the thumbnail */
+			if (!thumb || thumb_width < 8 || thumb_height < 8) {
+				thumb = p;
+				thumb_width = width;
+				thumb_height = height;
+			}
+			
+			for (uint32_t i = 0; i < count; i++, p += image_length) {
+				uint64_t hash = hash64(p, image_length);
+				fp.subimages.push_back(hash);
+				fp.content = hash64((const uint8_t*) &hash, sizeof(hash), fp.content);
+			}
+		}
+		
+		if (perceptual) {
+			Format thumb_format = info.format;
+			if ((uint32_t) thumb_width * thumb_height > 64 * 64
+					&& info.lowresFormat != FormatNone) {
+				thumb = (const uint8_t*) data + info.lowresOffset;
+				thumb_format = info.lowresFormat;
+				thumb_width = info.lowresWidth;
+				thumb_height = info.lowresHeight;
+			}
+			if (thumb && thumb_width && thumb_height)
+				fp.perceptual = perceptualHash(thumb, thumb_format, thumb_width, thumb_height);
+		}
+	} catch (std::bad_alloc&) {
+		return StatusOutOfMemory;
+	}
+	return StatusOk;
+}
+
+
+void File::save(const std::string& fname, uint32_t version, Stats* stats)
 {
 	std::ofstream stm(fname.c_str(), std::ios::binary);
-	save(stm, version);
+	save(stm, version, stats);
 	stm.close();
 }
 
 
-void File::save(std::ostream& stm, uint32_t version)
+void File::save(std::ostream& stm, uint32_t version, Stats* stats)
 {
+	uint64_t start = stats ? now() : 0;
 	Header hdr;
 	memset (&hdr, 0, sizeof (hdr));
 	
@@ -561,49 +1550,96 @@ void File::save(std::ostream& stm, uint32_t version)
 		throw Exception("High-resolution image is not provided");
 	
 	LowresImageResource* lowres = (LowresImageResource*) findResource(Resource::TypeLowres);
+	CRCResource* crc = (CRCResource*) findResource(Resource::TypeCRC);
 	
 	hdr.width = hires->width();
 	hdr.height = hires->height();
+	hdr.flags = m_Flags;
 	hdr.frameCount = hires->frameCount();
+	hdr.bumpmapScale = 1.0f;
 	hdr.format = hires->format();
 	hdr.mipmapCount = hires->mipmapCount();
+	hdr.depth = hires->depth();
 	
+	if (hires->faceCount() == 6) {
+		hdr.flags |= VTF_FLAG_ENVMAP;
+		hdr.firstFrame = 0xffff;
+	} else if (hires->faceCount() == 7) {
+		hdr.flags |= VTF_FLAG_ENVMAP;
+	} else if (hires->faceCount() != 1) {
+		throw Exception("Unsupported number of faces");
+	}
+	
+	uint32_t lowresLength = 0;
 	if (lowres) {
 		hdr.lowresFormat = lowres->format();
 		hdr.lowresWidth = lowres->width();
 		hdr.lowresHeight = lowres->height();
+		lowresLength = getImageLength(lowres->format(), lowres->width(), lowres->height());
+	} else {
+		hdr.lowresFormat = FormatNone;
 	}
 	
-	/* base header size */
+	std::vector<HeaderResource> rsrc;
 	switch (version) {
-		case 0:  hdr.headerSize = 80; break;
-		case 2:  hdr.headerSize = 80;  break; /* + */
-		case 3:  hdr.headerSize = 104; break;
-		case 4:  hdr.headerSize = 104; break; /* + */
+		case 0:
+		case 1:
+		case 2:
+			hdr.headerSize = sizeof(hdr);
+			if (!lowres)
+				throw Exception("Low-resolution image is required by this version");
+			break;
+		case 3:
+		case 4: {
+			uint32_t count = (lowres ? 1 : 0) + 1 + (crc ? 1 : 0);
+			hdr.resourceCount = count;
+			hdr.headerSize = sizeof(hdr) + count * sizeof(HeaderResource);
+			
+			HeaderResource res;
+			if (lowres) {
+				res.type = Resource::TypeLowres;
+				res.offset = hdr.headerSize;
+				rsrc.push_back(res);
+			}
+			res.type = Resource::TypeHires;
+			res.offset = hdr.headerSize + lowresLength;
+			rsrc.push_back(res);
+			if (crc) {
+				res.type = Resource::TypeCRC;
+				res.offset = crc->get();
+				rsrc.push_back(res);
+			}
+			} break;
 		default:
 			throw Exception ("Unsupported version");
 	}
 	
-	/*  */
-	stm.write((char*) &hdr, hdr.headerSize);
-	
-	if (hdr.version[1] >= 3) {
-		
+	stm.write((char*) &hdr, sizeof(hdr));
+	if (!rsrc.empty())
+		stm.write((char*) &rsrc[0], rsrc.size() * sizeof(HeaderResource));
+	if (stm.fail())
+		throw Exception("Could not write header");
+	if (stats) {
+		stats->bytesWritten += hdr.headerSize;
+		stats->writeCalls += rsrc.empty() ? 1 : 2;
 	}
 	
 	if (lowres)
-		lowres->write (stm);
-	hires->write (stm);
+		lowres->write (stm, stats);
+	hires->write (stm, stats);
+	
+	if (stats)
+		stats->totalTime += now() - start;
 }
 
 
-int
-calc_mipmap_count (int width, int height)
+uint8_t
+calcMipmapCount (uint16_t width, uint16_t height)
 {
-	int size = std::max(width, height);
-	int count = 1;
+	uint16_t size = std::max(width, height);
+	uint8_t count = 1;
 	
-	while (size == 1) {
+	while (size > 1) {
 		size /= 2;
 		count++;
 	}
@@ -628,6 +1664,24 @@ Resource* File::findResource(Resource::Type type)
 }
 
 
+const Resource* File::findResource(Resource::Type type) const
+{
+	for (ResourceList::const_iterator i = mResourceList.begin(); i != mResourceList.end(); ++i)
+		if ((*i)->getType() == type)
+			return (*i);
+	return NULL;
+}
+
+
+std::size_t File::memoryUsage() const
+{
+	std::size_t size = sizeof(*this) + mResourceList.capacity() * sizeof(Resource*);
+	for (ResourceList::const_iterator i = mResourceList.begin(); i != mResourceList.end(); ++i)
+		size += (*i)->memoryUsage();
+	return size;
+}
+
+
 void File::delResource(Resource::Type type)
 {
 	/* TODO */
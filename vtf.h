@@ -4,12 +4,41 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <iostream>
+#include <string>
 #include <vector>
 
 
 namespace Vtf {
 
 
+/* flags */
+#define VTF_FLAG_POINTSAMPLE			0x00000001
+#define VTF_FLAG_TRILINEAR				0x00000002
+#define VTF_FLAG_CLAMPS					0x00000004
+#define VTF_FLAG_CLAMPT					0x00000008
+#define VTF_FLAG_ANISOTROPIC			0x00000010
+#define VTF_FLAG_HINT_DXT5				0x00000020
+#define VTF_FLAG_PWL_CORRECTED			0x00000040
+#define VTF_FLAG_NORMAL					0x00000080
+#define VTF_FLAG_NOMIP					0x00000100
+#define VTF_FLAG_NOLOD					0x00000200
+#define VTF_FLAG_ALL_MIPS				0x00000400
+#define VTF_FLAG_PROCEDURAL				0x00000800
+#define VTF_FLAG_ONEBITALPHA			0x00001000
+#define VTF_FLAG_EIGHTBITALPHA			0x00002000
+#define VTF_FLAG_ENVMAP					0x00004000
+#define VTF_FLAG_RENDERTARGET			0x00008000
+#define VTF_FLAG_DEPTHRENDERTARGET		0x00010000
+#define VTF_FLAG_NODEBUGOVERRIDE		0x00020000
+#define VTF_FLAG_SINGLECOPY				0x00040000
+#define VTF_FLAG_PRE_SRGB				0x00080000
+#define VTF_FLAG_NODEPTHBUFFER			0x00800000
+#define VTF_FLAG_CLAMPU					0x02000000
+#define VTF_FLAG_VERTEXTEXTURE			0x04000000
+#define VTF_FLAG_SSBUMP					0x08000000
+#define VTF_FLAG_BORDER					0x20000000
+
+
 enum Format {
 	FormatNone				= 0xFFFFFFFF,
 	FormatRGBA8888			= 0,
@@ -42,6 +71,145 @@ enum Format {
 };
 
 
+enum Filter {
+	FilterBox,
+	FilterBilinear
+};
+
+
+/* DXT encoders, fastest first. QualityFast is the in-tree encoder, the
+	others are libsquish's range, cluster and iterative cluster fits. */
+enum Quality {
+	QualityFast,
+	QualityRange,
+	QualityCluster,
+	QualityIterative
+};
+
+
+/* Results of the non-throwing API. The throwing one reports the same
+	conditions as Exception with statusToString() as the message. */
+enum Status {
+	StatusOk = 0,
+	StatusIoError,
+	StatusHeaderTruncated,
+	StatusNotVtf,
+	StatusBadVersion,
+	StatusBadDimensions,
+	StatusNoMipmaps,
+	StatusBadLowres,
+	StatusBadDepth,
+	StatusBadResource,
+	StatusLowresTruncated,
+	StatusHiresTruncated,
+	StatusNoImage,
+	StatusUnsupportedFormat,
+	StatusBadArgument,
+	StatusOutOfMemory
+};
+
+
+/* Where a normal map keeps its tangent-space vector */
+enum NormalEncoding {
+	NormalRGB,			/* x, y, z in R, G, B (also SSBUMP, passed through) */
+	NormalDXT5nm,		/* x in A, y in G, z reconstructed */
+	NormalSigned		/* signed U, V (UV88, UVWQ8888), z reconstructed */
+};
+
+
+
+/* What an RGBA8888 image needs from its storage format, accumulated by
+	analyzeRGBA() over any number of images */
+struct ImageTraits
+{
+	bool opaque;		/* every alpha is 255 */
+	bool binaryAlpha;	/* every alpha is 0 or 255 */
+	bool grey;			/* R == G == B everywhere */
+	
+	inline ImageTraits() : opaque(true), binaryAlpha(true), grey(true)
+		{}
+};
+
+
+
+/* Result of diffImages(), one entry per 4x4 block in row-major order */
+struct BlockDiff
+{
+	uint16_t blocksWide;
+	uint16_t blocksHigh;
+	std::vector<uint8_t> changed;	/* 1 where the blocks differ */
+	uint32_t changedCount;
+	
+	/* pixel bounds of the changed blocks, empty (x0 == x1) if none */
+	uint16_t x0, y0, x1, y1;
+	
+	/* over the changed blocks only, decoded to RGBA */
+	uint8_t maxError;
+	double psnr;
+};
+
+
+
+/* Filled in by computeStats(). Luminance is (77 R + 150 G + 29 B) / 256. */
+struct ImageStats
+{
+	uint8_t mipmap;
+	uint16_t frame;
+	uint16_t face;
+	uint16_t slice;
+	uint16_t width;
+	uint16_t height;
+	
+	double average[4];			/* RGBA, 0 to 255 */
+	uint8_t minLuminance;
+	uint8_t maxLuminance;
+	double coverage;			/* share of pixels with alpha >= 128 */
+	uint32_t luminance[256];	/* histograms, pixel counts */
+	uint32_t alpha[256];
+};
+
+
+
+/* Optional counters filled in by File::load, File::save and
+	HiresImageResource::getImageRGBA. Counters accumulate until reset(),
+	so one object may be passed to several calls. Times are in nanoseconds. */
+struct Stats
+{
+	enum Operation {
+		OpLoad,
+		OpDecode,
+		OpSave
+	};
+	
+	struct Subimage {
+		Operation op;
+		uint8_t mipmap;
+		uint16_t frame;
+		uint16_t face;
+		uint16_t slice;
+		uint32_t length;		/* bytes read, written or produced */
+		uint64_t allocTime;
+		uint64_t ioTime;		/* stream reads or writes */
+		uint64_t decodeTime;	/* swizzle or DXT decompression */
+	};
+	
+	uint64_t bytesRead;
+	uint64_t bytesWritten;
+	uint32_t readCalls;			/* read requests issued to the stream */
+	uint32_t writeCalls;		/* write requests issued to the stream */
+	uint32_t allocCount;
+	uint64_t allocBytes;
+	uint64_t headerTime;		/* header and resource table parsing */
+	uint64_t totalTime;
+	std::vector<Subimage> subimages;
+	
+	inline Stats()
+		{reset();}
+	
+	void reset();
+};
+
+
 
 class Resource
 {
@@ -61,6 +229,9 @@ public:
 	inline Type getType() const
 		{return mType;}
 	
+	virtual inline std::size_t memoryUsage() const
+		{return sizeof(*this);}
+	
 private:
 	Type	mType;
 };
@@ -99,10 +270,20 @@ public:
 		{ if (m_Image) delete[] m_Image; }
 	
 	void read(std::istream& stm, uint32_t offset, Format format,
-			uint16_t width, uint16_t height);
+			uint16_t width, uint16_t height, Stats* stats = NULL);
+	Status tryRead(std::istream& stm, uint32_t offset, Format format,
+			uint16_t width, uint16_t height, Stats* stats = NULL);
+	
+	uint8_t* getImageRGBA() const;
+	uint8_t* getImageAs(Format format) const;
+	bool isOpaque() const;
 	
 	void setup(Format format, uint16_t width, uint16_t height);
-	void write (std::ostream& stm) const;
+	void setImage(uint8_t* data);
+	void setImageRGBA(const uint8_t* rgba);
+	void write (std::ostream& stm, Stats* stats = NULL) const;
+	
+	std::size_t memoryUsage() const;
 	
 private:
 	uint8_t* m_Image;
@@ -119,37 +300,107 @@ public:
 	
 	void read(std::istream& stm, uint32_t offset, Format format,
 			uint16_t width, uint16_t height, uint16_t depth,
-			uint8_t mipmaps, uint16_t frames);
+			uint8_t mipmaps, uint16_t frames, uint16_t faces, Stats* stats = NULL,
+			uint8_t skipMips = 0);
+	/* errorOffset receives the file offset of the subimage that could
+		not be read */
+	Status tryRead(std::istream& stm, uint32_t offset, Format format,
+			uint16_t width, uint16_t height, uint16_t depth,
+			uint8_t mipmaps, uint16_t frames, uint16_t faces, Stats* stats = NULL,
+			uint8_t skipMips = 0, uint64_t* errorOffset = NULL);
 	
-	inline uint16_t depth()
+	inline uint16_t depth() const
 		{return m_Depth;}
 	
-	inline uint32_t frameCount()
+	inline uint32_t frameCount() const
 		{return m_FrameCount;}
 	
-	inline uint8_t mipmapCount()
+	inline uint8_t mipmapCount() const
 		{return m_MipmapCount;}
 	
+	inline uint16_t faceCount() const
+		{return m_FaceCount;}
+	
 	uint8_t* getImage(uint8_t mipmap, uint16_t frame, uint16_t face, uint16_t slice);
-	uint8_t* getImageRGBA(uint8_t mipmap, uint16_t frame, uint16_t face, uint16_t slice);
+	const uint8_t* getImage(uint8_t mipmap, uint16_t frame, uint16_t face,
+			uint16_t slice) const;
+	uint8_t* getImageRGBA(uint8_t mipmap, uint16_t frame, uint16_t face, uint16_t slice,
+			Stats* stats = NULL) const;
+	
+	/* Byte-identical subimages of a mipmap are detected on read and share
+		the storage of the first one. findOriginal() moves the coordinates to
+		that first subimage and returns true if they changed, so callers can
+		reuse decoded results too. */
+	bool findOriginal(uint8_t mipmap, uint16_t& frame, uint16_t& face,
+			uint16_t& slice) const;
+	uint32_t uniqueCount() const;
+	/* Subimage in any format, see convert() */
+	uint8_t* getImageAs(Format format, uint8_t mipmap, uint16_t frame, uint16_t face,
+			uint16_t slice) const;
+	/* Same into a caller provided buffer of getImageLength() bytes */
+	Status tryDecode(Format format, uint8_t mipmap, uint16_t frame, uint16_t face,
+			uint16_t slice, uint8_t* dst) const throw ();
+	bool isOpaque(uint8_t mipmap, uint16_t frame, uint16_t face, uint16_t slice) const;
+	/* computeStats() of every subimage, ordered by mipmap, frame, face and
+		slice. Shared subimages are only measured once. */
+	bool computeStats(std::vector<ImageStats>& stats) const;
+	uint8_t* getNormals(uint8_t mipmap, uint16_t frame, uint16_t face, uint16_t slice,
+			NormalEncoding encoding) const;
+	float* getNormalsFloat(uint8_t mipmap, uint16_t frame, uint16_t face, uint16_t slice,
+			NormalEncoding encoding) const;
+	/* Cairo's CAIRO_FORMAT_ARGB32: native endian, premultiplied alpha */
+	uint8_t* getImageARGB32(uint8_t mipmap, uint16_t frame, uint16_t face,
+			uint16_t slice) const;
+	
+	/* Region decoding. For DXT formats only the 4x4 blocks intersecting
+		the region are decompressed. A subimage that does not exist or a
+		region outside the mipmap gives NULL or false. */
+	uint8_t* getImageRGBA(uint8_t mipmap, uint16_t frame, uint16_t face, uint16_t slice,
+			uint16_t x, uint16_t y, uint16_t width, uint16_t height,
+			Stats* stats = NULL) const;
+	bool decodeRegion(uint8_t mipmap, uint16_t frame, uint16_t face, uint16_t slice,
+			uint16_t x, uint16_t y, uint16_t width, uint16_t height,
+			uint8_t* dst, uint32_t rowstride) const;
+	
+	/* Decodes the smallest mipmap that is not smaller than the target and
+		resamples it to exactly targetWidth x targetHeight RGBA. */
+	uint8_t* decode(uint16_t frame, uint16_t face, uint16_t slice,
+			uint16_t targetWidth, uint16_t targetHeight,
+			Filter filter = FilterBox, Stats* stats = NULL) const;
+	uint8_t findMipmap(uint16_t targetWidth, uint16_t targetHeight) const;
 	
 	void clear();
 	void setup(Format format, uint16_t width, uint16_t height, uint8_t mipmaps, uint16_t frames,
 			uint16_t faces, uint16_t slices);
 	void setImage(uint8_t mipmap, uint16_t frame, uint16_t face, uint16_t slice, uint8_t* data);
-	bool check();
-	void write (std::ostream& stm);
+	void setImageRGBA(uint8_t mipmap, uint16_t frame, uint16_t face, uint16_t slice,
+			const uint8_t* rgba, bool dither = false, Quality quality = QualityCluster);
+	uint32_t checksum() const;
+	bool check() const;
+	void write (std::ostream& stm, Stats* stats = NULL);
+	
+	std::size_t memoryUsage() const;
 	
 protected:
 	uint16_t m_Depth;
 	uint8_t m_MipmapCount;
 	uint16_t m_FrameCount;
+	uint16_t m_FaceCount;
 	
 	typedef std::vector<uint8_t*>	SliceList;
 	typedef std::vector<SliceList>	FaceList;
 	typedef std::vector<FaceList>	FrameList;
 	typedef std::vector<FrameList>	MipmapList;
 	MipmapList mImages;
+	
+	/* per mipmap, index of the first identical subimage (itself if unique) */
+	typedef std::vector<std::vector<uint32_t> >	OriginalList;
+	OriginalList mOriginals;
+	
+	uint32_t subimageIndex(uint16_t frame, uint16_t face, uint16_t slice) const;
+	bool validRegion(uint8_t mipmap, uint16_t frame, uint16_t face, uint16_t slice,
+			uint16_t x, uint16_t y, uint16_t width, uint16_t height) const;
+	uint8_t* getImage(uint8_t mipmap, uint32_t index);
 };
 
 
@@ -173,27 +424,226 @@ private:
 };
 
 
+/* Like Source's mat_picmip: the largest mipmaps are neither read nor
+	allocated, and the high-resolution image reports the reduced size.
+	The smallest mipmap is always kept. */
+struct LoadOptions
+{
+	inline LoadOptions() : skipTopMips(0), maxDimension(0)
+		{}
+	
+	uint8_t skipTopMips;
+	uint16_t maxDimension;		/* 0 for no limit */
+	
+	uint8_t mipmapsToSkip(uint16_t width, uint16_t height, uint8_t mipmaps) const;
+};
+
+
+/* What File::tryProbe learns from the header alone */
+struct FileInfo
+{
+	uint32_t version;			/* minor, 7.x */
+	Format format;
+	uint16_t width;
+	uint16_t height;
+	uint16_t depth;
+	uint16_t frames;
+	uint16_t faces;
+	uint8_t mipmaps;
+	uint32_t flags;
+	Format lowresFormat;
+	uint16_t lowresWidth;
+	uint16_t lowresHeight;
+	uint64_t lowresOffset;		/* file offsets of the image data */
+	uint64_t hiresOffset;
+	
+	/* File offset of one high-resolution subimage, so that a mapped file
+		can be decoded piece by piece without loading it */
+	uint64_t subimageOffset(uint8_t mipmap, uint16_t frame, uint16_t face,
+			uint16_t slice) const;
+};
+
+
+/* Identifies a file by its pixel payload. Subimage hashes are over the
+	stored bytes in file order (smallest mipmap first); the perceptual
+	hash is a 64 bit difference hash of a small mipmap, 0 if not asked for
+	or the format cannot be decoded. */
+struct Fingerprint
+{
+	uint64_t content;
+	uint64_t perceptual;
+	std::vector<uint64_t> subimages;
+};
+
+
+/* Thread safety. A loaded File is plain immutable data: any number of
+	threads may call the const members of a File and its resources
+	(findResource, getImage, getImageRGBA, getImageAs, tryDecode,
+	decodeRegion, decode, computeStats and the like) at once, on the same
+	or different subimages. They only read the shared storage, write into
+	memory they allocate or are handed, and take no locks. Loading,
+	adding or deleting resources, setup() and setImage*() need the File
+	to themselves, even for different subimages: setImage() rewrites the
+	duplicate bookkeeping of its whole mipmap. To encode in parallel,
+	run encodeImage() or packRGBA() on the threads and hand the buffers
+	to setImage() from one thread, as the GIMP exporter and vtf-check
+	--stress do. A Stats object must not be shared between threads. */
 class File
 {
 public:
 	File();
 	~File();
 	
-	void load(const std::string& fname);
-	void load(const char* data, std::size_t length);
-	void load(FILE* f);
-	void load(std::istream& stm);
+	/* The try* variants never throw. On failure offset, if given, is set
+		to where in the file the problem was found. */
+	Status tryLoad(const std::string& fname, uint64_t* offset = NULL,
+			Stats* stats = NULL, const LoadOptions* options = NULL) throw ();
+	Status tryLoad(const char* data, std::size_t length, uint64_t* offset = NULL,
+			Stats* stats = NULL, const LoadOptions* options = NULL) throw ();
+	Status tryLoad(FILE* f, uint64_t* offset = NULL, Stats* stats = NULL,
+			const LoadOptions* options = NULL) throw ();
+	Status tryLoad(std::istream& stm, uint64_t* offset = NULL, Stats* stats = NULL,
+			const LoadOptions* options = NULL) throw ();
+	
+	/* Validates the header and that the images fit into LENGTH bytes,
+		without reading or allocating any of them */
+	static Status tryProbe(const char* data, std::size_t length, FileInfo* info,
+			uint64_t* offset = NULL) throw ();
+	static Status tryFingerprint(const char* data, std::size_t length, Fingerprint& fp,
+			bool perceptual = false) throw ();
 	
-	void save(const std::string& fname, uint32_t version);
-	void save(std::ostream& stm, uint32_t version);
+	void load(const std::string& fname, Stats* stats = NULL,
+			const LoadOptions* options = NULL);
+	void load(const char* data, std::size_t length, Stats* stats = NULL,
+			const LoadOptions* options = NULL);
+	void load(FILE* f, Stats* stats = NULL, const LoadOptions* options = NULL);
+	void load(std::istream& stm, Stats* stats = NULL, const LoadOptions* options = NULL);
+	
+	void save(const std::string& fname, uint32_t version, Stats* stats = NULL);
+	void save(std::ostream& stm, uint32_t version, Stats* stats = NULL);
 	
 	void addResource(Resource* res);
 	void delResource(Resource::Type type);
 	Resource* findResource(Resource::Type type);
+	const Resource* findResource(Resource::Type type) const;
+	
+	inline uint32_t flags() const
+		{return m_Flags;}
+	
+	inline void setFlags(uint32_t flags)
+		{m_Flags = flags;}
+	
+	std::size_t memoryUsage() const;
 	
 private:
 	typedef std::vector<Resource*> ResourceList;
 	ResourceList mResourceList;
+	uint32_t m_Flags;
+	
+	Status loadStream(std::istream& stm, uint64_t& offset, Stats* stats,
+			const LoadOptions* options);
+};
+
+
+
+/* Loads files on a pool of worker threads. Each file is read with pread(2)
+	in one go and parsed in the background, so reading of the next file
+	overlaps with whatever the caller does with the previous one.
+	Completed files are picked up from the queue with wait() or poll(). */
+class Loader
+{
+public:
+	struct Result {
+		uint32_t ticket;
+		std::string fname;
+		File* file;			/* owned by the caller, NULL on error */
+		std::string error;
+	};
+	
+	Loader(unsigned int threads = 0);
+	~Loader();
+	
+	uint32_t submit(const std::string& fname);
+	bool wait(Result& result);
+	bool poll(Result& result);
+	uint32_t pending() const;
+	
+private:
+	struct Private;
+	friend class LoadTask;
+	Private* m_Priv;
+	
+	Loader(const Loader&);
+	Loader& operator=(const Loader&);
+};
+
+
+
+/* Loads a list of files through a bounded pipeline: one thread reads
+	ahead sequentially while a pool decodes, and the callback runs on the
+	calling thread in completion order (default) or input order. At most
+	readAhead files and byteBudget bytes of file data are in flight;
+	a single larger file still goes through on its own. The callback owns
+	result.file. */
+class BatchLoader
+{
+public:
+	typedef void (*Callback)(const Loader::Result& result, void* data);
+	
+	BatchLoader(unsigned int threads = 0);
+	~BatchLoader();
+	
+	void setReadAhead(unsigned int files);
+	void setByteBudget(uint64_t bytes);
+	void setInputOrder(bool inputOrder);
+	void setLoadOptions(const LoadOptions& options);
+	
+	void run(const std::vector<std::string>& files, Callback callback, void* data);
+	
+private:
+	struct Private;
+	friend class BatchReadTask;
+	friend class BatchDecodeTask;
+	Private* m_Priv;
+	
+	BatchLoader(const BatchLoader&);
+	BatchLoader& operator=(const BatchLoader&);
+};
+
+
+/* Persistent cache of decoded subimages. Entries are keyed by a hash of
+	the compressed payload and the target format, kept one raw file each
+	and mapped back with mmap(2). Least recently used entries are evicted
+	to stay within the size budget; the index survives restarts. */
+class DiskCache
+{
+public:
+	DiskCache(const std::string& dir, uint64_t budget);
+	~DiskCache();
+	
+	/* Decoded subimage, mapped copy-on-write. Release with unmap(). */
+	uint8_t* getImage(HiresImageResource* res, Format format, uint8_t mipmap,
+			uint16_t frame, uint16_t face, uint16_t slice, std::size_t& length);
+	static void unmap(uint8_t* data, std::size_t length);
+	
+	static uint64_t makeKey(const uint8_t* payload, Format srcFormat,
+			uint16_t width, uint16_t height, Format dstFormat);
+	uint8_t* find(uint64_t key, std::size_t& length);
+	bool store(uint64_t key, const uint8_t* data, std::size_t length);
+	/* The index is also written every few dozen stores and hits, and on
+		destruction. Writing merges with what other processes saved. */
+	void flush();
+	
+	uint64_t size() const;
+	uint64_t hits() const;
+	uint64_t misses() const;
+	
+private:
+	struct Private;
+	Private* m_Priv;
+	
+	DiskCache(const DiskCache&);
+	DiskCache& operator=(const DiskCache&);
 };
 
 
@@ -212,6 +662,75 @@ private:
 
 
 const char* formatToString (Format format);
+const char* statusToString (Status status);
+
+uint8_t calcMipmapCount (uint16_t width, uint16_t height);
+uint32_t getImageLength (Format format, uint16_t width, uint16_t height);
+uint8_t* encodeImage (Format format, const uint8_t* rgba, uint16_t width, uint16_t height,
+		bool dither = false, Quality quality = QualityCluster);
+uint32_t crc32 (const uint8_t* data, std::size_t length, uint32_t crc = 0);
+uint64_t hash64 (const uint8_t* data, std::size_t length, uint64_t seed = 0);
+
+void resample (const uint8_t* src, uint16_t srcWidth, uint16_t srcHeight,
+		uint8_t* dst, uint16_t dstWidth, uint16_t dstHeight, Filter filter);
+
+/* Converts an image between any two supported formats. Byte layouts are
+	swizzled directly and DXT is decoded straight into the target layout,
+	without an intermediate RGBA8888 copy. DXT to A8 decodes the alpha
+	plane alone, for masks and coverage. */
+bool convert (const uint8_t* src, Format srcFormat, uint8_t* dst, Format dstFormat,
+		uint16_t width, uint16_t height);
+/* RGBA8888 to any format. The 16 bit, luminance and A8 formats round
+	to nearest, or with DITHER through a 4x4 ordered dither. DXT formats
+	are encoded at QUALITY. */
+bool packRGBA (const uint8_t* rgba, Format format, uint8_t* dst, uint16_t width,
+		uint16_t height, bool dither = false, Quality quality = QualityCluster);
+/* Peak signal to noise ratio in dB between two RGBA8888 images, over RGB
+	or RGBA. Infinity if they are identical. */
+double psnr (const uint8_t* a, const uint8_t* b, uint32_t count, bool alpha = true);
+
+/* Compares two images of the same format and size 4x4 block by block.
+	DXT blocks are compared as stored and only the changed ones are
+	decoded to measure the error. False if the format is not supported. */
+bool diffImages (const uint8_t* a, const uint8_t* b, Format format, uint16_t width,
+		uint16_t height, BlockDiff& diff);
+
+/* Decodes a rectangle of an image to RGBA8888 rows ROWSTRIDE bytes apart.
+	For DXT formats only the 4x4 blocks intersecting it are decompressed.
+	False if the rectangle does not fit or the format is not supported. */
+bool decodeRegion (const uint8_t* data, Format format, uint16_t imageWidth,
+		uint16_t imageHeight, uint16_t x, uint16_t y, uint16_t width, uint16_t height,
+		uint8_t* dst, uint32_t rowstride);
+
+/* True if every pixel is known to be fully opaque: the format has no
+	alpha, or for DXT1 no block uses the transparent index. */
+bool isOpaque (const uint8_t* data, Format format, uint16_t width, uint16_t height);
+/* In place, for 4 byte layouts with alpha in the last byte */
+void premultiplyAlpha (uint8_t* data, uint32_t count);
+
+/* Exact statistics of one image. DXT is never decoded: each block's
+	palette is weighted by how many pixels use each entry. Coordinates in
+	STATS are left alone. False if the format is not supported. */
+bool computeStats (const uint8_t* data, Format format, uint16_t width, uint16_t height,
+		ImageStats& stats);
+void analyzeRGBA (const uint8_t* rgba, uint32_t count, ImageTraits& traits);
+/* Smallest DXT format that keeps what TRAITS say the images need: DXT1,
+	DXT1_1bitAlpha or DXT5. With LOSSLESS the pixels are kept exactly
+	instead, in I8 or IA88 for grey images and BGR888 or BGRA8888
+	otherwise; those are 2 to 6 times larger. The alpha flags in FLAGS are
+	updated to match. */
+Format chooseFormat (const ImageTraits& traits, uint32_t& flags, bool lossless = false);
+
+/* Normals as RGB8 (n * 0.5 + 0.5) or float3 in [-1, 1], decoded and
+	reconstructed in a single pass over the source. normalEncoding() only
+	guesses from the format: Source's DXT5 bump maps keep x, y, z in RGB
+	and a specular or env map mask in alpha, so DXT5 gives NormalRGB and
+	swizzled DXT5nm maps have to be asked for explicitly. */
+NormalEncoding normalEncoding (Format format);
+bool decodeNormals (const uint8_t* src, Format format, NormalEncoding encoding,
+		uint16_t width, uint16_t height, uint8_t* rgb);
+bool decodeNormals (const uint8_t* src, Format format, NormalEncoding encoding,
+		uint16_t width, uint16_t height, float* xyz);
 
 
 }